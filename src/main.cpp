@@ -3,20 +3,160 @@
  * @brief Main entry point for the PEBBL language interpreter
  */
 
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "ast_generator.hpp"
+#include "builtin_objects.hpp"
 #include "gc.hpp"
 #include "interpreter.hpp"
 #include "lexer.hpp"
 
-void run_code(const std::string& source, bool use_bytecode = false) {
+/**
+ * @brief Settings gathered from command-line flags
+ */
+struct RunOptions {
+  bool use_bytecode = false;       ///< Run on the bytecode VM instead of the tree-walker
+  bool use_registers = false;      ///< Compile for the VM's register instruction set
+  GCConfig gc_config;              ///< Heap sizing policy for every GCHeap created
+  std::string heap_snapshot_path;  ///< Where to write a heap snapshot at exit, if anywhere
+};
+
+/**
+ * @brief Parse a byte count with an optional K, M or G suffix (e.g. "512K", "64M")
+ * @return true if the whole string was a valid size
+ */
+bool parse_byte_size(const std::string& text, size_t& bytes) {
+  char* end = nullptr;
+  unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+  if (end == text.c_str()) {
+    return false;
+  }
+
+  std::string suffix(end);
+  if (suffix == "K" || suffix == "k") {
+    value *= 1024ULL;
+  } else if (suffix == "M" || suffix == "m") {
+    value *= 1024ULL * 1024;
+  } else if (suffix == "G" || suffix == "g") {
+    value *= 1024ULL * 1024 * 1024;
+  } else if (!suffix.empty()) {
+    return false;
+  }
+
+  bytes = static_cast<size_t>(value);
+  return true;
+}
+
+/**
+ * @brief Parse a heap growth factor, which must be greater than 1
+ * @return true if the whole string was a valid factor
+ */
+bool parse_growth_factor(const std::string& text, double& factor) {
+  char* end = nullptr;
+  double value = std::strtod(text.c_str(), &end);
+  if (end == text.c_str() || *end != '\0' || !(value > 1.0)) {
+    return false;
+  }
+
+  factor = value;
+  return true;
+}
+
+/**
+ * @brief Parse a positive count
+ * @return true if the whole string was a number greater than zero
+ */
+bool parse_positive_count(const std::string& text, size_t& count) {
+  char* end = nullptr;
+  unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+  if (end == text.c_str() || *end != '\0' || value == 0) {
+    return false;
+  }
+
+  count = static_cast<size_t>(value);
+  return true;
+}
+
+/**
+ * @brief Parse a sweep mode name: eager, lazy or background
+ * @return true if the name was recognized
+ */
+bool parse_sweep_mode(const std::string& text, GCConfig::SweepMode& mode) {
+  if (text == "eager") {
+    mode = GCConfig::SweepMode::EAGER;
+  } else if (text == "lazy") {
+    mode = GCConfig::SweepMode::LAZY;
+  } else if (text == "background") {
+    mode = GCConfig::SweepMode::BACKGROUND;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void print_usage(const char* program) {
+  std::cout << "Usage: " << program << " [options] [--dev test|--repl|filename]" << std::endl;
+  std::cout << "  --bytecode            : Use bytecode interpreter instead of tree-walker"
+            << std::endl;
+  std::cout << "  --registers           : Use the bytecode interpreter on register-based"
+            << " instructions instead of stack-based ones" << std::endl;
+  std::cout << "  --gc-min-heap=<size>  : Heap size before the first collection (default 1M)"
+            << std::endl;
+  std::cout << "  --gc-max-heap=<size>  : Fail with an out-of-memory error when a collection"
+            << " cannot bring the heap under <size> (default unlimited)" << std::endl;
+  std::cout << "  --gc-growth=<factor>  : Heap growth over live data between collections"
+            << " (default 2.0)" << std::endl;
+  std::cout << "  --gc-nursery=<size>   : Size of the young generation (default 256K)"
+            << std::endl;
+  std::cout << "  --gc-incremental      : Mark the old generation in slices between minor GCs"
+            << std::endl;
+  std::cout << "  --gc-slice=<objects>  : Objects traced per incremental marking slice"
+            << " (default 4096)" << std::endl;
+  std::cout << "  --gc-mark-threads=<n> : Threads used to mark the old generation (default 1)"
+            << std::endl;
+  std::cout << "  --gc-compact          : Move objects out of sparse pages after major GCs"
+            << std::endl;
+  std::cout << "  --gc-trace            : Print one line per garbage collection to stderr"
+            << std::endl;
+  std::cout << "  --gc-profile[=<size>] : Sample an allocation every <size> bytes on average"
+            << " (default 64K; 1 records all) and report them by source line at exit" << std::endl;
+  std::cout << "  --heap-snapshot=<path>: Write the graph of live objects to <path> at exit, for"
+            << " tools/heap_analyzer.py" << std::endl;
+  std::cout << "  --gc-sweep=<mode>     : Free garbage eagerly, lazily on allocation, or on a"
+            << " background thread (eager|lazy|background, default eager)" << std::endl;
+  std::cout << "  --dev test            : Run interpreter tests" << std::endl;
+  std::cout << "  --dev gc-bench        : Time marking and sweeping a million strings"
+            << std::endl;
+  std::cout << "  --repl                : Run interactive REPL" << std::endl;
+  std::cout << "  filename              : Execute a PEBBL source file" << std::endl;
+  std::cout << "  (no args)             : Start interactive REPL" << std::endl;
+}
+
+/**
+ * @brief Write the snapshot requested with --heap-snapshot, if any
+ */
+void write_heap_snapshot(GCHeap& heap, const RunOptions& options) {
+  if (options.heap_snapshot_path.empty()) {
+    return;
+  }
+  std::ofstream file(options.heap_snapshot_path);
+  if (!file.is_open()) {
+    std::cerr << "Error: Could not open '" << options.heap_snapshot_path << "'" << std::endl;
+    return;
+  }
+  heap.write_snapshot(file);
+}
+
+void run_code(const std::string& source, const RunOptions& options) {
   try {
     // Create GC heap
-    GCHeap heap;
+    GCHeap heap(options.gc_config);
 
     // Parse the source code
     Lexer lexer{std::string(source)};
@@ -29,7 +169,7 @@ void run_code(const std::string& source, bool use_bytecode = false) {
     }
 
     // Execute the program
-    Interpreter interpreter(heap, use_bytecode);
+    Interpreter interpreter(heap, options.use_bytecode, options.use_registers);
     auto result = interpreter.execute(*program);
 
     // Print result if it's not null
@@ -37,6 +177,8 @@ void run_code(const std::string& source, bool use_bytecode = false) {
       std::cout << interpreter.stringify(result) << std::endl;
     }
 
+    write_heap_snapshot(heap, options);
+
   } catch (const RuntimeError& e) {
     // Runtime errors are already printed by the interpreter
   } catch (const std::exception& e) {
@@ -44,7 +186,7 @@ void run_code(const std::string& source, bool use_bytecode = false) {
   }
 }
 
-void run_file(const std::string& filename, bool use_bytecode = false) {
+void run_file(const std::string& filename, const RunOptions& options) {
   std::ifstream file(filename);
   if (!file.is_open()) {
     std::cerr << "Error: Could not open file '" << filename << "'" << std::endl;
@@ -55,15 +197,15 @@ void run_file(const std::string& filename, bool use_bytecode = false) {
   buffer << file.rdbuf();
   std::string source = buffer.str();
 
-  run_code(source, use_bytecode);
+  run_code(source, options);
 }
 
-void run_repl() {
+void run_repl(const RunOptions& options) {
   std::cout << "PEBBL Interactive Interpreter" << std::endl;
   std::cout << "Type 'exit' to quit" << std::endl;
   std::cout << std::endl;
 
-  GCHeap heap;
+  GCHeap heap(options.gc_config);
   Interpreter interpreter(heap);
 
   std::string line;
@@ -98,10 +240,15 @@ void run_repl() {
       std::cerr << "Error: " << e.what() << std::endl;
     }
   }
+
+  write_heap_snapshot(heap, options);
 }
 
-void test_interpreter(bool use_bytecode = false) {
-  std::cout << "Testing PEBBL Interpreter (" << (use_bytecode ? "Bytecode" : "Tree-Walker")
+void test_interpreter(const RunOptions& options) {
+  std::cout << "Testing PEBBL Interpreter ("
+            << (options.use_registers  ? "Register Bytecode"
+                : options.use_bytecode ? "Bytecode"
+                                       : "Tree-Walker")
             << " Mode)" << std::endl;
   std::cout << "=========================" << std::endl;
 
@@ -117,68 +264,165 @@ void test_interpreter(bool use_bytecode = false) {
       "[1, 2, 3];",
       "{\"name\": \"Alice\", \"age\": 25};",
       "if true { 42 } else { 0 };",
-      "let a = 5; let b = 10; a + b;"};
+      "let a = 5; let b = 10; a + b;",
+      "func add(a, b) { a + b }; add(2, 3);",
+      "func factorial(n) { if n < 2 { 1 } else { n * factorial(n - 1) } }; factorial(10);",
+      "func fib(n) { if n < 2 { n } else { fib(n - 1) + fib(n - 2) } }; fib(15);",
+      "func counter() { var c = 0; func inc() { c = c + 1; c }; inc }; "
+      "let next = counter(); next(); next(); next();",
+      "func pair() { var v = 0; func get() { v }; func set(x) { v = x }; [get, set] }; "
+      "let p = pair(); let set = pop(p); let get = pop(p); set(7); get();",
+      "func capture_loop() { var fs = []; var i = 0; "
+      "while i < 3 { let j = i; func f() { j * 10 }; push(fs, f); i = i + 1; }; fs }; "
+      "let fs = capture_loop(); [pop(fs)(), pop(fs)(), pop(fs)()];",
+      "func outer(a) { func middle(b) { func inner(c) { a + b + c }; inner }; middle }; "
+      "outer(1)(2)(3);",
+      "let person = {\"name\": \"Alice\", \"age\": 25}; person;",
+      "var x = 1; x + (x = 5);",
+      "func assign_operand() { var y = 1; y + (y = 5) }; assign_operand();",
+      "func call_operand() { var z = 1; func bump() { z = 10; 0 }; z + bump() }; "
+      "call_operand();",
+      "func id(v) { v }; "
+      "func call_bases(a) { var c = 0; let b = id(a) + id(a + 1); c = id(b); "
+      "[b, c, id(id(c)), [id(1), id(2)]] }; call_bases(3);"};
 
   for (const auto& test : test_cases) {
     std::cout << ">>> " << test << std::endl;
     std::string test_copy = test;  // Make a copy to avoid const issues
-    run_code(test_copy, use_bytecode);
+    run_code(test_copy, options);
     std::cout << std::endl;
   }
 }
 
+/**
+ * @brief Time full collections over a heap of a million live strings, then a million dead ones
+ */
+void bench_gc(const RunOptions& options) {
+  constexpr size_t BATCHES = 1000;
+  constexpr size_t STRINGS_PER_BATCH = 1000;
+  using Clock = std::chrono::steady_clock;
+
+  GCHeap heap(options.gc_config);
+  GCObject* root = heap.allocate<PEBBLArray>();
+  RootHandle root_handle(heap, root);
+
+  // Strings go into batches of arrays so no single remembered array is rescanned too often
+  for (size_t batch = 0; batch < BATCHES; ++batch) {
+    PEBBLArray* strings = heap.allocate<PEBBLArray>();
+    static_cast<PEBBLArray*>(root)->push(heap, PEBBLObject::make_gc_ptr(strings));
+    for (size_t i = 0; i < STRINGS_PER_BATCH; ++i) {
+      PEBBLString* str = heap.allocate<PEBBLString>("string " + std::to_string(i));
+      auto* current = static_cast<PEBBLArray*>(
+          static_cast<PEBBLArray*>(root)->elements[batch].as_gc_ptr());
+      current->push(heap, PEBBLObject::make_gc_ptr(str));
+    }
+  }
+  heap.collect();
+
+  auto report = [](const char* phase, Clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << phase << ": " << seconds * 1000.0 << " ms ("
+              << static_cast<double>(BATCHES * STRINGS_PER_BATCH) / seconds / 1e6
+              << "M strings/s)" << std::endl;
+  };
+
+  Clock::time_point start = Clock::now();
+  heap.collect();
+  report("mark 1M live strings", Clock::now() - start);
+
+  static_cast<PEBBLArray*>(root)->elements.clear();
+  start = Clock::now();
+  heap.collect();
+  report("sweep 1M dead strings", Clock::now() - start);
+}
+
 int main(int argc, char* argv[]) {
-  bool use_bytecode = false;
+  RunOptions options;
+  std::vector<std::string> args;
 
-  // Check for --bytecode flag
+  // Pull option flags out, leaving the positional arguments in order
   for (int i = 1; i < argc; ++i) {
     std::string arg = argv[i];
     if (arg == "--bytecode") {
-      use_bytecode = true;
-      // Remove the --bytecode flag from arguments
-      for (int j = i; j < argc - 1; ++j) {
-        argv[j] = argv[j + 1];
+      options.use_bytecode = true;
+    } else if (arg == "--registers") {
+      options.use_bytecode = true;
+      options.use_registers = true;
+    } else if (arg.rfind("--gc-min-heap=", 0) == 0) {
+      if (!parse_byte_size(arg.substr(14), options.gc_config.min_heap_bytes)) {
+        std::cerr << "Error: Invalid heap size '" << arg.substr(14) << "'" << std::endl;
+        return 1;
       }
-      argc--;
-      break;
+    } else if (arg.rfind("--gc-max-heap=", 0) == 0) {
+      if (!parse_byte_size(arg.substr(14), options.gc_config.max_heap_bytes)) {
+        std::cerr << "Error: Invalid heap size '" << arg.substr(14) << "'" << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--gc-nursery=", 0) == 0) {
+      if (!parse_byte_size(arg.substr(13), options.gc_config.nursery_bytes)) {
+        std::cerr << "Error: Invalid nursery size '" << arg.substr(13) << "'" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--gc-incremental") {
+      options.gc_config.incremental = true;
+    } else if (arg.rfind("--gc-slice=", 0) == 0) {
+      if (!parse_positive_count(arg.substr(11), options.gc_config.mark_slice_objects)) {
+        std::cerr << "Error: Invalid marking slice '" << arg.substr(11) << "'" << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--gc-mark-threads=", 0) == 0) {
+      if (!parse_positive_count(arg.substr(18), options.gc_config.mark_threads)) {
+        std::cerr << "Error: Invalid mark thread count '" << arg.substr(18) << "'" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--gc-compact") {
+      options.gc_config.compact = true;
+    } else if (arg == "--gc-trace") {
+      options.gc_config.trace = true;
+    } else if (arg.rfind("--heap-snapshot=", 0) == 0) {
+      options.heap_snapshot_path = arg.substr(16);
+    } else if (arg == "--gc-profile") {
+      options.gc_config.profile_sample_bytes = 64 * 1024;
+    } else if (arg.rfind("--gc-profile=", 0) == 0) {
+      if (!parse_byte_size(arg.substr(13), options.gc_config.profile_sample_bytes) ||
+          options.gc_config.profile_sample_bytes == 0) {
+        std::cerr << "Error: Invalid sample interval '" << arg.substr(13) << "'" << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--gc-sweep=", 0) == 0) {
+      if (!parse_sweep_mode(arg.substr(11), options.gc_config.sweep_mode)) {
+        std::cerr << "Error: Unknown sweep mode '" << arg.substr(11) << "'" << std::endl;
+        return 1;
+      }
+    } else if (arg.rfind("--gc-growth=", 0) == 0) {
+      if (!parse_growth_factor(arg.substr(12), options.gc_config.growth_factor)) {
+        std::cerr << "Error: Growth factor must be a number greater than 1, got '"
+                  << arg.substr(12) << "'" << std::endl;
+        return 1;
+      }
+    } else {
+      args.push_back(arg);
     }
   }
 
-  if (argc == 1) {
+  if (args.empty()) {
     // No arguments - run REPL
-    run_repl();
-  } else if (argc == 2) {
-    std::string arg = argv[1];
-    if (arg == "--repl") {
-      run_repl();
+    run_repl(options);
+  } else if (args.size() == 1) {
+    if (args[0] == "--repl") {
+      run_repl(options);
     } else {
       // Assume it's a filename
-      run_file(arg, use_bytecode);
-    }
-  } else if (argc == 3) {
-    std::string arg1 = argv[1];
-    std::string arg2 = argv[2];
-    if (arg1 == "--dev" && arg2 == "test") {
-      test_interpreter(use_bytecode);
-    } else {
-      std::cout << "Usage: " << argv[0] << " [--bytecode] [--dev test|--repl|filename]"
-                << std::endl;
-      std::cout << "  --bytecode : Use bytecode interpreter instead of tree-walker" << std::endl;
-      std::cout << "  --dev test : Run interpreter tests" << std::endl;
-      std::cout << "  --repl     : Run interactive REPL" << std::endl;
-      std::cout << "  filename   : Execute a PEBBL source file" << std::endl;
-      std::cout << "  (no args)  : Start interactive REPL" << std::endl;
-      return 1;
+      run_file(args[0], options);
     }
+  } else if (args.size() == 2 && args[0] == "--dev" && args[1] == "test") {
+    test_interpreter(options);
+  } else if (args.size() == 2 && args[0] == "--dev" && args[1] == "gc-bench") {
+    bench_gc(options);
   } else {
-    std::cout << "Usage: " << argv[0] << " [--bytecode] [--dev test|--repl|filename]" << std::endl;
-    std::cout << "  --bytecode : Use bytecode interpreter instead of tree-walker" << std::endl;
-    std::cout << "  --dev test : Run interpreter tests" << std::endl;
-    std::cout << "  --repl     : Run interactive REPL" << std::endl;
-    std::cout << "  filename   : Execute a PEBBL source file" << std::endl;
-    std::cout << "  (no args)  : Start interactive REPL" << std::endl;
+    print_usage(argv[0]);
     return 1;
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,78 @@
+/**
+ * @file alloc_profiler.cpp
+ * @brief Implementation of the sampling allocation profiler
+ */
+
+#include "alloc_profiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <vector>
+
+#include "gc.hpp"
+
+AllocationProfiler::AllocationProfiler(size_t sample_bytes) :
+    sample_bytes_(std::max<size_t>(sample_bytes, 1)), site_(0), sample_count_(0) {
+}
+
+size_t AllocationProfiler::next_sample_distance() {
+  if (sample_bytes_ == 1) {
+    return 1;
+  }
+  std::exponential_distribution<double> distance(1.0 / static_cast<double>(sample_bytes_));
+  return static_cast<size_t>(distance(random_)) + 1;
+}
+
+void AllocationProfiler::record(GCTag tag, size_t bytes) {
+  // An allocation of this size is sampled with probability 1 - e^(-bytes / sample_bytes_)
+  double weight = 1.0;
+  if (sample_bytes_ > 1) {
+    weight = 1.0 / -std::expm1(-static_cast<double>(bytes) / static_cast<double>(sample_bytes_));
+  }
+
+  SiteTotals& totals = sites_[site_key(site_, tag)];
+  totals.objects += weight;
+  totals.bytes += weight * static_cast<double>(bytes);
+  totals.samples++;
+  sample_count_++;
+}
+
+void AllocationProfiler::report(std::ostream& out) const {
+  std::vector<std::pair<uint64_t, SiteTotals>> sites(sites_.begin(), sites_.end());
+  std::sort(sites.begin(), sites.end(), [](const auto& a, const auto& b) {
+    if (a.second.bytes != b.second.bytes) {
+      return a.second.bytes > b.second.bytes;
+    }
+    return a.first < b.first;
+  });
+
+  double total_bytes = 0;
+  for (const auto& [key, totals] : sites) {
+    total_bytes += totals.bytes;
+  }
+
+  // Format the whole report first so output from other threads can't split it
+  std::ostringstream text;
+  text << "allocation profile: " << sample_count_ << " samples, one per " << sample_bytes_
+       << " bytes on average\n";
+  text << std::setw(14) << "bytes" << std::setw(12) << "objects" << std::setw(8) << "share"
+       << "  site\n";
+  text.setf(std::ios::fixed);
+  for (const auto& [key, totals] : sites) {
+    auto line = static_cast<uint32_t>(key >> 8);
+    auto tag = static_cast<GCTag>(key & 0xff);
+    text << std::setw(14) << std::setprecision(0) << totals.bytes << std::setw(12)
+         << totals.objects << std::setw(7) << std::setprecision(1)
+         << 100.0 * totals.bytes / total_bytes << "%  ";
+    if (line == 0) {
+      text << "(runtime)";
+    } else {
+      text << "line " << line;
+    }
+    text << " " << gc_tag_name(tag) << "\n";
+  }
+  out << text.str();
+}
@@ -0,0 +1,81 @@
+/**
+ * @file alloc_profiler.hpp
+ * @brief Sampling profiler attributing heap allocations to source lines
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <random>
+#include <unordered_map>
+
+enum class GCTag : uint8_t;
+
+/**
+ * @brief Statistical record of which source lines allocate on the heap
+ *
+ * The heap takes a sample whenever the bytes allocated since the previous one exceed a random
+ * distance with a mean of sample_bytes, as tcmalloc's heap profiler does: every byte is equally
+ * likely to be sampled, and each sample is scaled up by the inverse of its probability into an
+ * unbiased estimate of the allocations it stands for. A mean of one byte records everything.
+ *
+ * Samples are attributed to the site the running engine last reported through
+ * GCHeap::set_allocation_site, the source line of the expression or instruction being
+ * executed. Line 0 holds allocations made outside the program, such as the builtins created at
+ * start-up.
+ */
+class AllocationProfiler {
+public:
+  /**
+   * @param sample_bytes Mean number of bytes allocated between samples
+   */
+  explicit AllocationProfiler(size_t sample_bytes);
+
+  /**
+   * @brief Set the source line later samples are attributed to
+   */
+  void set_site(uint32_t line) {
+    site_ = line;
+  }
+
+  /**
+   * @brief Draw the number of bytes to allocate before the next sample
+   */
+  size_t next_sample_distance();
+
+  /**
+   * @brief Record a sampled allocation at the current site
+   * @param bytes Size of the object including its payload
+   */
+  void record(GCTag tag, size_t bytes);
+
+  /**
+   * @brief Print the estimated allocations of every site, largest first
+   */
+  void report(std::ostream& out) const;
+
+private:
+  /**
+   * @brief Estimated allocations of one object type at one line
+   */
+  struct SiteTotals {
+    double objects = 0;  ///< Estimated number of objects
+    double bytes = 0;    ///< Estimated bytes, payloads included
+    size_t samples = 0;  ///< Samples the estimates are based on
+  };
+
+  /**
+   * @brief Key of the sites_ entry for a line and object type
+   */
+  static uint64_t site_key(uint32_t line, GCTag tag) {
+    return (static_cast<uint64_t>(line) << 8) | static_cast<uint8_t>(tag);
+  }
+
+  size_t sample_bytes_;                             ///< Mean distance between samples
+  uint32_t site_;                                   ///< Line allocations are attributed to
+  size_t sample_count_;                             ///< Samples taken so far
+  std::mt19937_64 random_;                          ///< Source of sample distances
+  std::unordered_map<uint64_t, SiteTotals> sites_;  ///< Estimates by site_key
+};
@@ -5,12 +5,15 @@
 
 #pragma once
 
+#include <cstdint>
+#include <fstream>
 #include <iostream>
+#include <span>
 #include <string>
-#include <vector>
 
-#include "../evaluator/interpreter.hpp"
 #include "builtin_objects.hpp"
+#include "gc.hpp"
+#include "runtime_context.hpp"
 
 /**
  * @brief Namespace containing all builtin function implementations
@@ -19,14 +22,14 @@ namespace BuiltinFunctions {
 
 /**
  * @brief Print function - prints arguments and returns null
- * @param args Vector of arguments to print
- * @param interp Reference to interpreter for stringify calls
+ * @param args Arguments to print
+ * @param context Runtime context for stringify calls
  * @return PEBBLObject null value
  */
-inline PEBBLObject print_impl(const std::vector<PEBBLObject>& args, Interpreter& interp) {
+inline PEBBLObject print_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
   for (size_t i = 0; i < args.size(); ++i) {
     if (i > 0) std::cout << " ";
-    std::cout << interp.stringify(args[i]);
+    std::cout << context.stringify(args[i]);
   }
   std::cout << std::endl;
   return PEBBLObject::make_null();
@@ -34,13 +37,13 @@ inline PEBBLObject print_impl(const std::vector<PEBBLObject>& args, Interpreter&
 
 /**
  * @brief Length function - returns length of strings, arrays, or dicts
- * @param args Vector containing exactly one argument
- * @param interp Reference to interpreter for error reporting
+ * @param args Span containing exactly one argument
+ * @param context Runtime context for error reporting
  * @return PEBBLObject containing length as int32
  */
-inline PEBBLObject length_impl(const std::vector<PEBBLObject>& args, Interpreter& interp) {
+inline PEBBLObject length_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
   if (args.size() != 1) {
-    interp.report_error("length() expects exactly 1 argument, got " + std::to_string(args.size()));
+    context.report_error("length() expects exactly 1 argument, got " + std::to_string(args.size()));
     return PEBBLObject::make_null();
   }
 
@@ -64,19 +67,19 @@ inline PEBBLObject length_impl(const std::vector<PEBBLObject>& args, Interpreter
         break;
     }
   }
-  interp.report_error("length() can only be called on strings, arrays, or dictionaries");
+  context.report_error("length() can only be called on strings, arrays, or dictionaries");
   return PEBBLObject::make_null();
 }
 
 /**
  * @brief Type function - returns the type of an object as a string
- * @param args Vector containing exactly one argument
- * @param interp Reference to interpreter for heap allocation
+ * @param args Span containing exactly one argument
+ * @param context Runtime context for heap allocation
  * @return PEBBLObject containing type name as string
  */
-inline PEBBLObject type_impl(const std::vector<PEBBLObject>& args, Interpreter& interp) {
+inline PEBBLObject type_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
   if (args.size() != 1) {
-    interp.report_error("type() expects exactly 1 argument, got " + std::to_string(args.size()));
+    context.report_error("type() expects exactly 1 argument, got " + std::to_string(args.size()));
     return PEBBLObject::make_null();
   }
 
@@ -104,6 +107,7 @@ inline PEBBLObject type_impl(const std::vector<PEBBLObject>& args, Interpreter&
         type_name = "dict";
         break;
       case GCTag::FUNCTION:
+      case GCTag::CLOSURE:
         type_name = "function";
         break;
       case GCTag::BUILTIN_FUNCTION:
@@ -117,36 +121,36 @@ inline PEBBLObject type_impl(const std::vector<PEBBLObject>& args, Interpreter&
     type_name = "unknown";
   }
 
-  auto* str_obj = interp.get_heap().allocate<PEBBLString>(type_name);
+  auto* str_obj = context.get_heap().allocate<PEBBLString>(type_name);
   return PEBBLObject::make_gc_ptr(str_obj);
 }
 
 /**
  * @brief String conversion function - converts values to strings
- * @param args Vector containing exactly one argument
- * @param interp Reference to interpreter for stringify and heap allocation
+ * @param args Span containing exactly one argument
+ * @param context Runtime context for stringify and heap allocation
  * @return PEBBLObject containing string representation
  */
-inline PEBBLObject str_impl(const std::vector<PEBBLObject>& args, Interpreter& interp) {
+inline PEBBLObject str_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
   if (args.size() != 1) {
-    interp.report_error("str() expects exactly 1 argument, got " + std::to_string(args.size()));
+    context.report_error("str() expects exactly 1 argument, got " + std::to_string(args.size()));
     return PEBBLObject::make_null();
   }
 
-  std::string str_value = interp.stringify(args[0]);
-  auto* str_obj = interp.get_heap().allocate<PEBBLString>(str_value);
+  std::string str_value = context.stringify(args[0]);
+  auto* str_obj = context.get_heap().allocate<PEBBLString>(str_value);
   return PEBBLObject::make_gc_ptr(str_obj);
 }
 
 /**
  * @brief Push function - adds element to array
- * @param args Vector containing array and value to add
- * @param interp Reference to interpreter for error reporting
+ * @param args Span containing array and value to add
+ * @param context Runtime context for error reporting
  * @return PEBBLObject null value
  */
-inline PEBBLObject push_impl(const std::vector<PEBBLObject>& args, Interpreter& interp) {
+inline PEBBLObject push_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
   if (args.size() != 2) {
-    interp.report_error("push() expects exactly 2 arguments, got " + std::to_string(args.size()));
+    context.report_error("push() expects exactly 2 arguments, got " + std::to_string(args.size()));
     return PEBBLObject::make_null();
   }
 
@@ -154,43 +158,43 @@ inline PEBBLObject push_impl(const std::vector<PEBBLObject>& args, Interpreter&
   const auto& value = args[1];
 
   if (!array_obj.is_gc_ptr()) {
-    interp.report_error("push() first argument must be an array");
+    context.report_error("push() first argument must be an array");
     return PEBBLObject::make_null();
   }
 
   auto* gc_obj = array_obj.as_gc_ptr();
   if (gc_obj->tag != GCTag::ARRAY) {
-    interp.report_error("push() first argument must be an array");
+    context.report_error("push() first argument must be an array");
     return PEBBLObject::make_null();
   }
 
   auto* array = static_cast<PEBBLArray*>(gc_obj);
-  array->push(value);
+  array->push(context.get_heap(), value);
   return PEBBLObject::make_null();
 }
 
 /**
  * @brief Pop function - removes and returns last element from array
- * @param args Vector containing exactly one array argument
- * @param interp Reference to interpreter for error reporting
+ * @param args Span containing exactly one array argument
+ * @param context Runtime context for error reporting
  * @return PEBBLObject containing popped value or null
  */
-inline PEBBLObject pop_impl(const std::vector<PEBBLObject>& args, Interpreter& interp) {
+inline PEBBLObject pop_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
   if (args.size() != 1) {
-    interp.report_error("pop() expects exactly 1 argument, got " + std::to_string(args.size()));
+    context.report_error("pop() expects exactly 1 argument, got " + std::to_string(args.size()));
     return PEBBLObject::make_null();
   }
 
   const auto& array_obj = args[0];
 
   if (!array_obj.is_gc_ptr()) {
-    interp.report_error("pop() argument must be an array");
+    context.report_error("pop() argument must be an array");
     return PEBBLObject::make_null();
   }
 
   auto* gc_obj = array_obj.as_gc_ptr();
   if (gc_obj->tag != GCTag::ARRAY) {
-    interp.report_error("pop() argument must be an array");
+    context.report_error("pop() argument must be an array");
     return PEBBLObject::make_null();
   }
 
@@ -198,4 +202,109 @@ inline PEBBLObject pop_impl(const std::vector<PEBBLObject>& args, Interpreter& i
   return array->pop();
 }
 
+/**
+ * @brief Wrap a count as an integer, or a float once it no longer fits in one
+ */
+inline PEBBLObject count_value(size_t count) {
+  if (count <= static_cast<size_t>(INT32_MAX)) {
+    return PEBBLObject::make_int32(static_cast<int32_t>(count));
+  }
+  return PEBBLObject::make_double(static_cast<double>(count));
+}
+
+/**
+ * @brief GC statistics function - reports what the collector has done so far
+ * @param args Empty span
+ * @param context Runtime context for heap access and allocation
+ * @return PEBBLObject containing a dict of collection counts, pause times in milliseconds,
+ *         reclaimed totals, the last collection, and live objects per type
+ */
+inline PEBBLObject gc_stats_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
+  if (!args.empty()) {
+    context.report_error("gc_stats() expects no arguments, got " + std::to_string(args.size()));
+    return PEBBLObject::make_null();
+  }
+
+  GCHeap& heap = context.get_heap();
+  // Copied up front: the allocations below may run collections that update the totals
+  GCStats stats = heap.stats();
+
+  // Each allocation may move the dicts allocated before it, so they are reached through roots
+  GCObject* result = heap.allocate<PEBBLDict>();
+  RootHandle result_root(heap, result);
+  GCObject* histogram = heap.allocate<PEBBLArray>();
+  RootHandle histogram_root(heap, histogram);
+  GCObject* live = heap.allocate<PEBBLDict>();
+  RootHandle live_root(heap, live);
+  GCObject* kind = heap.allocate<PEBBLString>(stats.last.kind_name());
+  RootHandle kind_root(heap, kind);
+  GCObject* last = heap.allocate<PEBBLDict>();
+
+  auto* dict = static_cast<PEBBLDict*>(result);
+  dict->set(heap, "minor_collections", count_value(stats.minor_collections));
+  dict->set(heap, "major_collections", count_value(stats.major_collections));
+  dict->set(heap, "total_pause_ms", PEBBLObject::make_double(stats.total_pause_ms));
+  dict->set(heap, "max_pause_ms", PEBBLObject::make_double(stats.max_pause_ms));
+  dict->set(heap, "objects_freed", count_value(stats.objects_freed));
+  dict->set(heap, "bytes_freed", count_value(stats.bytes_freed));
+  dict->set(heap, "heap_bytes", count_value(heap.heap_bytes()));
+  dict->set(heap, "large_bytes", count_value(heap.large_bytes_allocated()));
+
+  // Bucket i counts pauses under 0.125 * 2^i ms; the last one counts all longer pauses
+  for (size_t count : stats.pause_histogram) {
+    static_cast<PEBBLArray*>(histogram)->push(heap, count_value(count));
+  }
+  dict->set(heap, "pause_histogram", PEBBLObject::make_gc_ptr(histogram));
+
+  for (size_t tag = 0; tag < GC_TAG_COUNT; ++tag) {
+    static_cast<PEBBLDict*>(live)->set(heap, gc_tag_name(static_cast<GCTag>(tag)),
+                                       count_value(stats.live_objects[tag]));
+  }
+  dict->set(heap, "live_objects", PEBBLObject::make_gc_ptr(live));
+
+  auto* last_dict = static_cast<PEBBLDict*>(last);
+  const GCCollectionStats& collection = stats.last;
+  last_dict->set(heap, "kind", PEBBLObject::make_gc_ptr(kind));
+  last_dict->set(heap, "pause_ms", PEBBLObject::make_double(collection.pause_ms));
+  last_dict->set(heap, "heap_bytes_before", count_value(collection.heap_bytes_before));
+  last_dict->set(heap, "heap_bytes_after", count_value(collection.heap_bytes_after));
+  last_dict->set(heap, "objects_survived", count_value(collection.objects_survived));
+  last_dict->set(heap, "bytes_survived", count_value(collection.bytes_survived));
+  last_dict->set(heap, "objects_freed", count_value(collection.objects_freed));
+  last_dict->set(heap, "bytes_freed", count_value(collection.bytes_freed));
+  dict->set(heap, "last_collection", PEBBLObject::make_gc_ptr(last));
+
+  return PEBBLObject::make_gc_ptr(result);
+}
+
+/**
+ * @brief Heap snapshot function - writes the graph of live objects to a file
+ * @param args Span containing the path to write to
+ * @param context Runtime context for heap access and error reporting
+ * @return PEBBLObject containing the number of nodes written
+ *
+ * The file is the JSON described by HeapSnapshot, readable by tools/heap_analyzer.py.
+ */
+inline PEBBLObject heap_snapshot_impl(std::span<const PEBBLObject> args, RuntimeContext& context) {
+  if (args.size() != 1) {
+    context.report_error("heap_snapshot() expects exactly 1 argument, got " +
+                         std::to_string(args.size()));
+    return PEBBLObject::make_null();
+  }
+
+  const auto& path = args[0];
+  if (!path.is_gc_ptr() || path.as_gc_ptr()->tag != GCTag::STRING) {
+    context.report_error("heap_snapshot() argument must be a string");
+    return PEBBLObject::make_null();
+  }
+
+  const std::string& filename = static_cast<PEBBLString*>(path.as_gc_ptr())->value;
+  std::ofstream file(filename);
+  if (!file.is_open()) {
+    context.report_error("heap_snapshot() could not open '" + filename + "'");
+    return PEBBLObject::make_null();
+  }
+  return count_value(context.get_heap().write_snapshot(file));
+}
+
 }  // namespace BuiltinFunctions
\ No newline at end of file
@@ -5,16 +5,34 @@
 
 #pragma once
 
-#include <functional>
+#include <memory>
+#include <span>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "bytecode.hpp"
+#include "environment.hpp"
 #include "gc.hpp"
 #include "object.hpp"
 
 // Forward declaration to avoid circular includes
-class Interpreter;
+class RuntimeContext;
+
+/**
+ * @brief Heap bytes behind a std::string, zero while it fits in the inline buffer
+ */
+inline std::size_t string_payload_size(const std::string& str) {
+  return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+/**
+ * @brief Heap bytes behind a std::vector's element storage
+ */
+template <typename T, typename Allocator>
+std::size_t vector_payload_size(const std::vector<T, Allocator>& vec) {
+  return vec.capacity() * sizeof(T);
+}
 
 /**
  * @brief Garbage-collected string object
@@ -29,10 +47,18 @@ public:
   explicit PEBBLString(std::string&& str) : GCObject(GCTag::STRING), value(std::move(str)) {
   }
 
-  void trace(Tracer& /* tracer */) override {
+  void trace(Tracer& /* tracer */) {
     // Strings contain no GC references
   }
 
+  GCObject* relocate(void* cell) {
+    return new (cell) PEBBLString(std::move(*this));
+  }
+
+  std::size_t payload_size() const {
+    return string_payload_size(value);
+  }
+
   std::size_t length() const {
     return value.length();
   }
@@ -40,23 +66,40 @@ public:
 
 /**
  * @brief Garbage-collected array object
+ *
+ * Element storage big enough to count as a large payload lives in the LargeObjectSpace.
  */
 class PEBBLArray : public GCObject {
 public:
-  std::vector<PEBBLObject> elements;
+  std::vector<PEBBLObject, PayloadAllocator<PEBBLObject>> elements;
 
-  explicit PEBBLArray(std::vector<PEBBLObject> elems = {}) :
-      GCObject(GCTag::ARRAY), elements(std::move(elems)) {
+  PEBBLArray() : GCObject(GCTag::ARRAY) {
   }
 
-  void trace(Tracer& tracer) override {
-    for (const auto& element : elements) {
-      if (element.is_gc_ptr()) {
-        tracer.mark(element.as_gc_ptr());
-      }
+  /**
+   * @brief Build an array from values held in traced storage (e.g. the VM stack)
+   *
+   * The values are read only once the object is being constructed, after any
+   * collection the allocation triggered has updated them.
+   */
+  explicit PEBBLArray(std::span<const PEBBLObject> values) :
+      GCObject(GCTag::ARRAY), elements(values.begin(), values.end()) {
+  }
+
+  void trace(Tracer& tracer) {
+    for (auto& element : elements) {
+      tracer.visit(element);
     }
   }
 
+  GCObject* relocate(void* cell) {
+    return new (cell) PEBBLArray(std::move(*this));
+  }
+
+  std::size_t payload_size() const {
+    return vector_payload_size(elements);
+  }
+
   std::size_t length() const {
     return elements.size();
   }
@@ -68,15 +111,23 @@ public:
     return elements[index];
   }
 
-  void set(std::size_t index, PEBBLObject value) {
+  void set(GCHeap& heap, std::size_t index, PEBBLObject value) {
+    std::size_t old_capacity = elements.capacity();
     if (index >= elements.size()) {
       elements.resize(index + 1, PEBBLObject::make_null());
     }
     elements[index] = value;
+    heap.write_barrier(this, value);
+    heap.account_payload_growth(this, (elements.capacity() - old_capacity) * sizeof(PEBBLObject),
+                                GCHeap::is_large_payload(payload_size()));
   }
 
-  void push(PEBBLObject value) {
+  void push(GCHeap& heap, PEBBLObject value) {
+    std::size_t old_capacity = elements.capacity();
     elements.push_back(value);
+    heap.write_barrier(this, value);
+    heap.account_payload_growth(this, (elements.capacity() - old_capacity) * sizeof(PEBBLObject),
+                                GCHeap::is_large_payload(payload_size()));
   }
 
   PEBBLObject pop() {
@@ -100,12 +151,35 @@ public:
       GCObject(GCTag::DICT), entries(std::move(ents)) {
   }
 
-  void trace(Tracer& tracer) override {
+  /**
+   * @brief Build a dict from alternating key/value pairs held in traced storage
+   *
+   * Every key must be a string object. Like the array constructor, the pairs
+   * are read only after any collection the allocation triggered.
+   */
+  explicit PEBBLDict(std::span<const PEBBLObject> pairs) : GCObject(GCTag::DICT) {
+    for (std::size_t i = 0; i + 1 < pairs.size(); i += 2) {
+      entries[static_cast<PEBBLString*>(pairs[i].as_gc_ptr())->value] = pairs[i + 1];
+    }
+  }
+
+  void trace(Tracer& tracer) {
+    for (auto& [key, value] : entries) {
+      tracer.visit(value);
+    }
+  }
+
+  GCObject* relocate(void* cell) {
+    return new (cell) PEBBLDict(std::move(*this));
+  }
+
+  std::size_t payload_size() const {
+    // Bucket array plus one node per entry
+    std::size_t bytes = entries.bucket_count() * sizeof(void*);
     for (const auto& [key, value] : entries) {
-      if (value.is_gc_ptr()) {
-        tracer.mark(value.as_gc_ptr());
-      }
+      bytes += node_size(key);
     }
+    return bytes;
   }
 
   std::size_t size() const {
@@ -120,8 +194,14 @@ public:
     return it->second;
   }
 
-  void set(const std::string& key, PEBBLObject value) {
-    entries[key] = value;
+  void set(GCHeap& heap, const std::string& key, PEBBLObject value) {
+    std::size_t old_buckets = entries.bucket_count();
+    bool inserted = entries.insert_or_assign(key, value).second;
+    heap.write_barrier(this, value);
+    if (inserted) {
+      heap.account_payload_growth(
+          this, node_size(key) + (entries.bucket_count() - old_buckets) * sizeof(void*));
+    }
   }
 
   bool has_key(const std::string& key) const {
@@ -140,30 +220,78 @@ public:
     }
     return result;
   }
+
+private:
+  /**
+   * @brief Estimated heap bytes of one entry: key, value and next pointer
+   */
+  static std::size_t node_size(const std::string& key) {
+    return sizeof(void*) + sizeof(std::pair<const std::string, PEBBLObject>) +
+           string_payload_size(key);
+  }
 };
 
 /**
  * @brief Garbage-collected function object
+ *
+ * Tree-walker functions carry their closure environment and AST body; functions compiled for the
+ * VM carry a bytecode chunk instead.
  */
 class PEBBLFunction : public GCObject {
 public:
   std::string name;
   std::vector<std::string> parameters;
-  std::shared_ptr<class Environment> closure;
+  std::shared_ptr<Environment> closure;
   const class BlockStatementNode* body;
+  std::unique_ptr<Chunk> chunk;      // Compiled body, null for tree-walker functions
+  std::vector<UpvalueInfo> upvalues;  // Variables a compiled body captures from enclosing scopes
 
   PEBBLFunction(
       const std::string& func_name,
       std::vector<std::string> params,
-      std::shared_ptr<class Environment> env,
+      std::shared_ptr<Environment> env,
       const class BlockStatementNode* func_body) :
       GCObject(GCTag::FUNCTION), name(func_name), parameters(std::move(params)), closure(env),
       body(func_body) {
   }
 
-  void trace(Tracer& /* tracer */) override {
-    // The closure environment is shared_ptr managed
-    // The body is owned by the AST, not us
+  PEBBLFunction(
+      const std::string& func_name, std::vector<std::string> params, std::unique_ptr<Chunk> code) :
+      GCObject(GCTag::FUNCTION), name(func_name), parameters(std::move(params)), closure(nullptr),
+      body(nullptr), chunk(std::move(code)) {
+  }
+
+  void trace(Tracer& tracer) {
+    // The closure environment is shared_ptr managed, but the values captured in it are
+    // reachable through us. The body is owned by the AST, not us
+    if (closure) {
+      closure->trace_chain(tracer);
+    }
+    // A compiled body keeps its constants (strings, nested functions) alive
+    if (chunk) {
+      for (auto& constant : chunk->constants) {
+        tracer.visit(constant);
+      }
+    }
+  }
+
+  GCObject* relocate(void* cell) {
+    return new (cell) PEBBLFunction(std::move(*this));
+  }
+
+  std::size_t payload_size() const {
+    std::size_t bytes = string_payload_size(name) + vector_payload_size(parameters) +
+                        vector_payload_size(upvalues);
+    for (const auto& parameter : parameters) {
+      bytes += string_payload_size(parameter);
+    }
+    if (chunk) {
+      bytes += sizeof(Chunk) + vector_payload_size(chunk->instructions) +
+               vector_payload_size(chunk->code) + vector_payload_size(chunk->instruction_offsets) +
+               vector_payload_size(chunk->register_code) + vector_payload_size(chunk->constants) +
+               vector_payload_size(chunk->variable_names);
+    }
+    return bytes;
   }
 
   std::size_t arity() const {
@@ -171,12 +299,76 @@ public:
   }
 };
 
+/**
+ * @brief Captured variable of a VM closure
+ *
+ * While the captured local is still live on the VM stack the upvalue is open and points at its
+ * stack slot; when the slot goes out of scope the value is moved into the upvalue itself.
+ */
+class PEBBLUpvalue : public GCObject {
+public:
+  PEBBLObject* location;    // Stack slot while open, &closed once closed
+  PEBBLObject closed;       // Holds the value after closing
+  PEBBLUpvalue* next_open;  // Next open upvalue, ordered by descending stack slot
+
+  explicit PEBBLUpvalue(PEBBLObject* slot) :
+      GCObject(GCTag::UPVALUE), location(slot), closed(PEBBLObject::make_null()),
+      next_open(nullptr) {
+  }
+
+  // A closed upvalue points at its own value, so moving it must retarget location
+  PEBBLUpvalue(PEBBLUpvalue&& other) noexcept :
+      GCObject(other), location(other.location == &other.closed ? &closed : other.location),
+      closed(other.closed), next_open(other.next_open) {
+  }
+
+  void trace(Tracer& tracer) {
+    // An open upvalue's value lives on the VM stack, which also traces the open list
+    tracer.visit(closed);
+  }
+
+  GCObject* relocate(void* cell) {
+    return new (cell) PEBBLUpvalue(std::move(*this));
+  }
+};
+
+/**
+ * @brief Compiled function paired with the variables it captured
+ */
+class PEBBLClosure : public GCObject {
+public:
+  PEBBLFunction* function;
+  std::vector<PEBBLUpvalue*> upvalues;
+
+  // The function is stored after allocation, which may move it
+  PEBBLClosure() : GCObject(GCTag::CLOSURE), function(nullptr) {
+  }
+
+  void trace(Tracer& tracer) {
+    tracer.visit(function);
+    for (auto*& upvalue : upvalues) {
+      tracer.visit(upvalue);
+    }
+  }
+
+  GCObject* relocate(void* cell) {
+    return new (cell) PEBBLClosure(std::move(*this));
+  }
+
+  std::size_t payload_size() const {
+    return vector_payload_size(upvalues);
+  }
+};
+
 /**
  * @brief Native C++ function callable from PEBBL
+ *
+ * Arguments are passed as a span over storage the caller keeps rooted (the VM passes its value
+ * stack directly), so a call allocates nothing on its own.
  */
 class PEBBLBuiltinFunction : public GCObject {
 public:
-  using NativeFn = std::function<PEBBLObject(const std::vector<PEBBLObject>&, Interpreter&)>;
+  using NativeFn = PEBBLObject (*)(std::span<const PEBBLObject>, RuntimeContext&);
 
   std::string name;
   size_t arity;
@@ -186,7 +378,15 @@ public:
       GCObject(GCTag::BUILTIN_FUNCTION), name(func_name), arity(param_count), function(fn) {
   }
 
-  void trace(Tracer& /* tracer */) override {
+  void trace(Tracer& /* tracer */) {
     // Native functions contain no GC references
   }
+
+  GCObject* relocate(void* cell) {
+    return new (cell) PEBBLBuiltinFunction(std::move(*this));
+  }
+
+  std::size_t payload_size() const {
+    return string_payload_size(name);
+  }
 };
\ No newline at end of file
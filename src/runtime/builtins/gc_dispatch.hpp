@@ -0,0 +1,80 @@
+/**
+ * @file gc_dispatch.hpp
+ * @brief Operations the collector performs on GC objects, dispatched on GCTag
+ */
+
+#pragma once
+
+#include <type_traits>
+
+#include "builtin_objects.hpp"
+#include "gc.hpp"
+
+/**
+ * @brief Call a visitor with the object cast to its concrete type
+ *
+ * A switch on the tag replaces the virtual calls the collector would otherwise make for every
+ * object it traces, moves or frees. Adding a GCTag means adding its case here.
+ */
+template <typename Visitor>
+decltype(auto) dispatch_gc_object(GCObject* obj, Visitor&& visitor) {
+  switch (obj->tag) {
+    case GCTag::STRING:
+      return visitor(static_cast<PEBBLString*>(obj));
+    case GCTag::ARRAY:
+      return visitor(static_cast<PEBBLArray*>(obj));
+    case GCTag::DICT:
+      return visitor(static_cast<PEBBLDict*>(obj));
+    case GCTag::CLOSURE:
+      return visitor(static_cast<PEBBLClosure*>(obj));
+    case GCTag::UPVALUE:
+      return visitor(static_cast<PEBBLUpvalue*>(obj));
+    case GCTag::FUNCTION:
+      return visitor(static_cast<PEBBLFunction*>(obj));
+    case GCTag::BUILTIN_FUNCTION:
+      break;
+  }
+  return visitor(static_cast<PEBBLBuiltinFunction*>(obj));
+}
+
+/**
+ * @brief Check whether objects with a tag never reference other heap objects
+ *
+ * Leaf objects are marked or moved but never put on a worklist to be traced.
+ */
+constexpr bool is_leaf_tag(GCTag tag) {
+  return tag == GCTag::STRING || tag == GCTag::BUILTIN_FUNCTION;
+}
+
+/**
+ * @brief Visit the heap references held by an object
+ */
+inline void trace_gc_object(GCObject* obj, Tracer& tracer) {
+  dispatch_gc_object(obj, [&tracer](auto* typed) { typed->trace(tracer); });
+}
+
+/**
+ * @brief Move an object into an uninitialized cell
+ * @return The moved object
+ */
+inline GCObject* relocate_gc_object(GCObject* obj, void* cell) {
+  return dispatch_gc_object(obj, [cell](auto* typed) { return typed->relocate(cell); });
+}
+
+/**
+ * @brief Out-of-line bytes owned by an object
+ */
+inline size_t gc_object_payload_size(const GCObject* obj) {
+  return dispatch_gc_object(const_cast<GCObject*>(obj),
+                            [](const auto* typed) { return typed->payload_size(); });
+}
+
+/**
+ * @brief Run an object's destructor, leaving its memory to the caller
+ */
+inline void finalize_gc_object(GCObject* obj) {
+  dispatch_gc_object(obj, [](auto* typed) {
+    using T = std::remove_pointer_t<decltype(typed)>;
+    typed->~T();
+  });
+}
@@ -0,0 +1,44 @@
+/**
+ * @file runtime_context.hpp
+ * @brief Interface builtin functions use to reach the runtime that called them
+ */
+
+#pragma once
+
+#include <string>
+
+#include "object.hpp"
+
+class GCHeap;
+
+/**
+ * @brief Services a native builtin needs from whichever engine is executing it
+ *
+ * Implemented by both the tree-walking Interpreter and the bytecode VM, so builtins are written
+ * once and called directly from either engine.
+ */
+class RuntimeContext {
+public:
+  virtual ~RuntimeContext() = default;
+
+  /**
+   * @brief Get the GC heap for allocating result objects
+   */
+  virtual GCHeap& get_heap() const = 0;
+
+  /**
+   * @brief Convert a value to its string representation
+   * @param value The value to stringify
+   * @return String representation
+   */
+  virtual std::string stringify(PEBBLObject value) = 0;
+
+  /**
+   * @brief Report a runtime error raised by a builtin
+   * @param message Error message
+   *
+   * The tree-walker throws; the VM records the error and unwinds once the builtin returns, so
+   * builtins must return immediately after reporting.
+   */
+  virtual void report_error(const std::string& message) = 0;
+};
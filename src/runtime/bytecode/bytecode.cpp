@@ -18,12 +18,20 @@ std::string opcode_to_string(OpCode opcode) {
       return "LOAD_TRUE";
     case OpCode::LOAD_FALSE:
       return "LOAD_FALSE";
-    case OpCode::LOAD_VAR:
-      return "LOAD_VAR";
-    case OpCode::STORE_VAR:
-      return "STORE_VAR";
-    case OpCode::DEFINE_VAR:
-      return "DEFINE_VAR";
+    case OpCode::LOAD_LOCAL:
+      return "LOAD_LOCAL";
+    case OpCode::STORE_LOCAL:
+      return "STORE_LOCAL";
+    case OpCode::LOAD_GLOBAL:
+      return "LOAD_GLOBAL";
+    case OpCode::STORE_GLOBAL:
+      return "STORE_GLOBAL";
+    case OpCode::DEFINE_GLOBAL:
+      return "DEFINE_GLOBAL";
+    case OpCode::LOAD_UPVALUE:
+      return "LOAD_UPVALUE";
+    case OpCode::STORE_UPVALUE:
+      return "STORE_UPVALUE";
     case OpCode::ADD:
       return "ADD";
     case OpCode::SUBTRACT:
@@ -62,6 +70,10 @@ std::string opcode_to_string(OpCode opcode) {
       return "CALL";
     case OpCode::RETURN:
       return "RETURN";
+    case OpCode::CLOSURE:
+      return "CLOSURE";
+    case OpCode::CLOSE_UPVALUE:
+      return "CLOSE_UPVALUE";
     case OpCode::BUILD_ARRAY:
       return "BUILD_ARRAY";
     case OpCode::BUILD_DICT:
@@ -78,6 +90,54 @@ std::string opcode_to_string(OpCode opcode) {
       return "SETUP_LOOP";
     case OpCode::BREAK_LOOP:
       return "BREAK_LOOP";
+    case OpCode::ADD_INT:
+      return "ADD_INT";
+    case OpCode::ADD_DOUBLE:
+      return "ADD_DOUBLE";
+    case OpCode::SUBTRACT_INT:
+      return "SUBTRACT_INT";
+    case OpCode::SUBTRACT_DOUBLE:
+      return "SUBTRACT_DOUBLE";
+    case OpCode::MULTIPLY_INT:
+      return "MULTIPLY_INT";
+    case OpCode::MULTIPLY_DOUBLE:
+      return "MULTIPLY_DOUBLE";
+    case OpCode::LESS_INT:
+      return "LESS_INT";
+    case OpCode::LESS_DOUBLE:
+      return "LESS_DOUBLE";
+    case OpCode::GREATER_INT:
+      return "GREATER_INT";
+    case OpCode::GREATER_DOUBLE:
+      return "GREATER_DOUBLE";
+    case OpCode::LESS_EQUAL_INT:
+      return "LESS_EQUAL_INT";
+    case OpCode::LESS_EQUAL_DOUBLE:
+      return "LESS_EQUAL_DOUBLE";
+    case OpCode::GREATER_EQUAL_INT:
+      return "GREATER_EQUAL_INT";
+    case OpCode::GREATER_EQUAL_DOUBLE:
+      return "GREATER_EQUAL_DOUBLE";
+    case OpCode::INC_LOCAL:
+      return "INC_LOCAL";
+    case OpCode::INC_GLOBAL:
+      return "INC_GLOBAL";
+    case OpCode::STORE_LOCAL_POP:
+      return "STORE_LOCAL_POP";
+    case OpCode::STORE_GLOBAL_POP:
+      return "STORE_GLOBAL_POP";
+    case OpCode::LOAD_LOCAL_LOAD_CONST:
+      return "LOAD_LOCAL_LOAD_CONST";
+    case OpCode::JUMP_IF_NOT_LESS:
+      return "JUMP_IF_NOT_LESS";
+    case OpCode::JUMP_IF_NOT_GREATER:
+      return "JUMP_IF_NOT_GREATER";
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+      return "JUMP_IF_NOT_LESS_EQUAL";
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+      return "JUMP_IF_NOT_GREATER_EQUAL";
+    case OpCode::WIDE:
+      return "WIDE";
     case OpCode::HALT:
       return "HALT";
     default:
@@ -85,17 +145,294 @@ std::string opcode_to_string(OpCode opcode) {
   }
 }
 
+namespace {
+
+/**
+ * @brief Whether an operand fits in the encoding of its opcode without a WIDE prefix
+ */
+bool fits_narrow(OpCode opcode, uint32_t operand) {
+  switch (operand_format(opcode)) {
+    case OperandFormat::BYTE:
+      return operand <= 0xff;
+    case OperandFormat::JUMP_TARGET:
+      return operand <= 0xffff;
+    case OperandFormat::PAIR:
+      return first_operand(operand) <= 0xff && second_operand(operand) <= 0xff;
+    default:
+      return true;
+  }
+}
+
+/**
+ * @brief Number of bytes an instruction is encoded in
+ */
+uint32_t encoded_size(OpCode opcode, bool wide) {
+  if (wide) {
+    return 6;
+  }
+  switch (operand_format(opcode)) {
+    case OperandFormat::BYTE:
+      return 2;
+    case OperandFormat::JUMP_TARGET:
+    case OperandFormat::PAIR:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+}  // namespace
+
+void encode_chunk(Chunk& chunk) {
+  const std::vector<Instruction>& instructions = chunk.instructions;
+  size_t count = instructions.size();
+
+  // A jump target's offset depends on the size of every instruction before it, jumps included.
+  // Jumps start out narrow and are widened while their target does not fit; sizes only grow, so
+  // the layout settles
+  std::vector<bool> wide(count);
+  std::vector<bool> is_jump(count);
+  for (size_t i = 0; i < count; ++i) {
+    is_jump[i] = operand_format(instructions[i].opcode) == OperandFormat::JUMP_TARGET;
+    wide[i] = !is_jump[i] && !fits_narrow(instructions[i].opcode, instructions[i].operand);
+  }
+
+  std::vector<uint32_t> offsets(count + 1);
+  auto target_offset = [&](const Instruction& jump) {
+    return jump.operand <= count ? offsets[jump.operand] : jump.operand;
+  };
+  for (bool changed = true; changed;) {
+    uint32_t offset = 0;
+    for (size_t i = 0; i < count; ++i) {
+      offsets[i] = offset;
+      offset += encoded_size(instructions[i].opcode, wide[i]);
+    }
+    offsets[count] = offset;
+
+    changed = false;
+    for (size_t i = 0; i < count; ++i) {
+      if (is_jump[i] && !wide[i] && !fits_narrow(instructions[i].opcode,
+                                                 target_offset(instructions[i]))) {
+        wide[i] = true;
+        changed = true;
+      }
+    }
+  }
+
+  std::vector<uint8_t> code;
+  code.reserve(offsets[count]);
+  for (size_t i = 0; i < count; ++i) {
+    OpCode opcode = instructions[i].opcode;
+    uint32_t operand = is_jump[i] ? target_offset(instructions[i]) : instructions[i].operand;
+    if (wide[i]) {
+      code.push_back(static_cast<uint8_t>(OpCode::WIDE));
+      code.push_back(static_cast<uint8_t>(opcode));
+      for (int shift = 0; shift < 32; shift += 8) {
+        code.push_back(static_cast<uint8_t>(operand >> shift));
+      }
+      continue;
+    }
+
+    code.push_back(static_cast<uint8_t>(opcode));
+    switch (operand_format(opcode)) {
+      case OperandFormat::BYTE:
+        code.push_back(static_cast<uint8_t>(operand));
+        break;
+      case OperandFormat::JUMP_TARGET:
+        code.push_back(static_cast<uint8_t>(operand));
+        code.push_back(static_cast<uint8_t>(operand >> 8));
+        break;
+      case OperandFormat::PAIR:
+        code.push_back(static_cast<uint8_t>(first_operand(operand)));
+        code.push_back(static_cast<uint8_t>(second_operand(operand)));
+        break;
+      default:
+        break;
+    }
+  }
+
+  offsets.pop_back();
+  chunk.code = std::move(code);
+  chunk.instruction_offsets = std::move(offsets);
+  chunk.instructions = std::vector<Instruction>();
+}
+
+std::string register_opcode_to_string(RegisterOpCode opcode) {
+  switch (opcode) {
+    case RegisterOpCode::LOAD_CONST:
+      return "LOAD_CONST";
+    case RegisterOpCode::LOAD_NULL:
+      return "LOAD_NULL";
+    case RegisterOpCode::LOAD_TRUE:
+      return "LOAD_TRUE";
+    case RegisterOpCode::LOAD_FALSE:
+      return "LOAD_FALSE";
+    case RegisterOpCode::MOVE:
+      return "MOVE";
+    case RegisterOpCode::LOAD_GLOBAL:
+      return "LOAD_GLOBAL";
+    case RegisterOpCode::STORE_GLOBAL:
+      return "STORE_GLOBAL";
+    case RegisterOpCode::DEFINE_GLOBAL:
+      return "DEFINE_GLOBAL";
+    case RegisterOpCode::LOAD_UPVALUE:
+      return "LOAD_UPVALUE";
+    case RegisterOpCode::STORE_UPVALUE:
+      return "STORE_UPVALUE";
+    case RegisterOpCode::ADD:
+      return "ADD";
+    case RegisterOpCode::SUBTRACT:
+      return "SUBTRACT";
+    case RegisterOpCode::MULTIPLY:
+      return "MULTIPLY";
+    case RegisterOpCode::DIVIDE:
+      return "DIVIDE";
+    case RegisterOpCode::EQUAL:
+      return "EQUAL";
+    case RegisterOpCode::NOT_EQUAL:
+      return "NOT_EQUAL";
+    case RegisterOpCode::LESS:
+      return "LESS";
+    case RegisterOpCode::GREATER:
+      return "GREATER";
+    case RegisterOpCode::LESS_EQUAL:
+      return "LESS_EQUAL";
+    case RegisterOpCode::GREATER_EQUAL:
+      return "GREATER_EQUAL";
+    case RegisterOpCode::AND:
+      return "AND";
+    case RegisterOpCode::OR:
+      return "OR";
+    case RegisterOpCode::NEGATE:
+      return "NEGATE";
+    case RegisterOpCode::NOT:
+      return "NOT";
+    case RegisterOpCode::JUMP:
+      return "JUMP";
+    case RegisterOpCode::JUMP_IF_FALSE:
+      return "JUMP_IF_FALSE";
+    case RegisterOpCode::CALL:
+      return "CALL";
+    case RegisterOpCode::RETURN:
+      return "RETURN";
+    case RegisterOpCode::CLOSURE:
+      return "CLOSURE";
+    case RegisterOpCode::CLOSE:
+      return "CLOSE";
+    case RegisterOpCode::BUILD_ARRAY:
+      return "BUILD_ARRAY";
+    case RegisterOpCode::BUILD_DICT:
+      return "BUILD_DICT";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+namespace {
+
+std::string disassemble_register_instruction(const Chunk& chunk, uint32_t offset) {
+  std::stringstream ss;
+
+  if (offset >= chunk.register_code.size()) {
+    return "INVALID_OFFSET";
+  }
+
+  const RegisterInstruction& instr = chunk.register_code[offset];
+
+  ss << std::setfill('0') << std::setw(4) << offset << " " << std::setfill(' ');
+  ss << std::left << std::setw(16) << register_opcode_to_string(instr.opcode);
+
+  auto write_rk = [&ss](uint32_t operand) {
+    if (operand & CONSTANT_OPERAND) {
+      ss << "k" << (operand & ~CONSTANT_OPERAND);
+    } else {
+      ss << "r" << operand;
+    }
+  };
+  auto global_name = [&chunk](uint32_t slot) {
+    return slot < chunk.variable_names.size() ? "'" + chunk.variable_names[slot] + "'"
+                                              : "global " + std::to_string(slot);
+  };
+
+  switch (instr.opcode) {
+    case RegisterOpCode::LOAD_CONST:
+    case RegisterOpCode::CLOSURE:
+      ss << " r" << instr.a << ", " << instr.b << " ; constant[" << instr.b << "]";
+      break;
+
+    case RegisterOpCode::LOAD_NULL:
+    case RegisterOpCode::LOAD_TRUE:
+    case RegisterOpCode::LOAD_FALSE:
+    case RegisterOpCode::RETURN:
+    case RegisterOpCode::CLOSE:
+      ss << " r" << instr.a;
+      break;
+
+    case RegisterOpCode::MOVE:
+    case RegisterOpCode::NEGATE:
+    case RegisterOpCode::NOT:
+      ss << " r" << instr.a << ", r" << instr.b;
+      break;
+
+    case RegisterOpCode::LOAD_GLOBAL:
+    case RegisterOpCode::STORE_GLOBAL:
+    case RegisterOpCode::DEFINE_GLOBAL:
+      ss << " r" << instr.a << ", " << instr.b << " ; " << global_name(instr.b);
+      break;
+
+    case RegisterOpCode::LOAD_UPVALUE:
+    case RegisterOpCode::STORE_UPVALUE:
+      ss << " r" << instr.a << ", " << instr.b << " ; upvalue " << instr.b;
+      break;
+
+    case RegisterOpCode::JUMP:
+      ss << " " << instr.b << " ; -> " << instr.b;
+      break;
+
+    case RegisterOpCode::JUMP_IF_FALSE:
+      ss << " r" << instr.a << ", " << instr.b << " ; -> " << instr.b;
+      break;
+
+    case RegisterOpCode::CALL:
+      ss << " r" << instr.a << ", " << instr.b << " ; argc=" << instr.b;
+      break;
+
+    case RegisterOpCode::BUILD_ARRAY:
+    case RegisterOpCode::BUILD_DICT:
+      ss << " r" << instr.a << ", r" << instr.b << ", " << instr.c << " ; count=" << instr.c;
+      break;
+
+    default:
+      // Three-address operations
+      ss << " r" << instr.a << ", ";
+      write_rk(instr.b);
+      ss << ", ";
+      write_rk(instr.c);
+      break;
+  }
+
+  return ss.str();
+}
+
+}  // namespace
+
 std::string disassemble_instruction(const Chunk& chunk, uint32_t offset) {
+  if (chunk.has_register_code()) {
+    return disassemble_register_instruction(chunk, offset);
+  }
+
   std::stringstream ss;
 
-  if (offset >= chunk.instructions.size()) {
+  if (offset >= chunk.code.size()) {
     return "INVALID_OFFSET";
   }
 
-  const Instruction& instr = chunk.instructions[offset];
+  Instruction instr;
+  bool wide = chunk.code[offset] == static_cast<uint8_t>(OpCode::WIDE);
+  decode_instruction(chunk.code.data() + offset, instr.opcode, instr.operand);
 
-  ss << std::setfill('0') << std::setw(4) << offset << " ";
-  ss << std::left << std::setw(16) << opcode_to_string(instr.opcode);
+  ss << std::setfill('0') << std::setw(4) << offset << " " << std::setfill(' ');
+  ss << std::left << std::setw(16) << (wide ? "WIDE " : "") + opcode_to_string(instr.opcode);
 
   // Add operand information based on instruction type
   switch (instr.opcode) {
@@ -107,9 +444,42 @@ std::string disassemble_instruction(const Chunk& chunk, uint32_t offset) {
       }
       break;
 
-    case OpCode::LOAD_VAR:
-    case OpCode::STORE_VAR:
-    case OpCode::DEFINE_VAR:
+    case OpCode::LOAD_LOCAL:
+    case OpCode::STORE_LOCAL:
+    case OpCode::STORE_LOCAL_POP:
+      ss << " " << instr.operand << " ; slot " << instr.operand;
+      break;
+
+    case OpCode::INC_LOCAL:
+    case OpCode::LOAD_LOCAL_LOAD_CONST:
+      ss << " " << first_operand(instr.operand) << " " << second_operand(instr.operand)
+         << " ; slot " << first_operand(instr.operand) << ", constant["
+         << second_operand(instr.operand) << "]";
+      break;
+
+    case OpCode::INC_GLOBAL:
+      ss << " " << first_operand(instr.operand) << " " << second_operand(instr.operand) << " ; ";
+      if (first_operand(instr.operand) < chunk.variable_names.size()) {
+        ss << "'" << chunk.variable_names[first_operand(instr.operand)] << "'";
+      } else {
+        ss << "global " << first_operand(instr.operand);
+      }
+      ss << ", constant[" << second_operand(instr.operand) << "]";
+      break;
+
+    case OpCode::LOAD_UPVALUE:
+    case OpCode::STORE_UPVALUE:
+      ss << " " << instr.operand << " ; upvalue " << instr.operand;
+      break;
+
+    case OpCode::CLOSURE:
+      ss << " " << instr.operand << " ; constant[" << instr.operand << "]";
+      break;
+
+    case OpCode::LOAD_GLOBAL:
+    case OpCode::STORE_GLOBAL:
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::STORE_GLOBAL_POP:
       ss << " " << instr.operand;
       if (instr.operand < chunk.variable_names.size()) {
         ss << " ; '" << chunk.variable_names[instr.operand] << "'";
@@ -119,6 +489,10 @@ std::string disassemble_instruction(const Chunk& chunk, uint32_t offset) {
     case OpCode::JUMP:
     case OpCode::JUMP_IF_FALSE:
     case OpCode::JUMP_IF_TRUE:
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
       ss << " " << instr.operand << " ; -> " << instr.operand;
       break;
 
@@ -146,12 +520,27 @@ std::string disassemble_instruction(const Chunk& chunk, uint32_t offset) {
     case OpCode::AND:
     case OpCode::OR:
     case OpCode::RETURN:
+    case OpCode::CLOSE_UPVALUE:
     case OpCode::POP:
     case OpCode::DUP:
     case OpCode::PUSH_ENV:
     case OpCode::POP_ENV:
     case OpCode::SETUP_LOOP:
     case OpCode::BREAK_LOOP:
+    case OpCode::ADD_INT:
+    case OpCode::ADD_DOUBLE:
+    case OpCode::SUBTRACT_INT:
+    case OpCode::SUBTRACT_DOUBLE:
+    case OpCode::MULTIPLY_INT:
+    case OpCode::MULTIPLY_DOUBLE:
+    case OpCode::LESS_INT:
+    case OpCode::LESS_DOUBLE:
+    case OpCode::GREATER_INT:
+    case OpCode::GREATER_DOUBLE:
+    case OpCode::LESS_EQUAL_INT:
+    case OpCode::LESS_EQUAL_DOUBLE:
+    case OpCode::GREATER_EQUAL_INT:
+    case OpCode::GREATER_EQUAL_DOUBLE:
     case OpCode::HALT:
       // No operand needed for these instructions
       break;
@@ -170,9 +559,15 @@ std::string disassemble_chunk(const Chunk& chunk) {
   std::stringstream ss;
 
   ss << "=== Bytecode Chunk ===\n";
-  ss << "Instructions: " << chunk.instructions.size() << "\n";
+  if (chunk.has_register_code()) {
+    ss << "Register instructions: " << chunk.register_code.size() << "\n";
+    ss << "Registers: " << chunk.register_count << "\n";
+  } else {
+    ss << "Instructions: " << chunk.instruction_offsets.size() << "\n";
+    ss << "Code bytes: " << chunk.code.size() << "\n";
+  }
   ss << "Constants: " << chunk.constants.size() << "\n";
-  ss << "Variables: " << chunk.variable_names.size() << "\n";
+  ss << "Globals: " << chunk.variable_names.size() << "\n";
   ss << "\n";
 
   // Disassemble constants
@@ -186,7 +581,7 @@ std::string disassemble_chunk(const Chunk& chunk) {
 
   // Disassemble variable names
   if (!chunk.variable_names.empty()) {
-    ss << "Variables:\n";
+    ss << "Globals:\n";
     for (size_t i = 0; i < chunk.variable_names.size(); ++i) {
       ss << "  [" << i << "] '" << chunk.variable_names[i] << "'\n";
     }
@@ -195,8 +590,14 @@ std::string disassemble_chunk(const Chunk& chunk) {
 
   // Disassemble instructions
   ss << "Instructions:\n";
-  for (uint32_t i = 0; i < chunk.instructions.size(); ++i) {
-    ss << "  " << disassemble_instruction(chunk, i) << "\n";
+  if (chunk.has_register_code()) {
+    for (uint32_t i = 0; i < chunk.register_code.size(); ++i) {
+      ss << "  " << disassemble_instruction(chunk, i) << "\n";
+    }
+  } else {
+    for (uint32_t offset : chunk.instruction_offsets) {
+      ss << "  " << disassemble_instruction(chunk, offset) << "\n";
+    }
   }
 
   return ss.str();
@@ -5,8 +5,11 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "object.hpp"
@@ -22,9 +25,13 @@ enum class OpCode : uint8_t {
   LOAD_FALSE,  // Load false value
 
   // Variables
-  LOAD_VAR,    // Load variable from environment
-  STORE_VAR,   // Store variable to environment
-  DEFINE_VAR,  // Define new variable
+  LOAD_LOCAL,     // Load local from stack slot (relative to the frame's stack base)
+  STORE_LOCAL,    // Store top of stack into local slot
+  LOAD_GLOBAL,    // Load global by slot in the VM's global array
+  STORE_GLOBAL,   // Store top of stack into global slot
+  DEFINE_GLOBAL,  // Pop top of stack into global slot
+  LOAD_UPVALUE,   // Load captured variable through the current closure
+  STORE_UPVALUE,  // Store top of stack into captured variable
 
   // Arithmetic operations
   ADD,       // Binary addition
@@ -52,8 +59,10 @@ enum class OpCode : uint8_t {
   JUMP_IF_TRUE,   // Conditional jump if true
 
   // Function calls
-  CALL,    // Call function with n arguments
-  RETURN,  // Return from function
+  CALL,           // Call function with n arguments
+  RETURN,         // Return from function
+  CLOSURE,        // Wrap function constant in a closure capturing its upvalues
+  CLOSE_UPVALUE,  // Move captured local on top of stack to the heap and pop it
 
   // Collections
   BUILD_ARRAY,  // Build array from n stack items
@@ -71,12 +80,203 @@ enum class OpCode : uint8_t {
   SETUP_LOOP,  // Setup loop context
   BREAK_LOOP,  // Break from loop
 
+  // Type-specialized forms the VM rewrites generic instructions into after observing their
+  // operands (quickening); never emitted by the compiler. Each reverts to its generic opcode
+  // when an operand does not have the expected type, counting the reversion in the otherwise
+  // unused operand so that sites seeing mixed types stop being specialized.
+  ADD_INT,               // ADD of two int32s
+  ADD_DOUBLE,            // ADD of two numbers, at least one a double
+  SUBTRACT_INT,          // SUBTRACT of two int32s
+  SUBTRACT_DOUBLE,       // SUBTRACT of two numbers, at least one a double
+  MULTIPLY_INT,          // MULTIPLY of two int32s
+  MULTIPLY_DOUBLE,       // MULTIPLY of two numbers, at least one a double
+  LESS_INT,              // LESS of two int32s
+  LESS_DOUBLE,           // LESS of two numbers, at least one a double
+  GREATER_INT,           // GREATER of two int32s
+  GREATER_DOUBLE,        // GREATER of two numbers, at least one a double
+  LESS_EQUAL_INT,        // LESS_EQUAL of two int32s
+  LESS_EQUAL_DOUBLE,     // LESS_EQUAL of two numbers, at least one a double
+  GREATER_EQUAL_INT,     // GREATER_EQUAL of two int32s
+  GREATER_EQUAL_DOUBLE,  // GREATER_EQUAL of two numbers, at least one a double
+
+  // Superinstructions the peephole pass (peephole.hpp) fuses common sequences into. Packed
+  // operands hold two 16-bit fields, see pack_operands.
+  INC_LOCAL,                  // LOAD_LOCAL a; LOAD_CONST b; ADD; STORE_LOCAL a; POP (packed)
+  INC_GLOBAL,                 // LOAD_GLOBAL a; LOAD_CONST b; ADD; STORE_GLOBAL a; POP (packed)
+  STORE_LOCAL_POP,            // STORE_LOCAL; POP
+  STORE_GLOBAL_POP,           // STORE_GLOBAL; POP
+  LOAD_LOCAL_LOAD_CONST,      // LOAD_LOCAL a; LOAD_CONST b (packed)
+  JUMP_IF_NOT_LESS,           // LESS; JUMP_IF_FALSE
+  JUMP_IF_NOT_GREATER,        // GREATER; JUMP_IF_FALSE
+  JUMP_IF_NOT_LESS_EQUAL,     // LESS_EQUAL; JUMP_IF_FALSE
+  JUMP_IF_NOT_GREATER_EQUAL,  // GREATER_EQUAL; JUMP_IF_FALSE
+
   // Special
+  WIDE,  // Prefix giving the next instruction a four-byte operand in encoded code
   HALT,  // Stop execution
 };
 
 /**
- * @brief Single bytecode instruction
+ * @brief Number of opcodes, for tables indexed by OpCode
+ */
+constexpr size_t OPCODE_COUNT = static_cast<size_t>(OpCode::HALT) + 1;
+
+/**
+ * @brief Largest value a field of a packed operand can hold
+ */
+constexpr uint32_t PACKED_OPERAND_MAX = 0xffff;
+
+/**
+ * @brief Combine the two operands of a superinstruction, each at most PACKED_OPERAND_MAX
+ */
+constexpr uint32_t pack_operands(uint32_t first, uint32_t second) {
+  return first | (second << 16);
+}
+
+/**
+ * @brief First field of a packed operand
+ */
+constexpr uint32_t first_operand(uint32_t packed) {
+  return packed & PACKED_OPERAND_MAX;
+}
+
+/**
+ * @brief Second field of a packed operand
+ */
+constexpr uint32_t second_operand(uint32_t packed) {
+  return packed >> 16;
+}
+
+/**
+ * @brief Layout of an instruction's operand in encoded code (see encode_chunk)
+ *
+ * The opcode takes one byte, followed by no operand (NONE), one byte (BYTE), a two-byte offset in
+ * the chunk's code (JUMP_TARGET) or the two fields of a packed operand in a byte each (PAIR).
+ * After a WIDE prefix the operand takes four bytes, packed fields in the layout of
+ * pack_operands. Multi-byte operands are little-endian.
+ */
+enum class OperandFormat : uint8_t { NONE, BYTE, JUMP_TARGET, PAIR };
+
+/**
+ * @brief Operand format of an opcode
+ */
+constexpr OperandFormat operand_format(OpCode opcode) {
+  switch (opcode) {
+    case OpCode::LOAD_CONST:
+    case OpCode::LOAD_LOCAL:
+    case OpCode::STORE_LOCAL:
+    case OpCode::LOAD_GLOBAL:
+    case OpCode::STORE_GLOBAL:
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::LOAD_UPVALUE:
+    case OpCode::STORE_UPVALUE:
+    case OpCode::CALL:
+    case OpCode::CLOSURE:
+    case OpCode::BUILD_ARRAY:
+    case OpCode::BUILD_DICT:
+    case OpCode::STORE_LOCAL_POP:
+    case OpCode::STORE_GLOBAL_POP:
+      return OperandFormat::BYTE;
+
+    // Instructions the VM quickens count their deoptimizations in the operand, which starts at
+    // zero, so they are never wide and their opcode is always just before the operand byte
+    case OpCode::ADD:
+    case OpCode::SUBTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::LESS:
+    case OpCode::GREATER:
+    case OpCode::LESS_EQUAL:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::ADD_INT:
+    case OpCode::ADD_DOUBLE:
+    case OpCode::SUBTRACT_INT:
+    case OpCode::SUBTRACT_DOUBLE:
+    case OpCode::MULTIPLY_INT:
+    case OpCode::MULTIPLY_DOUBLE:
+    case OpCode::LESS_INT:
+    case OpCode::LESS_DOUBLE:
+    case OpCode::GREATER_INT:
+    case OpCode::GREATER_DOUBLE:
+    case OpCode::LESS_EQUAL_INT:
+    case OpCode::LESS_EQUAL_DOUBLE:
+    case OpCode::GREATER_EQUAL_INT:
+    case OpCode::GREATER_EQUAL_DOUBLE:
+      return OperandFormat::BYTE;
+
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+      return OperandFormat::JUMP_TARGET;
+
+    case OpCode::INC_LOCAL:
+    case OpCode::INC_GLOBAL:
+    case OpCode::LOAD_LOCAL_LOAD_CONST:
+      return OperandFormat::PAIR;
+
+    default:
+      return OperandFormat::NONE;
+  }
+}
+
+/**
+ * @brief Read the operand of an instruction that has no WIDE prefix
+ * @param bytes Encoded operand, just after the opcode
+ * @return Number of operand bytes read
+ */
+template <OperandFormat format>
+inline uint32_t read_operand(const uint8_t* bytes, uint32_t& operand) {
+  if constexpr (format == OperandFormat::BYTE) {
+    operand = bytes[0];
+    return 1;
+  } else if constexpr (format == OperandFormat::JUMP_TARGET) {
+    operand = bytes[0] | (static_cast<uint32_t>(bytes[1]) << 8);
+    return 2;
+  } else if constexpr (format == OperandFormat::PAIR) {
+    operand = pack_operands(bytes[0], bytes[1]);
+    return 2;
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * @brief Read the four-byte operand of an instruction following a WIDE prefix
+ */
+inline uint32_t read_wide_operand(const uint8_t* bytes) {
+  return bytes[0] | (static_cast<uint32_t>(bytes[1]) << 8) |
+         (static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+/**
+ * @brief Decode the encoded instruction at bytes, including a WIDE prefix
+ * @return Number of bytes the instruction takes
+ */
+inline uint32_t decode_instruction(const uint8_t* bytes, OpCode& opcode, uint32_t& operand) {
+  opcode = static_cast<OpCode>(bytes[0]);
+  if (opcode == OpCode::WIDE) {
+    opcode = static_cast<OpCode>(bytes[1]);
+    operand = read_wide_operand(bytes + 2);
+    return 6;
+  }
+  operand = 0;
+  switch (operand_format(opcode)) {
+    case OperandFormat::BYTE:
+      return 1 + read_operand<OperandFormat::BYTE>(bytes + 1, operand);
+    case OperandFormat::JUMP_TARGET:
+      return 1 + read_operand<OperandFormat::JUMP_TARGET>(bytes + 1, operand);
+    case OperandFormat::PAIR:
+      return 1 + read_operand<OperandFormat::PAIR>(bytes + 1, operand);
+    default:
+      return 1;
+  }
+}
+
+/**
+ * @brief Single bytecode instruction, as emitted by the compiler before encoding
  */
 struct Instruction {
   OpCode opcode;
@@ -90,13 +290,89 @@ struct Instruction {
   }
 };
 
+/**
+ * @brief Operation codes of the register instruction set
+ *
+ * An alternative to OpCode, compiled by RegisterCompiler and run by VM::execute when a chunk
+ * holds register code. Each call frame owns a window of registers on the VM stack, starting at
+ * its stack base; parameters and locals live in the low registers and temporaries above them.
+ * Operands a, b and c of a RegisterInstruction are register numbers (r), constant pool
+ * indices (k), global slots (g), upvalue indices (u), counts (n) or instruction indices
+ * (target), as noted for each opcode. Operands of binary operations (rk) name a register, or a
+ * constant if flagged with CONSTANT_OPERAND.
+ */
+enum class RegisterOpCode : uint8_t {
+  // Constants and moves
+  LOAD_CONST,  // r[a] = k[b]
+  LOAD_NULL,   // r[a] = null
+  LOAD_TRUE,   // r[a] = true
+  LOAD_FALSE,  // r[a] = false
+  MOVE,        // r[a] = r[b]
+
+  // Variables outside the frame
+  LOAD_GLOBAL,    // r[a] = g[b]
+  STORE_GLOBAL,   // g[b] = r[a], if g[b] is defined and mutable
+  DEFINE_GLOBAL,  // g[b] = r[a]
+  LOAD_UPVALUE,   // r[a] = u[b]
+  STORE_UPVALUE,  // u[b] = r[a]
+
+  // Three-address arithmetic, comparison and logic
+  ADD,            // r[a] = rk[b] + rk[c]
+  SUBTRACT,       // r[a] = rk[b] - rk[c]
+  MULTIPLY,       // r[a] = rk[b] * rk[c]
+  DIVIDE,         // r[a] = rk[b] / rk[c]
+  EQUAL,          // r[a] = rk[b] == rk[c]
+  NOT_EQUAL,      // r[a] = rk[b] != rk[c]
+  LESS,           // r[a] = rk[b] < rk[c]
+  GREATER,        // r[a] = rk[b] > rk[c]
+  LESS_EQUAL,     // r[a] = rk[b] <= rk[c]
+  GREATER_EQUAL,  // r[a] = rk[b] >= rk[c]
+  AND,            // r[a] = rk[b] and rk[c]
+  OR,             // r[a] = rk[b] or rk[c]
+  NEGATE,         // r[a] = -r[b]
+  NOT,            // r[a] = !r[b]
+
+  // Control flow
+  JUMP,           // Continue at target b
+  JUMP_IF_FALSE,  // Continue at target b if r[a] is falsy
+
+  // Functions
+  CALL,     // r[a] = r[a](r[a + 1], ..., r[a + n]) with n = b; the callee's frame starts at r[a + 1]
+  RETURN,   // Return r[a] to the caller
+  CLOSURE,  // r[a] = closure of the function k[b], capturing its upvalues
+  CLOSE,    // Move captured registers r[a] and above to the heap
+
+  // Collections
+  BUILD_ARRAY,  // r[a] = array of the n = c registers from r[b]
+  BUILD_DICT,   // r[a] = dictionary of the n = c key-value register pairs from r[b]
+};
+
+/**
+ * @brief Flag on an rk operand selecting the constant k[operand & ~CONSTANT_OPERAND]
+ */
+constexpr uint32_t CONSTANT_OPERAND = 0x80000000;
+
+/**
+ * @brief Single three-address instruction of the register instruction set
+ */
+struct RegisterInstruction {
+  RegisterOpCode opcode;
+  uint32_t a;  // Usually the destination register
+  uint32_t b;
+  uint32_t c;
+
+  RegisterInstruction(RegisterOpCode op, uint32_t first, uint32_t second, uint32_t third) :
+      opcode(op), a(first), b(second), c(third) {
+  }
+};
+
 /**
  * @brief Variable information for compilation
  */
 struct VariableInfo {
   std::string name;
   bool is_mutable;
-  uint32_t index;  // Index in local variables or global environment
+  uint32_t index;  // Stack slot for locals, global array slot for globals
 
   // Default constructor for std::unordered_map
   VariableInfo() : name(""), is_mutable(false), index(0) {
@@ -107,27 +383,121 @@ struct VariableInfo {
   }
 };
 
+/**
+ * @brief Describes where a closure captures one of its upvalues from
+ */
+struct UpvalueInfo {
+  uint32_t index;   // Local slot in the enclosing frame, or the enclosing closure's upvalue index
+  bool is_local;    // True if capturing a local of the immediately enclosing function
+  bool is_mutable;  // Mutability of the captured variable, checked at compile time
+
+  UpvalueInfo(uint32_t idx, bool local, bool mut) : index(idx), is_local(local), is_mutable(mut) {
+  }
+};
+
+/**
+ * @brief Compile-time mapping from global names to dense slots in the VM's global array
+ *
+ * Shared by the compiler and the VM so that globals keep their slots across programs run on the
+ * same VM. Slots are never reused; a slot whose variable has not been defined yet holds the
+ * undefined sentinel at runtime.
+ */
+class GlobalTable {
+public:
+  /**
+   * @brief Get the slot for a global name, reserving a new one if the name is unknown
+   */
+  uint32_t resolve(const std::string& name) {
+    auto it = slots_by_name_.find(name);
+    if (it != slots_by_name_.end()) {
+      return it->second;
+    }
+    uint32_t index = static_cast<uint32_t>(globals_.size());
+    globals_.emplace_back(name, true, index);
+    slots_by_name_.emplace(name, index);
+    return index;
+  }
+
+  /**
+   * @brief Record a definition of a global and its mutability
+   * @return Slot of the global
+   */
+  uint32_t define(const std::string& name, bool is_mutable) {
+    uint32_t index = resolve(name);
+    globals_[index].is_mutable = is_mutable;
+    return index;
+  }
+
+  /**
+   * @brief Look up a global by name without reserving a slot
+   * @return Variable info, or nullptr if the name has never been referenced
+   */
+  const VariableInfo* find(const std::string& name) const {
+    auto it = slots_by_name_.find(name);
+    return it != slots_by_name_.end() ? &globals_[it->second] : nullptr;
+  }
+
+  /**
+   * @brief Get variable info for a slot
+   */
+  const VariableInfo& get(uint32_t index) const {
+    return globals_[index];
+  }
+
+  /**
+   * @brief Get the number of reserved slots
+   */
+  size_t size() const {
+    return globals_.size();
+  }
+
+private:
+  std::vector<VariableInfo> globals_;
+  std::unordered_map<std::string, uint32_t> slots_by_name_;
+};
+
 /**
  * @brief Bytecode chunk containing instructions and constants
  */
 class Chunk {
 public:
-  std::vector<Instruction> instructions;
+  std::vector<Instruction> instructions;  // Compiler output, replaced by code once encoded
   std::vector<PEBBLObject> constants;
-  std::vector<std::string> variable_names;  // For debugging and variable lookup
+  std::vector<std::string> variable_names;  // Global names by slot, for debugging
+  std::vector<uint32_t> lines;              // Source line of each instruction, 0 if unknown
+
+  // Encoded instructions the VM runs (see encode_chunk), and where each of them starts in code
+  std::vector<uint8_t> code;
+  std::vector<uint32_t> instruction_offsets;
+
+  // Register code replaces instructions in chunks compiled by RegisterCompiler
+  std::vector<RegisterInstruction> register_code;
+  uint32_t register_count = 0;  // Registers in a call frame running this chunk
 
   /**
    * @brief Add an instruction to the chunk
+   * @param line Source line the instruction was compiled from
    */
-  void add_instruction(OpCode opcode) {
-    instructions.emplace_back(opcode);
+  void add_instruction(OpCode opcode, uint32_t operand = 0, uint32_t line = 0) {
+    instructions.emplace_back(opcode, operand);
+    lines.push_back(line);
   }
 
   /**
-   * @brief Add an instruction with operand
+   * @brief Add a register instruction to the chunk
+   * @param line Source line the instruction was compiled from
    */
-  void add_instruction(OpCode opcode, uint32_t operand) {
-    instructions.emplace_back(opcode, operand);
+  void add_register_instruction(RegisterOpCode opcode, uint32_t a, uint32_t b, uint32_t c,
+                                uint32_t line) {
+    register_code.emplace_back(opcode, a, b, c);
+    lines.push_back(line);
+  }
+
+  /**
+   * @brief Whether the chunk runs on the register instruction set
+   */
+  bool has_register_code() const {
+    return !register_code.empty();
   }
 
   /**
@@ -140,16 +510,7 @@ public:
   }
 
   /**
-   * @brief Add a variable name for debugging
-   * @return Index of the variable name
-   */
-  uint32_t add_variable_name(const std::string& name) {
-    variable_names.push_back(name);
-    return static_cast<uint32_t>(variable_names.size() - 1);
-  }
-
-  /**
-   * @brief Get current instruction count (for jump targets)
+   * @brief Get current instruction count (for jump targets while compiling)
    */
   uint32_t get_instruction_count() const {
     return static_cast<uint32_t>(instructions.size());
@@ -171,6 +532,19 @@ public:
     instructions.clear();
     constants.clear();
     variable_names.clear();
+    lines.clear();
+    code.clear();
+    instruction_offsets.clear();
+    register_code.clear();
+    register_count = 0;
+  }
+
+  /**
+   * @brief Get the index of the encoded instruction containing the byte at offset in code
+   */
+  uint32_t instruction_index(uint32_t offset) const {
+    auto next = std::upper_bound(instruction_offsets.begin(), instruction_offsets.end(), offset);
+    return static_cast<uint32_t>(next - instruction_offsets.begin()) - 1;
   }
 
   /**
@@ -187,6 +561,13 @@ public:
     return constants[index];
   }
 
+  /**
+   * @brief Get the source line of the instruction at index
+   */
+  uint32_t get_line(uint32_t index) const {
+    return index < lines.size() ? lines[index] : 0;
+  }
+
   /**
    * @brief Get variable name at index
    */
@@ -199,15 +580,31 @@ public:
    */
   size_t size_bytes() const {
     return instructions.size() * sizeof(Instruction) + constants.size() * sizeof(PEBBLObject) +
-           variable_names.size() * sizeof(std::string);
+           variable_names.size() * sizeof(std::string) + lines.size() * sizeof(uint32_t) +
+           code.size() + instruction_offsets.size() * sizeof(uint32_t) +
+           register_code.size() * sizeof(RegisterInstruction);
   }
 };
 
+/**
+ * @brief Encode a compiled chunk's instructions into code for the VM
+ *
+ * Each instruction takes the shortest form its operand fits in (see OperandFormat), with a WIDE
+ * prefix otherwise. Jump targets become offsets in code. The instructions are released; lines
+ * stay indexed by instruction, see Chunk::instruction_index.
+ */
+void encode_chunk(Chunk& chunk);
+
 /**
  * @brief Convert opcode to string for debugging
  */
 std::string opcode_to_string(OpCode opcode);
 
+/**
+ * @brief Convert register opcode to string for debugging
+ */
+std::string register_opcode_to_string(RegisterOpCode opcode);
+
 /**
  * @brief Disassemble bytecode chunk for debugging
  */
@@ -215,5 +612,6 @@ std::string disassemble_chunk(const Chunk& chunk);
 
 /**
  * @brief Disassemble single instruction for debugging
+ * @param offset Offset of the instruction in code, or its index for register code
  */
 std::string disassemble_instruction(const Chunk& chunk, uint32_t offset);
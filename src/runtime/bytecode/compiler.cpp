@@ -9,43 +9,103 @@
 #include <stdexcept>
 
 #include "../builtins/builtin_objects.hpp"
+#include "constant_folder.hpp"
 #include "object.hpp"
+#include "peephole.hpp"
 
-Compiler::Compiler(GCHeap& heap) : heap_(heap), has_error_(false) {
+ResolvedVariable resolve_global(GlobalTable& globals, const std::string& name) {
+  uint32_t index = globals.resolve(name);
+  return {VariableKind::GLOBAL, index, globals.get(index).is_mutable};
+}
+
+uint32_t add_upvalue(std::vector<UpvalueInfo>& upvalues, UpvalueInfo upvalue) {
+  for (uint32_t i = 0; i < upvalues.size(); ++i) {
+    if (upvalues[i].index == upvalue.index && upvalues[i].is_local == upvalue.is_local) {
+      return i;
+    }
+  }
+  upvalues.push_back(upvalue);
+  return static_cast<uint32_t>(upvalues.size() - 1);
+}
+
+uint32_t add_function_constant(GCHeap& heap, Chunk& chunk, const FunctionStatementNode& stmt) {
+  std::vector<std::string> param_names;
+  param_names.reserve(stmt.parameters.size());
+  for (const auto& param : stmt.parameters) {
+    param_names.push_back(param->name);
+  }
+
+  auto* function = heap.allocate<PEBBLFunction>(
+      stmt.name->name, std::move(param_names), std::unique_ptr<Chunk>());
+  return chunk.add_constant(PEBBLObject::make_gc_ptr(function));
+}
+
+bool finish_function_constant(GCHeap& heap, Chunk& chunk, uint32_t index,
+                              std::unique_ptr<Chunk> body, std::vector<UpvalueInfo> upvalues) {
+  auto* function = static_cast<PEBBLFunction*>(chunk.constants[index].as_gc_ptr());
+  function->chunk = std::move(body);
+  function->upvalues = std::move(upvalues);
+  heap.remember(function);
+  return !function->upvalues.empty();
+}
+
+void record_global_names(const GlobalTable& globals, Chunk& chunk) {
+  chunk.variable_names.clear();
+  chunk.variable_names.reserve(globals.size());
+  for (uint32_t i = 0; i < globals.size(); ++i) {
+    chunk.variable_names.push_back(globals.get(i).name);
+  }
+}
+
+void report_compile_error(const std::string& message, const Token* token) {
+  std::cerr << "Compilation Error";
+  if (token) {
+    std::cerr << " at line " << token->line;
+  }
+  std::cerr << ": " << message << std::endl;
+}
+
+Compiler::Compiler(GCHeap& heap, GlobalTable& globals) :
+    heap_(heap), globals_(globals), has_error_(false), current_line_(0) {
+  // String and function constants are only reachable through the chunks being built
+  root_tracer_token_ = heap_.add_root_tracer([this](Tracer& tracer) { this->trace_roots(tracer); });
+}
+
+Compiler::~Compiler() {
+  heap_.remove_root_tracer(root_tracer_token_);
 }
 
 std::unique_ptr<Chunk> Compiler::compile(const ProgramNode& program) {
   current_chunk_ = std::make_unique<Chunk>();
+  enclosing_chunks_.clear();
   has_error_ = false;
 
   // Clear scope stack and push global scope
-  while (!scope_stack_.empty()) {
-    scope_stack_.pop();
-  }
+  scope_stack_.clear();
   push_scope(ScopeType::GLOBAL);
 
-  // Compile all statements
-  for (const auto& statement : program.statements) {
-    compile_statement(*statement);
-    if (has_error_) {
-      return nullptr;
-    }
+  // Compile all statements; a trailing expression's value is left as the program result
+  compile_statement_list(program.statements);
+  if (has_error_) {
+    return nullptr;
   }
 
   // Add halt instruction at the end
   emit_instruction(OpCode::HALT);
 
   pop_scope();
+  record_global_names(globals_, *current_chunk_);
+  optimize_chunk(*current_chunk_);
+  encode_chunk(*current_chunk_);
   return std::move(current_chunk_);
 }
 
 std::unique_ptr<Chunk> Compiler::compile_expression(const ExpressionNode& expr) {
   current_chunk_ = std::make_unique<Chunk>();
+  enclosing_chunks_.clear();
   has_error_ = false;
 
-  while (!scope_stack_.empty()) {
-    scope_stack_.pop();
-  }
+  scope_stack_.clear();
   push_scope(ScopeType::GLOBAL);
 
   compile_expression_impl(expr);
@@ -60,10 +120,50 @@ std::unique_ptr<Chunk> Compiler::compile_expression(const ExpressionNode& expr)
     return nullptr;
   }
 
+  record_global_names(globals_, *current_chunk_);
+  optimize_chunk(*current_chunk_);
+  encode_chunk(*current_chunk_);
   return std::move(current_chunk_);
 }
 
+void Compiler::trace_roots(Tracer& tracer) {
+  auto trace_chunk = [&tracer](Chunk* chunk) {
+    if (!chunk) return;
+    for (auto& constant : chunk->constants) {
+      tracer.visit(constant);
+    }
+  };
+
+  trace_chunk(current_chunk_.get());
+  for (const auto& chunk : enclosing_chunks_) {
+    trace_chunk(chunk.get());
+  }
+}
+
+bool Compiler::compile_statement_list(
+    const std::vector<std::unique_ptr<StatementNode>>& statements) {
+  for (size_t i = 0; i < statements.size(); ++i) {
+    const StatementNode& statement = *statements[i];
+    if (i + 1 == statements.size() && statement.type() == ASTType::EXPRESSION_STATEMENT) {
+      // Keep the value of a trailing expression statement on the stack
+      compile_expression_impl(*static_cast<const ExpressionStatementNode&>(statement).expression);
+      return !has_error_;
+    }
+    compile_statement(statement);
+    if (has_error_ || always_returns(statement)) {
+      return false;
+    }
+  }
+  return false;
+}
+
 void Compiler::compile_statement(const StatementNode& stmt) {
+  // Instructions take the line of the innermost node with a token, restored when it is done
+  uint32_t enclosing_line = current_line_;
+  if (const Token* token = stmt.get_token()) {
+    current_line_ = static_cast<uint32_t>(token->line);
+  }
+
   switch (stmt.type()) {
     case ASTType::EXPRESSION_STATEMENT:
       compile_expression_statement(static_cast<const ExpressionStatementNode&>(stmt));
@@ -89,28 +189,31 @@ void Compiler::compile_statement(const StatementNode& stmt) {
     default:
       error("Unknown statement type", stmt.get_token());
   }
+  current_line_ = enclosing_line;
 }
 
 void Compiler::compile_expression_statement(const ExpressionStatementNode& stmt) {
-  compile_expression(*stmt.expression);
-  // Expression statements need to pop their result if not at global scope
-  if (!is_global_scope()) {
-    emit_instruction(OpCode::POP);
-  }
+  compile_expression_impl(*stmt.expression);
+  // Statements leave the stack as they found it so local slots stay at fixed offsets
+  emit_instruction(OpCode::POP);
 }
 
 void Compiler::compile_variable_statement(const VariableStatementNode& stmt) {
   // Compile the initializer expression
-  compile_expression(*stmt.value);
+  compile_expression_impl(*stmt.value);
 
-  // Define the variable
-  uint32_t var_index = define_variable(stmt.name->name, stmt.is_mutable());
-  emit_instruction(OpCode::DEFINE_VAR, var_index);
+  if (is_global_scope()) {
+    uint32_t global_index = globals_.define(stmt.name->name, stmt.is_mutable());
+    emit_instruction(OpCode::DEFINE_GLOBAL, global_index);
+  } else {
+    // The initializer's value is already in the stack slot of the new local
+    define_variable(stmt.name->name, stmt.is_mutable());
+  }
 }
 
 void Compiler::compile_return_statement(const ReturnStatementNode& stmt) {
   if (stmt.return_value) {
-    compile_expression(*stmt.return_value);
+    compile_expression_impl(*stmt.return_value);
   } else {
     emit_instruction(OpCode::LOAD_NULL);
   }
@@ -122,24 +225,32 @@ void Compiler::compile_block_statement(const BlockStatementNode& stmt) {
 
   for (const auto& statement : stmt.statements) {
     compile_statement(*statement);
-    if (has_error_) break;
+    if (has_error_ || always_returns(*statement)) break;
   }
 
   pop_scope();
 }
 
 void Compiler::compile_while_statement(const WhileLoopStatementNode& stmt) {
+  std::optional<bool> constant_condition = fold_condition(*stmt.condition);
+  if (constant_condition && !*constant_condition) {
+    return;
+  }
+
   push_scope(ScopeType::LOOP);
 
   uint32_t loop_start = current_chunk_->get_instruction_count();
   current_scope().loop_start = loop_start;
 
-  // Compile condition
-  compile_expression(*stmt.condition);
+  std::optional<uint32_t> exit_jump;
+  if (!constant_condition) {
+    // Compile condition
+    compile_expression_impl(*stmt.condition);
 
-  // Jump if false (to end of loop)
-  uint32_t exit_jump = emit_jump(OpCode::JUMP_IF_FALSE);
-  current_scope().loop_exit = exit_jump;
+    // Jump if false (to end of loop)
+    exit_jump = emit_jump(OpCode::JUMP_IF_FALSE);
+    current_scope().loop_exit = *exit_jump;
+  }
 
   // Compile loop body
   compile_statement(*stmt.block);
@@ -148,7 +259,9 @@ void Compiler::compile_while_statement(const WhileLoopStatementNode& stmt) {
   emit_instruction(OpCode::JUMP, loop_start);
 
   // Patch the exit jump
-  patch_jump(exit_jump);
+  if (exit_jump) {
+    patch_jump(*exit_jump);
+  }
 
   pop_scope();
 }
@@ -157,7 +270,7 @@ void Compiler::compile_for_statement(const ForLoopStatementNode& stmt) {
   push_scope(ScopeType::LOOP);
 
   // Compile the iterable expression
-  compile_expression(*stmt.iterable);
+  compile_expression_impl(*stmt.iterable);
 
   // For now, we'll implement a simplified version that assumes array iteration
   // This would need to be extended for different iterable types
@@ -175,39 +288,56 @@ void Compiler::compile_for_statement(const ForLoopStatementNode& stmt) {
 }
 
 void Compiler::compile_function_statement(const FunctionStatementNode& stmt) {
-  // For now, we'll store function definitions as constants
-  // This is simplified - a full implementation would need proper closure handling
+  uint32_t const_index = add_function_constant(heap_, *current_chunk_, stmt);
 
-  // Create a new chunk for the function body
-  auto function_chunk = std::make_unique<Chunk>();
-  auto saved_chunk = std::move(current_chunk_);
-  current_chunk_ = std::move(function_chunk);
+  // A local function's slot exists before its body is compiled so the body can capture it
+  bool is_global = is_global_scope();
+  if (!is_global) {
+    define_variable(stmt.name->name, false);
+  }
+
+  // Compile the body into the function's own chunk
+  enclosing_chunks_.push_back(std::move(current_chunk_));
+  current_chunk_ = std::make_unique<Chunk>();
 
   push_scope(ScopeType::FUNCTION);
 
-  // Define parameters as local variables
+  // Parameters occupy the first local slots, where the caller left the arguments
   for (const auto& param : stmt.parameters) {
     define_variable(param->name, true);
   }
 
-  // Compile function body
-  compile_statement(*stmt.body);
-
-  // Ensure function returns null if no explicit return
-  emit_instruction(OpCode::LOAD_NULL);
+  // Like the tree-walker, the function yields its trailing expression if there is no return
+  if (!compile_statement_list(stmt.body->statements)) {
+    emit_instruction(OpCode::LOAD_NULL);
+  }
   emit_instruction(OpCode::RETURN);
 
+  std::vector<UpvalueInfo> upvalues = std::move(current_scope().upvalues);
   pop_scope();
 
-  // TODO: Store the compiled function chunk as a constant
-  // This would require extending the object system to handle compiled functions
+  std::unique_ptr<Chunk> body_chunk = std::move(current_chunk_);
+  optimize_chunk(*body_chunk);
+  encode_chunk(*body_chunk);
+  current_chunk_ = std::move(enclosing_chunks_.back());
+  enclosing_chunks_.pop_back();
 
-  current_chunk_ = std::move(saved_chunk);
+  bool needs_closure = finish_function_constant(
+      heap_, *current_chunk_, const_index, std::move(body_chunk), std::move(upvalues));
+  emit_instruction(needs_closure ? OpCode::CLOSURE : OpCode::LOAD_CONST, const_index);
 
-  error("Function definitions not yet fully implemented in bytecode compiler", stmt.get_token());
+  // Functions are immutable by default
+  if (is_global) {
+    emit_instruction(OpCode::DEFINE_GLOBAL, globals_.define(stmt.name->name, false));
+  }
 }
 
 void Compiler::compile_expression_impl(const ExpressionNode& expr) {
+  uint32_t enclosing_line = current_line_;
+  if (const Token* token = expr.get_token()) {
+    current_line_ = static_cast<uint32_t>(token->line);
+  }
+
   switch (expr.type()) {
     case ASTType::INTEGER_LITERAL:
     case ASTType::FLOAT_LITERAL:
@@ -242,6 +372,7 @@ void Compiler::compile_expression_impl(const ExpressionNode& expr) {
     default:
       error("Unknown expression type", expr.get_token());
   }
+  current_line_ = enclosing_line;
 }
 
 void Compiler::compile_literal(const LiteralNode& expr) {
@@ -281,15 +412,30 @@ void Compiler::compile_literal(const LiteralNode& expr) {
 
 void Compiler::compile_identifier(const IdentifierNode& expr) {
   // Treat all identifiers as variables (including builtin functions)
-  // The VM will resolve builtin functions from its global environment
-  uint32_t var_index = resolve_variable(expr.name);
-  emit_instruction(OpCode::LOAD_VAR, var_index);
+  // Builtin functions occupy global slots registered by the interpreter
+  ResolvedVariable variable = resolve_variable(expr.name);
+  switch (variable.kind) {
+    case VariableKind::LOCAL:
+      emit_instruction(OpCode::LOAD_LOCAL, variable.index);
+      break;
+    case VariableKind::UPVALUE:
+      emit_instruction(OpCode::LOAD_UPVALUE, variable.index);
+      break;
+    case VariableKind::GLOBAL:
+      emit_instruction(OpCode::LOAD_GLOBAL, variable.index);
+      break;
+  }
 }
 
 void Compiler::compile_binary_expression(const BinaryExpressionNode& expr) {
+  if (std::optional<PEBBLObject> value = fold_constant(expr)) {
+    emit_constant(*value);
+    return;
+  }
+
   // Compile operands (left first, then right for stack order)
-  compile_expression(*expr.left);
-  compile_expression(*expr.right);
+  compile_expression_impl(*expr.left);
+  compile_expression_impl(*expr.right);
 
   // Emit the appropriate operation
   OpCode opcode = binary_op_to_opcode(expr.operator_token.type);
@@ -301,8 +447,13 @@ void Compiler::compile_binary_expression(const BinaryExpressionNode& expr) {
 }
 
 void Compiler::compile_unary_expression(const UnaryExpressionNode& expr) {
+  if (std::optional<PEBBLObject> value = fold_constant(expr)) {
+    emit_constant(*value);
+    return;
+  }
+
   // Compile operand
-  compile_expression(*expr.operand);
+  compile_expression_impl(*expr.operand);
 
   // Emit the appropriate operation
   OpCode opcode = unary_op_to_opcode(expr.operator_token.type);
@@ -315,29 +466,48 @@ void Compiler::compile_unary_expression(const UnaryExpressionNode& expr) {
 
 void Compiler::compile_assignment_expression(const AssignmentExpressionNode& expr) {
   // Compile the value
-  compile_expression(*expr.value);
+  compile_expression_impl(*expr.value);
 
   // Handle assignment target
   if (expr.target->type() == ASTType::IDENTIFIER) {
     const auto& identifier = static_cast<const IdentifierNode&>(*expr.target);
-    uint32_t var_index = resolve_variable(identifier.name);
-    emit_instruction(OpCode::STORE_VAR, var_index);
-    // Assignment expressions also leave the value on the stack
-    emit_instruction(OpCode::DUP);
+    ResolvedVariable variable = resolve_variable(identifier.name);
+    // Stores leave the value on the stack, which is the result of the assignment
+    if (variable.kind != VariableKind::GLOBAL && !variable.is_mutable) {
+      error("Cannot assign to immutable variable '" + identifier.name + "'", expr.get_token());
+      return;
+    }
+    if (variable.kind == VariableKind::LOCAL) {
+      emit_instruction(OpCode::STORE_LOCAL, variable.index);
+    } else if (variable.kind == VariableKind::UPVALUE) {
+      emit_instruction(OpCode::STORE_UPVALUE, variable.index);
+    } else {
+      // Global mutability is checked by the VM, since the definition may not be compiled yet
+      emit_instruction(OpCode::STORE_GLOBAL, variable.index);
+    }
   } else {
     error("Invalid assignment target", expr.get_token());
   }
 }
 
 void Compiler::compile_if_else_expression(const IfElseExpressionNode& expr) {
+  if (std::optional<const ExpressionNode*> branch = selected_branch(expr)) {
+    if (*branch) {
+      compile_expression_impl(**branch);
+    } else {
+      emit_instruction(OpCode::LOAD_NULL);
+    }
+    return;
+  }
+
   // Compile condition
-  compile_expression(*expr.condition);
+  compile_expression_impl(*expr.condition);
 
   // Jump if false to else branch
   uint32_t else_jump = emit_jump(OpCode::JUMP_IF_FALSE);
 
   // Compile then branch
-  compile_expression(*expr.then_expression);
+  compile_expression_impl(*expr.then_expression);
 
   if (expr.else_expression) {
     // Jump over else branch
@@ -347,7 +517,7 @@ void Compiler::compile_if_else_expression(const IfElseExpressionNode& expr) {
     patch_jump(else_jump);
 
     // Compile else branch
-    compile_expression(*expr.else_expression);
+    compile_expression_impl(*expr.else_expression);
 
     // Patch end jump
     patch_jump(end_jump);
@@ -361,7 +531,7 @@ void Compiler::compile_if_else_expression(const IfElseExpressionNode& expr) {
 void Compiler::compile_array_literal(const ArrayLiteralNode& expr) {
   // Compile all elements
   for (const auto& element : expr.elements) {
-    compile_expression(*element);
+    compile_expression_impl(*element);
   }
 
   // Build array with the number of elements
@@ -371,8 +541,8 @@ void Compiler::compile_array_literal(const ArrayLiteralNode& expr) {
 void Compiler::compile_dict_literal(const DictLiteralNode& expr) {
   // Compile all key-value pairs
   for (const auto& [key_ptr, value_ptr] : expr.entries) {
-    compile_expression(*key_ptr);    // Key
-    compile_expression(*value_ptr);  // Value
+    compile_expression_impl(*key_ptr);    // Key
+    compile_expression_impl(*value_ptr);  // Value
   }
 
   // Build dictionary with the number of pairs
@@ -381,11 +551,11 @@ void Compiler::compile_dict_literal(const DictLiteralNode& expr) {
 
 void Compiler::compile_call_expression(const CallExpressionNode& expr) {
   // Compile function expression
-  compile_expression(*expr.function);
+  compile_expression_impl(*expr.function);
 
   // Compile arguments
   for (const auto& arg : expr.arguments) {
-    compile_expression(*arg);
+    compile_expression_impl(*arg);
   }
 
   // Emit call instruction with argument count
@@ -397,7 +567,7 @@ void Compiler::emit_instruction(OpCode opcode) {
     error("Compiler error: current_chunk_ is null");
     return;
   }
-  current_chunk_->add_instruction(opcode);
+  current_chunk_->add_instruction(opcode, 0, current_line_);
 }
 
 void Compiler::emit_instruction(OpCode opcode, uint32_t operand) {
@@ -405,7 +575,17 @@ void Compiler::emit_instruction(OpCode opcode, uint32_t operand) {
     error("Compiler error: current_chunk_ is null");
     return;
   }
-  current_chunk_->add_instruction(opcode, operand);
+  current_chunk_->add_instruction(opcode, operand, current_line_);
+}
+
+void Compiler::emit_constant(PEBBLObject value) {
+  if (value.is_null()) {
+    emit_instruction(OpCode::LOAD_NULL);
+  } else if (value.is_bool()) {
+    emit_instruction(value.as_bool() ? OpCode::LOAD_TRUE : OpCode::LOAD_FALSE);
+  } else {
+    emit_instruction(OpCode::LOAD_CONST, add_constant(value));
+  }
 }
 
 uint32_t Compiler::emit_jump(OpCode opcode) {
@@ -414,7 +594,7 @@ uint32_t Compiler::emit_jump(OpCode opcode) {
     return 0;
   }
   uint32_t instruction_index = current_chunk_->get_instruction_count();
-  current_chunk_->add_instruction(opcode, 0);  // Placeholder operand
+  current_chunk_->add_instruction(opcode, 0, current_line_);  // Placeholder operand
   return instruction_index;
 }
 
@@ -436,67 +616,120 @@ uint32_t Compiler::add_constant(PEBBLObject constant) {
 }
 
 void Compiler::push_scope(ScopeType type) {
-  scope_stack_.emplace(type);
+  // Blocks and loops continue the enclosing frame's slots; functions start a new frame
+  uint32_t first_slot = 0;
+  if ((type == ScopeType::BLOCK || type == ScopeType::LOOP) && !scope_stack_.empty()) {
+    first_slot = scope_stack_.back().variable_count;
+  }
+  scope_stack_.emplace_back(type, first_slot);
 }
 
 void Compiler::pop_scope() {
-  if (!scope_stack_.empty()) {
-    scope_stack_.pop();
+  if (scope_stack_.empty()) {
+    return;
   }
+
+  // Release the block's locals, moving captured ones to the heap; a function's frame is discarded
+  // as a whole by RETURN
+  const CompilationScope& scope = scope_stack_.back();
+  if (scope.type == ScopeType::BLOCK || scope.type == ScopeType::LOOP) {
+    auto& captured = scope_stack_[function_scope_start(scope_stack_.size() - 1)].captured_slots;
+    for (uint32_t slot = scope.variable_count; slot > scope.first_slot; --slot) {
+      if (slot - 1 < captured.size() && captured[slot - 1]) {
+        captured[slot - 1] = false;
+        emit_instruction(OpCode::CLOSE_UPVALUE);
+      } else {
+        emit_instruction(OpCode::POP);
+      }
+    }
+  }
+  scope_stack_.pop_back();
 }
 
 CompilationScope& Compiler::current_scope() {
   if (scope_stack_.empty()) {
     throw std::runtime_error("No active compilation scope");
   }
-  return scope_stack_.top();
+  return scope_stack_.back();
 }
 
-uint32_t Compiler::resolve_variable(const std::string& name) {
-  // Look up variable in current scope chain
-  auto& scope = current_scope();
-  auto it = scope.variables.find(name);
-  if (it != scope.variables.end()) {
-    return it->second.index;
+ResolvedVariable Compiler::resolve_variable(const std::string& name) {
+  // Innermost declaration in the current function wins, then locals of enclosing functions
+  size_t function_start = function_scope_start(scope_stack_.size() - 1);
+  if (const VariableInfo* local = find_local(name, function_start, scope_stack_.size())) {
+    return {VariableKind::LOCAL, local->index, local->is_mutable};
   }
 
-  // For simplicity, return a name index for global lookup
-  if (!current_chunk_) {
-    error("Compiler error: current_chunk_ is null");
-    return 0;
+  // Functions are identified by the index of their scope; the locals in scope where one is
+  // defined are those of the enclosing function's scopes below it
+  auto enclosing = [this](size_t start) -> std::optional<size_t> {
+    if (start == 0) {
+      return std::nullopt;
+    }
+    return function_scope_start(start - 1);
+  };
+  auto capture_local = [this](size_t start,
+                              const std::string& local_name) -> std::optional<UpvalueInfo> {
+    size_t enclosing_start = function_scope_start(start - 1);
+    const VariableInfo* local = find_local(local_name, enclosing_start, start);
+    if (!local) {
+      return std::nullopt;
+    }
+    auto& captured = scope_stack_[enclosing_start].captured_slots;
+    if (captured.size() <= local->index) {
+      captured.resize(local->index + 1, false);
+    }
+    captured[local->index] = true;
+    return UpvalueInfo(local->index, true, local->is_mutable);
+  };
+  auto upvalues = [this](size_t start) -> std::vector<UpvalueInfo>& {
+    return scope_stack_[start].upvalues;
+  };
+  if (auto index = resolve_upvalue(function_start, name, enclosing, capture_local, upvalues)) {
+    return {VariableKind::UPVALUE, *index, upvalues(function_start)[*index].is_mutable};
   }
-  return current_chunk_->add_variable_name(name);
+  return resolve_global(globals_, name);
 }
 
 uint32_t Compiler::define_variable(const std::string& name, bool is_mutable) {
   auto& scope = current_scope();
   uint32_t index = scope.variable_count++;
   scope.variables[name] = VariableInfo(name, is_mutable, index);
-  if (!current_chunk_) {
-    error("Compiler error: current_chunk_ is null");
-    return 0;
+  return index;
+}
+
+size_t Compiler::function_scope_start(size_t scope_index) const {
+  // Blocks and loops share the call frame of the closest function (or the global scope)
+  while (scope_index > 0 && scope_stack_[scope_index].type != ScopeType::FUNCTION) {
+    --scope_index;
+  }
+  return scope_index;
+}
+
+const VariableInfo* Compiler::find_local(
+    const std::string& name, size_t begin, size_t end) const {
+  for (size_t i = end; i > begin; --i) {
+    const auto& variables = scope_stack_[i - 1].variables;
+    auto it = variables.find(name);
+    if (it != variables.end()) {
+      return &it->second;
+    }
   }
-  return current_chunk_->add_variable_name(name);
+  return nullptr;
 }
 
 bool Compiler::is_global_scope() const {
-  return !scope_stack_.empty() && scope_stack_.top().type == ScopeType::GLOBAL;
+  return !scope_stack_.empty() && scope_stack_.back().type == ScopeType::GLOBAL;
 }
 
 void Compiler::error(const std::string& message) {
-  has_error_ = true;
-  error_message_ = message;
-  std::cerr << "Compilation Error: " << message << std::endl;
+  error(message, nullptr);
 }
 
 void Compiler::error(const std::string& message, const Token* token) {
   has_error_ = true;
   error_message_ = message;
-  std::cerr << "Compilation Error";
-  if (token) {
-    std::cerr << " at line " << token->line;
-  }
-  std::cerr << ": " << message << std::endl;
+  report_compile_error(message, token);
 }
 
 OpCode Compiler::binary_op_to_opcode(TokenType token_type) {
@@ -6,7 +6,8 @@
 #pragma once
 
 #include <memory>
-#include <stack>
+#include <optional>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -21,18 +22,124 @@ enum class ScopeType { GLOBAL, FUNCTION, BLOCK, LOOP };
 
 /**
  * @brief Compilation scope information
+ *
+ * Locals live in consecutive stack slots of the enclosing call frame, so a nested block starts
+ * allocating where its parent left off and releases its slots when it ends.
  */
 struct CompilationScope {
   ScopeType type;
   std::unordered_map<std::string, VariableInfo> variables;
-  uint32_t variable_count;
-  uint32_t loop_start;  // For loop scopes
-  uint32_t loop_exit;   // For loop scopes
+  uint32_t first_slot;      // First stack slot owned by this scope
+  uint32_t variable_count;  // Next free stack slot (relative to the frame's stack base)
+  uint32_t loop_start;      // For loop scopes
+  uint32_t loop_exit;       // For loop scopes
 
-  CompilationScope(ScopeType t) : type(t), variable_count(0), loop_start(0), loop_exit(0) {
+  // Function and global scopes describe a whole call frame
+  std::vector<UpvalueInfo> upvalues;  // Variables the function captures, by upvalue index
+  std::vector<bool> captured_slots;   // Frame slots captured by a nested function
+
+  CompilationScope(ScopeType t, uint32_t first = 0) :
+      type(t), first_slot(first), variable_count(first), loop_start(0), loop_exit(0) {
   }
 };
 
+/**
+ * @brief Storage class of a resolved variable reference
+ */
+enum class VariableKind { LOCAL, UPVALUE, GLOBAL };
+
+/**
+ * @brief Result of resolving a variable name at compile time
+ */
+struct ResolvedVariable {
+  VariableKind kind;
+  uint32_t index;  // Stack slot, closure upvalue index or global table slot
+  bool is_mutable;
+};
+
+// Helpers shared by Compiler and RegisterCompiler, which differ in the instructions they emit
+// but not in how they resolve names and build function constants
+
+/**
+ * @brief Resolve a name that is not declared locally as a global
+ *
+ * The global may be defined later, so its slot is reserved if the name is unknown and its
+ * mutability is checked by the VM when it is assigned.
+ */
+ResolvedVariable resolve_global(GlobalTable& globals, const std::string& name);
+
+/**
+ * @brief Get the index of an upvalue in a function's upvalue list, adding it if it is new
+ */
+uint32_t add_upvalue(std::vector<UpvalueInfo>& upvalues, UpvalueInfo upvalue);
+
+/**
+ * @brief Resolve a name to an upvalue of a function being compiled, adding upvalues as needed
+ *
+ * A local of the enclosing function is captured directly. Anything else must reach the
+ * function through the enclosing function's own closure, so it is resolved there first, up to
+ * the top-level code, which has no enclosing frame. The compilers only differ in how they store
+ * the functions being compiled, which they describe with the three callbacks.
+ *
+ * @param function Function being compiled, identified by the compiler
+ * @param name Name to resolve
+ * @param enclosing Maps a function to the one it is defined in, or to nullopt at top level
+ * @param capture_local Looks up a name among the locals in scope where a function is defined;
+ *                      marks a local it finds as captured and returns it as a local upvalue
+ * @param upvalues Maps a function to its upvalue list
+ * @return Upvalue index, or nullopt if no enclosing function declares the name
+ */
+template <typename Enclosing, typename CaptureLocal, typename Upvalues>
+std::optional<uint32_t> resolve_upvalue(size_t function, const std::string& name,
+                                        Enclosing&& enclosing, CaptureLocal&& capture_local,
+                                        Upvalues&& upvalues) {
+  std::optional<size_t> enclosing_function = enclosing(function);
+  if (!enclosing_function) {
+    return std::nullopt;
+  }
+
+  if (std::optional<UpvalueInfo> local = capture_local(function, name)) {
+    return add_upvalue(upvalues(function), *local);
+  }
+  if (auto index =
+          resolve_upvalue(*enclosing_function, name, enclosing, capture_local, upvalues)) {
+    bool is_mutable = upvalues(*enclosing_function)[*index].is_mutable;
+    return add_upvalue(upvalues(function), UpvalueInfo(*index, false, is_mutable));
+  }
+  return std::nullopt;
+}
+
+/**
+ * @brief Add the function object for a function declaration to a chunk's constant pool
+ *
+ * The function is added without a body, before its body is compiled, so it stays reachable if
+ * compiling the body triggers a collection. finish_function_constant supplies the body.
+ *
+ * @return Constant pool index of the function
+ */
+uint32_t add_function_constant(GCHeap& heap, Chunk& chunk, const FunctionStatementNode& stmt);
+
+/**
+ * @brief Give a function constant its compiled body and the variables it captures
+ *
+ * The function is fetched again from the constant pool, since compiling the body may have
+ * moved it.
+ *
+ * @return Whether the function captures variables, and so needs a closure object at runtime
+ */
+bool finish_function_constant(GCHeap& heap, Chunk& chunk, uint32_t index,
+                              std::unique_ptr<Chunk> body, std::vector<UpvalueInfo> upvalues);
+
+/**
+ * @brief Record global names by slot in a chunk, for disassembly and error messages
+ */
+void record_global_names(const GlobalTable& globals, Chunk& chunk);
+
+/**
+ * @brief Print a compilation error, with the line of the token it was found at if there is one
+ */
+void report_compile_error(const std::string& message, const Token* token);
+
 /**
  * @brief Compiler for converting AST to bytecode
  */
@@ -41,8 +148,14 @@ public:
   /**
    * @brief Constructor
    * @param heap GC heap for allocating string constants
+   * @param globals Global slot table shared with the VM that runs the compiled chunks
+   */
+  Compiler(GCHeap& heap, GlobalTable& globals);
+
+  /**
+   * @brief Destructor; stops the heap from tracing this compiler's constants
    */
-  explicit Compiler(GCHeap& heap);
+  ~Compiler();
 
   /**
    * @brief Compile a program AST to bytecode
@@ -58,14 +171,25 @@ public:
    */
   std::unique_ptr<Chunk> compile_expression(const ExpressionNode& expr);
 
+  /**
+   * @brief Trace GC roots (constants of the chunks being compiled)
+   * @param tracer GC tracer
+   */
+  void trace_roots(class Tracer& tracer);
+
 private:
   GCHeap& heap_;
+  RootToken root_tracer_token_;  // Registration of trace_roots with the heap
+  GlobalTable& globals_;
   std::unique_ptr<Chunk> current_chunk_;
-  std::stack<CompilationScope> scope_stack_;
+  std::vector<std::unique_ptr<Chunk>> enclosing_chunks_;  // Suspended while compiling a function
+  std::vector<CompilationScope> scope_stack_;
   bool has_error_;
   std::string error_message_;
+  uint32_t current_line_;  // Source line recorded for emitted instructions
 
   // Compilation methods for statements
+  bool compile_statement_list(const std::vector<std::unique_ptr<StatementNode>>& statements);
   void compile_statement(const StatementNode& stmt);
   void compile_expression_statement(const ExpressionStatementNode& stmt);
   void compile_variable_statement(const VariableStatementNode& stmt);
@@ -90,6 +214,7 @@ private:
   // Utility methods
   void emit_instruction(OpCode opcode);
   void emit_instruction(OpCode opcode, uint32_t operand);
+  void emit_constant(PEBBLObject value);  // Load a folded number, boolean or null
   uint32_t emit_jump(OpCode opcode);
   void patch_jump(uint32_t instruction_index);
   uint32_t add_constant(PEBBLObject constant);
@@ -100,8 +225,10 @@ private:
   CompilationScope& current_scope();
 
   // Variable management
-  uint32_t resolve_variable(const std::string& name);
+  ResolvedVariable resolve_variable(const std::string& name);
   uint32_t define_variable(const std::string& name, bool is_mutable);
+  size_t function_scope_start(size_t scope_index) const;
+  const VariableInfo* find_local(const std::string& name, size_t begin, size_t end) const;
   bool is_global_scope() const;
 
   // Error handling
@@ -0,0 +1,224 @@
+/**
+ * @file constant_folder.cpp
+ * @brief Implementation of compile-time constant and control flow evaluation
+ */
+
+#include "constant_folder.hpp"
+
+#include <cstdint>
+#include <limits>
+
+namespace {
+
+bool is_number(PEBBLObject value) {
+  return value.is_int32() || value.is_double();
+}
+
+double number_as_double(PEBBLObject value) {
+  return value.is_int32() ? value.as_int32() : value.as_double();
+}
+
+/**
+ * @brief Fold +, -, * and / on two constants
+ */
+std::optional<PEBBLObject> fold_arithmetic(TokenType op, PEBBLObject left, PEBBLObject right) {
+  if (!is_number(left) || !is_number(right)) {
+    return std::nullopt;
+  }
+
+  if (left.is_int32() && right.is_int32() && op != TokenType::SLASH) {
+    int64_t a = left.as_int32();
+    int64_t b = right.as_int32();
+    int64_t result = op == TokenType::PLUS ? a + b : op == TokenType::MINUS ? a - b : a * b;
+    // The engines compute in 32 bits, so an overflowing result is left to them
+    if (result < std::numeric_limits<int32_t>::min() ||
+        result > std::numeric_limits<int32_t>::max()) {
+      return std::nullopt;
+    }
+    return PEBBLObject::make_int32(static_cast<int32_t>(result));
+  }
+
+  // Division always produces a double, as do mixed int32 and double operands
+  double a = number_as_double(left);
+  double b = number_as_double(right);
+  switch (op) {
+    case TokenType::PLUS:
+      return PEBBLObject::make_double(a + b);
+    case TokenType::MINUS:
+      return PEBBLObject::make_double(a - b);
+    case TokenType::ASTERISK:
+      return PEBBLObject::make_double(a * b);
+    default:
+      if (b == 0.0) {
+        return std::nullopt;  // Division by zero is a runtime error
+      }
+      return PEBBLObject::make_double(a / b);
+  }
+}
+
+/**
+ * @brief Fold <, >, <= and >= on two constants
+ */
+std::optional<PEBBLObject> fold_comparison(TokenType op, PEBBLObject left, PEBBLObject right) {
+  if (!is_number(left) || !is_number(right)) {
+    return std::nullopt;
+  }
+  // Every int32 converts to a double exactly, so one comparison covers all operand types
+  double a = number_as_double(left);
+  double b = number_as_double(right);
+  switch (op) {
+    case TokenType::LESS:
+      return PEBBLObject::make_bool(a < b);
+    case TokenType::GREATER:
+      return PEBBLObject::make_bool(a > b);
+    case TokenType::LESS_EQUAL:
+      return PEBBLObject::make_bool(a <= b);
+    default:
+      return PEBBLObject::make_bool(a >= b);
+  }
+}
+
+/**
+ * @brief Equality of two constants, which are numbers, booleans or null
+ */
+bool constants_equal(PEBBLObject left, PEBBLObject right) {
+  if (left.is_null() || right.is_null()) {
+    return left.is_null() && right.is_null();
+  }
+  if (left.is_bool() && right.is_bool()) {
+    return left.as_bool() == right.as_bool();
+  }
+  if (is_number(left) && is_number(right)) {
+    return number_as_double(left) == number_as_double(right);
+  }
+  return false;
+}
+
+std::optional<PEBBLObject> fold_binary(const BinaryExpressionNode& expr) {
+  std::optional<PEBBLObject> left = fold_constant(*expr.left);
+  if (!left) {
+    return std::nullopt;
+  }
+  std::optional<PEBBLObject> right = fold_constant(*expr.right);
+  if (!right) {
+    return std::nullopt;
+  }
+
+  TokenType op = expr.operator_token.type;
+  switch (op) {
+    case TokenType::PLUS:
+    case TokenType::MINUS:
+    case TokenType::ASTERISK:
+    case TokenType::SLASH:
+      return fold_arithmetic(op, *left, *right);
+    case TokenType::LESS:
+    case TokenType::GREATER:
+    case TokenType::LESS_EQUAL:
+    case TokenType::GREATER_EQUAL:
+      return fold_comparison(op, *left, *right);
+    case TokenType::EQUAL:
+      return PEBBLObject::make_bool(constants_equal(*left, *right));
+    case TokenType::NOT_EQUAL:
+      return PEBBLObject::make_bool(!constants_equal(*left, *right));
+    case TokenType::AND:
+      return PEBBLObject::make_bool(is_truthy_constant(*left) && is_truthy_constant(*right));
+    case TokenType::OR:
+      return PEBBLObject::make_bool(is_truthy_constant(*left) || is_truthy_constant(*right));
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<PEBBLObject> fold_unary(const UnaryExpressionNode& expr) {
+  std::optional<PEBBLObject> operand = fold_constant(*expr.operand);
+  if (!operand) {
+    return std::nullopt;
+  }
+
+  switch (expr.operator_token.type) {
+    case TokenType::MINUS:
+      if (operand->is_int32() && operand->as_int32() != std::numeric_limits<int32_t>::min()) {
+        return PEBBLObject::make_int32(-operand->as_int32());
+      } else if (operand->is_double()) {
+        return PEBBLObject::make_double(-operand->as_double());
+      }
+      return std::nullopt;
+    case TokenType::BANG:
+      return PEBBLObject::make_bool(!is_truthy_constant(*operand));
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<PEBBLObject> fold_if_else(const IfElseExpressionNode& expr) {
+  std::optional<const ExpressionNode*> branch = selected_branch(expr);
+  if (!branch) {
+    return std::nullopt;
+  }
+  return *branch ? fold_constant(**branch) : PEBBLObject::make_null();
+}
+
+}  // namespace
+
+std::optional<PEBBLObject> fold_constant(const ExpressionNode& expr) {
+  switch (expr.type()) {
+    case ASTType::INTEGER_LITERAL:
+      // Truncated to int32 like the engines do when loading the literal
+      return PEBBLObject::make_int32(
+          static_cast<int32_t>(static_cast<const IntegerLiteralNode&>(expr).value));
+    case ASTType::FLOAT_LITERAL:
+      return PEBBLObject::make_double(static_cast<const FloatLiteralNode&>(expr).value);
+    case ASTType::BOOLEAN_LITERAL:
+      return PEBBLObject::make_bool(static_cast<const BooleanLiteralNode&>(expr).value);
+    case ASTType::BINARY_EXPRESSION:
+      return fold_binary(static_cast<const BinaryExpressionNode&>(expr));
+    case ASTType::UNARY_EXPRESSION:
+      return fold_unary(static_cast<const UnaryExpressionNode&>(expr));
+    case ASTType::IF_ELSE_EXPRESSION:
+      return fold_if_else(static_cast<const IfElseExpressionNode&>(expr));
+    default:
+      return std::nullopt;
+  }
+}
+
+bool is_truthy_constant(PEBBLObject value) {
+  if (value.is_bool()) {
+    return value.as_bool();
+  } else if (value.is_null()) {
+    return false;
+  } else if (value.is_int32()) {
+    return value.as_int32() != 0;
+  } else if (value.is_double()) {
+    return value.as_double() != 0.0;
+  }
+  return true;
+}
+
+std::optional<bool> fold_condition(const ExpressionNode& condition) {
+  if (std::optional<PEBBLObject> value = fold_constant(condition)) {
+    return is_truthy_constant(*value);
+  }
+  return std::nullopt;
+}
+
+std::optional<const ExpressionNode*> selected_branch(const IfElseExpressionNode& expr) {
+  std::optional<bool> condition = fold_condition(*expr.condition);
+  if (!condition) {
+    return std::nullopt;
+  }
+  return *condition ? expr.then_expression.get() : expr.else_expression.get();
+}
+
+bool always_returns(const StatementNode& stmt) {
+  if (stmt.type() == ASTType::RETURN_STATEMENT) {
+    return true;
+  }
+  if (stmt.type() == ASTType::BLOCK_STATEMENT) {
+    for (const auto& statement : static_cast<const BlockStatementNode&>(stmt).statements) {
+      if (always_returns(*statement)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file constant_folder.hpp
+ * @brief Compile-time evaluation of constant expressions and control flow, shared by the
+ *        bytecode compilers
+ */
+
+#pragma once
+
+#include <optional>
+
+#include "ast.hpp"
+#include "object.hpp"
+
+/**
+ * @brief Evaluate an expression at compile time if its value cannot depend on the program state
+ *
+ * Number and boolean literals are constant, as are unary, binary and if-else expressions whose
+ * operands are. String literals are not: each evaluation creates a new string, and strings
+ * compare by identity. The result follows the tree-walker's rules exactly, int32 arithmetic
+ * staying int32 and mixed operands being computed in double precision. Expressions that would
+ * fail at runtime (type errors, division by zero, int32 overflow) are left for the engine to
+ * report and are not folded.
+ *
+ * @param expr Expression to evaluate
+ * @return Value of the expression, or nullopt if it must be computed at runtime
+ */
+std::optional<PEBBLObject> fold_constant(const ExpressionNode& expr);
+
+/**
+ * @brief Truthiness of a value, as used by conditions and logical operators
+ */
+bool is_truthy_constant(PEBBLObject value);
+
+/**
+ * @brief Truthiness of a condition whose value is known at compile time
+ *
+ * A loop with a constant condition needs no test, since it either never runs or never exits.
+ *
+ * @return Truthiness of the condition, or nullopt if it must be evaluated at runtime
+ */
+std::optional<bool> fold_condition(const ExpressionNode& condition);
+
+/**
+ * @brief Branch of an if-else expression that a constant condition selects, the only one that
+ *        needs compiling
+ *
+ * @return nullopt if the condition must be evaluated at runtime; otherwise the selected branch,
+ *         which is null when a false condition has no else branch
+ */
+std::optional<const ExpressionNode*> selected_branch(const IfElseExpressionNode& expr);
+
+/**
+ * @brief Whether control never continues past a statement, making what follows it unreachable
+ */
+bool always_returns(const StatementNode& stmt);
@@ -0,0 +1,177 @@
+/**
+ * @file peephole.cpp
+ * @brief Implementation of the peephole optimizer
+ */
+
+#include "peephole.hpp"
+
+#include <initializer_list>
+
+namespace {
+
+bool is_jump(OpCode opcode) {
+  switch (opcode) {
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * @brief Fused form of a comparison followed by JUMP_IF_FALSE, or HALT if there is none
+ */
+OpCode jump_unless(OpCode comparison) {
+  switch (comparison) {
+    case OpCode::LESS:
+      return OpCode::JUMP_IF_NOT_LESS;
+    case OpCode::GREATER:
+      return OpCode::JUMP_IF_NOT_GREATER;
+    case OpCode::LESS_EQUAL:
+      return OpCode::JUMP_IF_NOT_LESS_EQUAL;
+    case OpCode::GREATER_EQUAL:
+      return OpCode::JUMP_IF_NOT_GREATER_EQUAL;
+    default:
+      return OpCode::HALT;
+  }
+}
+
+/**
+ * @brief Matches sequences starting at one instruction of a chunk
+ */
+class SequenceMatcher {
+public:
+  SequenceMatcher(const std::vector<Instruction>& code, const std::vector<bool>& is_target,
+                  size_t start) :
+      code_(code), is_target_(is_target), start_(start) {
+  }
+
+  /**
+   * @brief Whether the instructions from the start have these opcodes and can be fused, which
+   *        they cannot if a jump lands on any but the first
+   */
+  bool matches(std::initializer_list<OpCode> opcodes) const {
+    if (start_ + opcodes.size() > code_.size()) {
+      return false;
+    }
+    size_t index = start_;
+    for (OpCode opcode : opcodes) {
+      if (code_[index].opcode != opcode || (index != start_ && is_target_[index])) {
+        return false;
+      }
+      ++index;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Operand of the instruction at an offset from the start
+   */
+  uint32_t operand(size_t offset) const {
+    return code_[start_ + offset].operand;
+  }
+
+private:
+  const std::vector<Instruction>& code_;
+  const std::vector<bool>& is_target_;
+  size_t start_;
+};
+
+/**
+ * @brief Fuse the longest sequence starting at an instruction
+ * @param fused Set to the superinstruction, or to the instruction itself if nothing matches
+ * @return Number of instructions replaced by fused
+ */
+size_t fuse(const std::vector<Instruction>& code, const std::vector<bool>& is_target, size_t start,
+            Instruction& fused) {
+  SequenceMatcher at(code, is_target, start);
+  auto packable = [](uint32_t first, uint32_t second) {
+    return first <= PACKED_OPERAND_MAX && second <= PACKED_OPERAND_MAX;
+  };
+
+  // x = x + constant as a statement
+  if (at.matches({OpCode::LOAD_LOCAL, OpCode::LOAD_CONST, OpCode::ADD, OpCode::STORE_LOCAL,
+                  OpCode::POP}) &&
+      at.operand(0) == at.operand(3) && packable(at.operand(0), at.operand(1))) {
+    fused = Instruction(OpCode::INC_LOCAL, pack_operands(at.operand(0), at.operand(1)));
+    return 5;
+  }
+  if (at.matches({OpCode::LOAD_GLOBAL, OpCode::LOAD_CONST, OpCode::ADD, OpCode::STORE_GLOBAL,
+                  OpCode::POP}) &&
+      at.operand(0) == at.operand(3) && packable(at.operand(0), at.operand(1))) {
+    fused = Instruction(OpCode::INC_GLOBAL, pack_operands(at.operand(0), at.operand(1)));
+    return 5;
+  }
+
+  // Assignment statements
+  if (at.matches({OpCode::STORE_LOCAL, OpCode::POP})) {
+    fused = Instruction(OpCode::STORE_LOCAL_POP, at.operand(0));
+    return 2;
+  }
+  if (at.matches({OpCode::STORE_GLOBAL, OpCode::POP})) {
+    fused = Instruction(OpCode::STORE_GLOBAL_POP, at.operand(0));
+    return 2;
+  }
+
+  // Loop and if conditions
+  OpCode jump = jump_unless(code[start].opcode);
+  if (jump != OpCode::HALT && at.matches({code[start].opcode, OpCode::JUMP_IF_FALSE})) {
+    fused = Instruction(jump, at.operand(1));
+    return 2;
+  }
+
+  // Operands of a binary operation on a local and a constant
+  if (at.matches({OpCode::LOAD_LOCAL, OpCode::LOAD_CONST}) &&
+      packable(at.operand(0), at.operand(1))) {
+    fused = Instruction(OpCode::LOAD_LOCAL_LOAD_CONST, pack_operands(at.operand(0), at.operand(1)));
+    return 2;
+  }
+
+  fused = code[start];
+  return 1;
+}
+
+}  // namespace
+
+void optimize_chunk(Chunk& chunk) {
+  const std::vector<Instruction>& code = chunk.instructions;
+
+  std::vector<bool> is_target(code.size() + 1, false);
+  for (const Instruction& instruction : code) {
+    if (is_jump(instruction.opcode) && instruction.operand <= code.size()) {
+      is_target[instruction.operand] = true;
+    }
+  }
+
+  std::vector<Instruction> optimized;
+  std::vector<uint32_t> lines;
+  std::vector<uint32_t> new_index(code.size() + 1);
+  optimized.reserve(code.size());
+  lines.reserve(code.size());
+  for (size_t index = 0; index < code.size();) {
+    Instruction fused;
+    size_t length = fuse(code, is_target, index, fused);
+    // A fused sequence takes the line of its first instruction
+    for (size_t offset = 0; offset < length; ++offset) {
+      new_index[index + offset] = static_cast<uint32_t>(optimized.size());
+    }
+    optimized.push_back(fused);
+    lines.push_back(chunk.get_line(static_cast<uint32_t>(index)));
+    index += length;
+  }
+  new_index[code.size()] = static_cast<uint32_t>(optimized.size());
+
+  for (Instruction& instruction : optimized) {
+    if (is_jump(instruction.opcode) && instruction.operand < new_index.size()) {
+      instruction.operand = new_index[instruction.operand];
+    }
+  }
+  chunk.instructions = std::move(optimized);
+  chunk.lines = std::move(lines);
+}
@@ -0,0 +1,20 @@
+/**
+ * @file peephole.hpp
+ * @brief Peephole optimizer fusing common instruction sequences into superinstructions
+ */
+
+#pragma once
+
+#include "bytecode.hpp"
+
+/**
+ * @brief Rewrite a finished chunk, replacing common instruction sequences by superinstructions
+ *
+ * Fused sequences are the statement `x = x + constant`, an assignment statement's store
+ * followed by its POP, a comparison followed by JUMP_IF_FALSE, and a local loaded before a
+ * constant; the superinstructions are listed in OpCode. A sequence is only fused if no jump
+ * lands inside it. Jump targets and the line table are updated for the shorter code.
+ *
+ * @param chunk Chunk whose compilation is complete
+ */
+void optimize_chunk(Chunk& chunk);
@@ -0,0 +1,660 @@
+/**
+ * @file register_compiler.cpp
+ * @brief Implementation of the AST to register bytecode compiler
+ */
+
+#include "register_compiler.hpp"
+
+#include <algorithm>
+
+#include "../builtins/builtin_objects.hpp"
+#include "constant_folder.hpp"
+#include "object.hpp"
+
+namespace {
+
+/**
+ * @brief Whether evaluating an expression may assign a variable, directly or through a call
+ *
+ * An operand read straight from a local's register is only read when its instruction runs, so
+ * it must not be followed by an operand that could change the local first.
+ */
+bool may_assign(const ExpressionNode& expr) {
+  switch (expr.type()) {
+    case ASTType::ASSIGNMENT_EXPRESSION:
+    case ASTType::CALL_EXPRESSION:
+      return true;
+    case ASTType::BINARY_EXPRESSION: {
+      const auto& binary = static_cast<const BinaryExpressionNode&>(expr);
+      return may_assign(*binary.left) || may_assign(*binary.right);
+    }
+    case ASTType::UNARY_EXPRESSION:
+      return may_assign(*static_cast<const UnaryExpressionNode&>(expr).operand);
+    case ASTType::IF_ELSE_EXPRESSION: {
+      const auto& if_else = static_cast<const IfElseExpressionNode&>(expr);
+      return may_assign(*if_else.condition) || may_assign(*if_else.then_expression) ||
+             (if_else.else_expression && may_assign(*if_else.else_expression));
+    }
+    case ASTType::ARRAY_LITERAL:
+      for (const auto& element : static_cast<const ArrayLiteralNode&>(expr).elements) {
+        if (may_assign(*element)) {
+          return true;
+        }
+      }
+      return false;
+    case ASTType::DICT_LITERAL:
+      for (const auto& [key, value] : static_cast<const DictLiteralNode&>(expr).entries) {
+        if (may_assign(*key) || may_assign(*value)) {
+          return true;
+        }
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+RegisterOpCode binary_op_to_register_opcode(TokenType token_type, bool& valid) {
+  valid = true;
+  switch (token_type) {
+    case TokenType::PLUS:
+      return RegisterOpCode::ADD;
+    case TokenType::MINUS:
+      return RegisterOpCode::SUBTRACT;
+    case TokenType::ASTERISK:
+      return RegisterOpCode::MULTIPLY;
+    case TokenType::SLASH:
+      return RegisterOpCode::DIVIDE;
+    case TokenType::EQUAL:
+      return RegisterOpCode::EQUAL;
+    case TokenType::NOT_EQUAL:
+      return RegisterOpCode::NOT_EQUAL;
+    case TokenType::LESS:
+      return RegisterOpCode::LESS;
+    case TokenType::GREATER:
+      return RegisterOpCode::GREATER;
+    case TokenType::LESS_EQUAL:
+      return RegisterOpCode::LESS_EQUAL;
+    case TokenType::GREATER_EQUAL:
+      return RegisterOpCode::GREATER_EQUAL;
+    case TokenType::AND:
+      return RegisterOpCode::AND;
+    case TokenType::OR:
+      return RegisterOpCode::OR;
+    default:
+      valid = false;
+      return RegisterOpCode::ADD;
+  }
+}
+
+}  // namespace
+
+RegisterCompiler::RegisterCompiler(GCHeap& heap, GlobalTable& globals) :
+    heap_(heap), globals_(globals), has_error_(false), current_line_(0) {
+  // Constants are unreachable from the heap until the finished chunks are handed out
+  root_tracer_token_ = heap_.add_root_tracer([this](Tracer& tracer) { this->trace_roots(tracer); });
+}
+
+RegisterCompiler::~RegisterCompiler() {
+  heap_.remove_root_tracer(root_tracer_token_);
+}
+
+std::unique_ptr<Chunk> RegisterCompiler::compile(const ProgramNode& program) {
+  functions_.clear();
+  functions_.emplace_back();
+  functions_.back().chunk = std::make_unique<Chunk>();
+  has_error_ = false;
+
+  // The program returns the value of a trailing expression as its result
+  std::optional<uint32_t> result = compile_statement_list(program.statements);
+  if (has_error_) {
+    functions_.clear();
+    return nullptr;
+  }
+  emit_return(result);
+
+  std::unique_ptr<Chunk> chunk = std::move(functions_.back().chunk);
+  functions_.clear();
+  record_global_names(globals_, *chunk);
+  return chunk;
+}
+
+void RegisterCompiler::trace_roots(Tracer& tracer) {
+  for (FunctionState& function : functions_) {
+    if (!function.chunk) continue;
+    for (auto& constant : function.chunk->constants) {
+      tracer.visit(constant);
+    }
+  }
+}
+
+std::optional<uint32_t> RegisterCompiler::compile_statement_list(
+    const std::vector<std::unique_ptr<StatementNode>>& statements) {
+  for (size_t i = 0; i < statements.size(); ++i) {
+    const StatementNode& statement = *statements[i];
+    if (i + 1 == statements.size() && statement.type() == ASTType::EXPRESSION_STATEMENT) {
+      // The register holding a trailing expression's value stays allocated for the caller
+      uint32_t result =
+          compile_operand(*static_cast<const ExpressionStatementNode&>(statement).expression);
+      return has_error_ ? std::nullopt : std::optional<uint32_t>(result);
+    }
+    compile_statement(statement);
+    if (has_error_ || always_returns(statement)) {
+      return std::nullopt;
+    }
+  }
+  return std::nullopt;
+}
+
+void RegisterCompiler::compile_statement(const StatementNode& stmt) {
+  uint32_t enclosing_line = current_line_;
+  if (const Token* token = stmt.get_token()) {
+    current_line_ = static_cast<uint32_t>(token->line);
+  }
+
+  switch (stmt.type()) {
+    case ASTType::EXPRESSION_STATEMENT: {
+      const ExpressionNode& expr = *static_cast<const ExpressionStatementNode&>(stmt).expression;
+      if (expr.type() == ASTType::ASSIGNMENT_EXPRESSION) {
+        // An assignment statement stores its value without copying it anywhere else
+        if (const Token* token = expr.get_token()) {
+          current_line_ = static_cast<uint32_t>(token->line);
+        }
+        compile_assignment_expression(
+            static_cast<const AssignmentExpressionNode&>(expr), std::nullopt);
+      } else {
+        uint32_t first_temporary = current().free_register;
+        compile_operand(expr);
+        current().free_register = first_temporary;
+      }
+      break;
+    }
+    case ASTType::VARIABLE_STATEMENT:
+      compile_variable_statement(static_cast<const VariableStatementNode&>(stmt));
+      break;
+    case ASTType::RETURN_STATEMENT:
+      compile_return_statement(static_cast<const ReturnStatementNode&>(stmt));
+      break;
+    case ASTType::BLOCK_STATEMENT:
+      compile_block_statement(static_cast<const BlockStatementNode&>(stmt));
+      break;
+    case ASTType::WHILE_LOOP_STATEMENT:
+      compile_while_statement(static_cast<const WhileLoopStatementNode&>(stmt));
+      break;
+    case ASTType::FOR_LOOP_STATEMENT:
+      error("For loops not yet implemented in bytecode compiler", stmt.get_token());
+      break;
+    case ASTType::FUNCTION_STATEMENT:
+      compile_function_statement(static_cast<const FunctionStatementNode&>(stmt));
+      break;
+    default:
+      error("Unknown statement type", stmt.get_token());
+  }
+  current_line_ = enclosing_line;
+}
+
+void RegisterCompiler::compile_variable_statement(const VariableStatementNode& stmt) {
+  if (is_global_scope()) {
+    uint32_t first_temporary = current().free_register;
+    uint32_t value = compile_operand(*stmt.value);
+    uint32_t global_index = globals_.define(stmt.name->name, stmt.is_mutable());
+    emit(RegisterOpCode::DEFINE_GLOBAL, value, global_index);
+    current().free_register = first_temporary;
+  } else {
+    // The initializer is evaluated straight into the new local's register, but the name only
+    // comes into scope afterwards
+    uint32_t reg = allocate_register();
+    compile_expression(*stmt.value, reg);
+    declare_local(stmt.name->name, reg, stmt.is_mutable());
+  }
+}
+
+void RegisterCompiler::compile_return_statement(const ReturnStatementNode& stmt) {
+  uint32_t first_temporary = current().free_register;
+  if (stmt.return_value) {
+    emit_return(compile_operand(*stmt.return_value));
+  } else {
+    emit_return(std::nullopt);
+  }
+  current().free_register = first_temporary;
+}
+
+void RegisterCompiler::compile_block_statement(const BlockStatementNode& stmt) {
+  begin_scope();
+
+  for (const auto& statement : stmt.statements) {
+    compile_statement(*statement);
+    if (has_error_ || always_returns(*statement)) break;
+  }
+
+  end_scope();
+}
+
+void RegisterCompiler::compile_while_statement(const WhileLoopStatementNode& stmt) {
+  std::optional<bool> constant_condition = fold_condition(*stmt.condition);
+  if (constant_condition && !*constant_condition) {
+    return;
+  }
+
+  uint32_t loop_start = static_cast<uint32_t>(current().chunk->register_code.size());
+
+  std::optional<uint32_t> exit_jump;
+  if (!constant_condition) {
+    uint32_t first_temporary = current().free_register;
+    exit_jump = emit_jump(RegisterOpCode::JUMP_IF_FALSE, compile_operand(*stmt.condition));
+    current().free_register = first_temporary;
+  }
+
+  compile_statement(*stmt.block);
+  emit(RegisterOpCode::JUMP, 0, loop_start);
+
+  if (exit_jump) {
+    patch_jump(*exit_jump);
+  }
+}
+
+void RegisterCompiler::compile_function_statement(const FunctionStatementNode& stmt) {
+  uint32_t const_index = add_function_constant(heap_, *current().chunk, stmt);
+
+  // A local function's register is in scope before its body is compiled so the body can
+  // capture it; a global function only passes through a temporary
+  bool is_global = is_global_scope();
+  uint32_t first_temporary = current().free_register;
+  uint32_t reg = allocate_register();
+  if (!is_global) {
+    declare_local(stmt.name->name, reg, false);
+  }
+
+  // Parameters occupy the first registers of the callee's frame, where the caller left them
+  functions_.emplace_back();
+  functions_.back().chunk = std::make_unique<Chunk>();
+  for (const auto& param : stmt.parameters) {
+    declare_local(param->name, allocate_register(), true);
+  }
+
+  std::optional<uint32_t> result = compile_statement_list(stmt.body->statements);
+  if (has_error_) {
+    return;
+  }
+  emit_return(result);
+
+  std::unique_ptr<Chunk> body_chunk = std::move(functions_.back().chunk);
+  std::vector<UpvalueInfo> upvalues = std::move(functions_.back().upvalues);
+  functions_.pop_back();
+
+  bool needs_closure = finish_function_constant(
+      heap_, *current().chunk, const_index, std::move(body_chunk), std::move(upvalues));
+  emit(needs_closure ? RegisterOpCode::CLOSURE : RegisterOpCode::LOAD_CONST, reg, const_index);
+
+  if (is_global) {
+    emit(RegisterOpCode::DEFINE_GLOBAL, reg, globals_.define(stmt.name->name, false));
+    current().free_register = first_temporary;
+  }
+}
+
+uint32_t RegisterCompiler::compile_operand(const ExpressionNode& expr, bool allow_local) {
+  // A local is read from its own register, anything else is computed into a new temporary
+  if (allow_local && expr.type() == ASTType::IDENTIFIER) {
+    ResolvedVariable variable = resolve_variable(static_cast<const IdentifierNode&>(expr).name);
+    if (variable.kind == VariableKind::LOCAL) {
+      return variable.index;
+    }
+  }
+  uint32_t reg = allocate_register();
+  compile_expression(expr, reg);
+  return reg;
+}
+
+uint32_t RegisterCompiler::compile_binary_operand(const ExpressionNode& expr, bool allow_local) {
+  // Constant operands are read from the constant pool rather than loaded into a register
+  if (std::optional<PEBBLObject> value = fold_constant(expr)) {
+    return add_constant(*value) | CONSTANT_OPERAND;
+  }
+  return compile_operand(expr, allow_local);
+}
+
+void RegisterCompiler::compile_expression(const ExpressionNode& expr, uint32_t target) {
+  uint32_t enclosing_line = current_line_;
+  if (const Token* token = expr.get_token()) {
+    current_line_ = static_cast<uint32_t>(token->line);
+  }
+
+  // Temporaries allocated for subexpressions are released once the target is written
+  uint32_t first_temporary = current().free_register;
+
+  switch (expr.type()) {
+    case ASTType::INTEGER_LITERAL:
+    case ASTType::FLOAT_LITERAL:
+    case ASTType::BOOLEAN_LITERAL:
+      emit_constant(*fold_constant(expr), target);
+      break;
+    case ASTType::STRING_LITERAL: {
+      const auto& string_literal = static_cast<const StringLiteralNode&>(expr);
+      auto* str_obj = heap_.allocate<PEBBLString>(string_literal.value);
+      emit(RegisterOpCode::LOAD_CONST, target, add_constant(PEBBLObject::make_gc_ptr(str_obj)));
+      break;
+    }
+    case ASTType::IDENTIFIER:
+      compile_identifier(static_cast<const IdentifierNode&>(expr), target);
+      break;
+    case ASTType::BINARY_EXPRESSION:
+      compile_binary_expression(static_cast<const BinaryExpressionNode&>(expr), target);
+      break;
+    case ASTType::UNARY_EXPRESSION:
+      compile_unary_expression(static_cast<const UnaryExpressionNode&>(expr), target);
+      break;
+    case ASTType::ASSIGNMENT_EXPRESSION:
+      compile_assignment_expression(static_cast<const AssignmentExpressionNode&>(expr), target);
+      break;
+    case ASTType::IF_ELSE_EXPRESSION:
+      compile_if_else_expression(static_cast<const IfElseExpressionNode&>(expr), target);
+      break;
+    case ASTType::ARRAY_LITERAL: {
+      std::vector<const ExpressionNode*> elements;
+      for (const auto& element : static_cast<const ArrayLiteralNode&>(expr).elements) {
+        elements.push_back(element.get());
+      }
+      compile_collection(elements, RegisterOpCode::BUILD_ARRAY, target);
+      break;
+    }
+    case ASTType::DICT_LITERAL: {
+      std::vector<const ExpressionNode*> elements;
+      for (const auto& [key_ptr, value_ptr] : static_cast<const DictLiteralNode&>(expr).entries) {
+        elements.push_back(key_ptr);
+        elements.push_back(value_ptr.get());
+      }
+      compile_collection(elements, RegisterOpCode::BUILD_DICT, target);
+      break;
+    }
+    case ASTType::CALL_EXPRESSION:
+      compile_call_expression(static_cast<const CallExpressionNode&>(expr), target);
+      break;
+    default:
+      error("Unknown expression type", expr.get_token());
+  }
+
+  current().free_register = first_temporary;
+  current_line_ = enclosing_line;
+}
+
+void RegisterCompiler::compile_identifier(const IdentifierNode& expr, uint32_t target) {
+  ResolvedVariable variable = resolve_variable(expr.name);
+  switch (variable.kind) {
+    case VariableKind::LOCAL:
+      if (variable.index != target) {
+        emit(RegisterOpCode::MOVE, target, variable.index);
+      }
+      break;
+    case VariableKind::UPVALUE:
+      emit(RegisterOpCode::LOAD_UPVALUE, target, variable.index);
+      break;
+    case VariableKind::GLOBAL:
+      emit(RegisterOpCode::LOAD_GLOBAL, target, variable.index);
+      break;
+  }
+}
+
+void RegisterCompiler::compile_binary_expression(const BinaryExpressionNode& expr,
+                                                 uint32_t target) {
+  if (std::optional<PEBBLObject> value = fold_constant(expr)) {
+    emit_constant(*value, target);
+    return;
+  }
+
+  bool valid;
+  RegisterOpCode opcode = binary_op_to_register_opcode(expr.operator_token.type, valid);
+  if (!valid) {
+    error("Unsupported binary operator", &expr.operator_token);
+    return;
+  }
+
+  // The left operand is evaluated first, so it is copied out of its local if the right one
+  // might assign that local before the operation reads it
+  uint32_t left = compile_binary_operand(*expr.left, !may_assign(*expr.right));
+  uint32_t right = compile_binary_operand(*expr.right, true);
+  emit(opcode, target, left, right);
+}
+
+void RegisterCompiler::compile_unary_expression(const UnaryExpressionNode& expr, uint32_t target) {
+  if (std::optional<PEBBLObject> value = fold_constant(expr)) {
+    emit_constant(*value, target);
+    return;
+  }
+
+  RegisterOpCode opcode;
+  switch (expr.operator_token.type) {
+    case TokenType::MINUS:
+      opcode = RegisterOpCode::NEGATE;
+      break;
+    case TokenType::BANG:
+      opcode = RegisterOpCode::NOT;
+      break;
+    default:
+      error("Unsupported unary operator", &expr.operator_token);
+      return;
+  }
+  emit(opcode, target, compile_operand(*expr.operand));
+}
+
+void RegisterCompiler::compile_assignment_expression(const AssignmentExpressionNode& expr,
+                                                     std::optional<uint32_t> target) {
+  if (expr.target->type() != ASTType::IDENTIFIER) {
+    error("Invalid assignment target", expr.get_token());
+    return;
+  }
+
+  const auto& identifier = static_cast<const IdentifierNode&>(*expr.target);
+  ResolvedVariable variable = resolve_variable(identifier.name);
+  if (variable.kind != VariableKind::GLOBAL && !variable.is_mutable) {
+    error("Cannot assign to immutable variable '" + identifier.name + "'", expr.get_token());
+    return;
+  }
+
+  // The assigned value is also the value of the assignment, copied to the target if there is one
+  if (variable.kind == VariableKind::LOCAL) {
+    compile_expression(*expr.value, variable.index);
+    if (target && *target != variable.index) {
+      emit(RegisterOpCode::MOVE, *target, variable.index);
+    }
+    return;
+  }
+
+  uint32_t first_temporary = current().free_register;
+  uint32_t value = target ? *target : allocate_register();
+  compile_expression(*expr.value, value);
+  if (variable.kind == VariableKind::UPVALUE) {
+    emit(RegisterOpCode::STORE_UPVALUE, value, variable.index);
+  } else {
+    emit(RegisterOpCode::STORE_GLOBAL, value, variable.index);
+  }
+  current().free_register = first_temporary;
+}
+
+void RegisterCompiler::compile_if_else_expression(const IfElseExpressionNode& expr,
+                                                  uint32_t target) {
+  if (std::optional<const ExpressionNode*> branch = selected_branch(expr)) {
+    if (*branch) {
+      compile_expression(**branch, target);
+    } else {
+      emit(RegisterOpCode::LOAD_NULL, target);
+    }
+    return;
+  }
+
+  uint32_t first_temporary = current().free_register;
+  uint32_t else_jump = emit_jump(RegisterOpCode::JUMP_IF_FALSE, compile_operand(*expr.condition));
+  current().free_register = first_temporary;
+
+  compile_expression(*expr.then_expression, target);
+  uint32_t end_jump = emit_jump(RegisterOpCode::JUMP);
+
+  patch_jump(else_jump);
+  if (expr.else_expression) {
+    compile_expression(*expr.else_expression, target);
+  } else {
+    emit(RegisterOpCode::LOAD_NULL, target);
+  }
+  patch_jump(end_jump);
+}
+
+void RegisterCompiler::compile_collection(const std::vector<const ExpressionNode*>& elements,
+                                          RegisterOpCode opcode, uint32_t target) {
+  // Elements are evaluated into consecutive registers, which the VM copies from
+  uint32_t first = current().free_register;
+  for (const ExpressionNode* element : elements) {
+    compile_expression(*element, allocate_register());
+  }
+  uint32_t count = static_cast<uint32_t>(
+      opcode == RegisterOpCode::BUILD_DICT ? elements.size() / 2 : elements.size());
+  emit(opcode, target, first, count);
+}
+
+void RegisterCompiler::compile_call_expression(const CallExpressionNode& expr, uint32_t target) {
+  // The function and its arguments go in consecutive registers at the top of the frame, so the
+  // callee's frame starts right after the function. A target at the top that no variable owns
+  // receives the function itself, saving the move of the result
+  uint32_t base = target + 1 == current().free_register && is_temporary(target)
+                      ? target
+                      : allocate_register();
+  compile_expression(*expr.function, base);
+  for (const auto& arg : expr.arguments) {
+    compile_expression(*arg, allocate_register());
+  }
+
+  emit(RegisterOpCode::CALL, base, static_cast<uint32_t>(expr.arguments.size()));
+  if (base != target) {
+    emit(RegisterOpCode::MOVE, target, base);
+  }
+}
+
+void RegisterCompiler::emit(RegisterOpCode opcode, uint32_t a, uint32_t b, uint32_t c) {
+  current().chunk->add_register_instruction(opcode, a, b, c, current_line_);
+}
+
+void RegisterCompiler::emit_constant(PEBBLObject value, uint32_t target) {
+  if (value.is_null()) {
+    emit(RegisterOpCode::LOAD_NULL, target);
+  } else if (value.is_bool()) {
+    emit(value.as_bool() ? RegisterOpCode::LOAD_TRUE : RegisterOpCode::LOAD_FALSE, target);
+  } else {
+    emit(RegisterOpCode::LOAD_CONST, target, add_constant(value));
+  }
+}
+
+uint32_t RegisterCompiler::emit_jump(RegisterOpCode opcode, uint32_t condition) {
+  uint32_t instruction_index = static_cast<uint32_t>(current().chunk->register_code.size());
+  emit(opcode, condition, 0);  // Placeholder target
+  return instruction_index;
+}
+
+void RegisterCompiler::patch_jump(uint32_t instruction_index) {
+  std::vector<RegisterInstruction>& code = current().chunk->register_code;
+  code[instruction_index].b = static_cast<uint32_t>(code.size());
+}
+
+uint32_t RegisterCompiler::add_constant(PEBBLObject constant) {
+  return current().chunk->add_constant(constant);
+}
+
+RegisterCompiler::FunctionState& RegisterCompiler::current() {
+  return functions_.back();
+}
+
+uint32_t RegisterCompiler::allocate_register() {
+  FunctionState& function = current();
+  uint32_t reg = function.free_register++;
+  function.chunk->register_count = std::max(function.chunk->register_count, function.free_register);
+  return reg;
+}
+
+bool RegisterCompiler::is_temporary(uint32_t reg) {
+  // Locals are declared in register order, so registers above the last one are temporaries
+  const std::vector<Local>& locals = current().locals;
+  return locals.empty() || reg > locals.back().reg;
+}
+
+void RegisterCompiler::begin_scope() {
+  ++current().depth;
+}
+
+void RegisterCompiler::end_scope() {
+  FunctionState& function = current();
+  --function.depth;
+
+  // Captured locals are moved to the heap by a single CLOSE from the lowest one
+  std::optional<uint32_t> first_captured;
+  while (!function.locals.empty() && function.locals.back().depth > function.depth) {
+    if (function.locals.back().captured) {
+      first_captured = function.locals.back().reg;
+    }
+    function.free_register = function.locals.back().reg;
+    function.locals.pop_back();
+  }
+  if (first_captured) {
+    emit(RegisterOpCode::CLOSE, *first_captured);
+  }
+}
+
+bool RegisterCompiler::is_global_scope() const {
+  return functions_.size() == 1 && functions_.back().depth == 0;
+}
+
+ResolvedVariable RegisterCompiler::resolve_variable(const std::string& name) {
+  size_t function_index = functions_.size() - 1;
+  if (Local* local = find_local(function_index, name)) {
+    return {VariableKind::LOCAL, local->reg, local->is_mutable};
+  }
+
+  // A function is defined in the one below it in functions_, whose locals are all in scope
+  auto enclosing = [](size_t index) -> std::optional<size_t> {
+    if (index == 0) {
+      return std::nullopt;
+    }
+    return index - 1;
+  };
+  auto capture_local = [this](size_t index,
+                              const std::string& local_name) -> std::optional<UpvalueInfo> {
+    Local* local = find_local(index - 1, local_name);
+    if (!local) {
+      return std::nullopt;
+    }
+    local->captured = true;
+    return UpvalueInfo(local->reg, true, local->is_mutable);
+  };
+  auto upvalues = [this](size_t index) -> std::vector<UpvalueInfo>& {
+    return functions_[index].upvalues;
+  };
+  if (auto index = resolve_upvalue(function_index, name, enclosing, capture_local, upvalues)) {
+    return {VariableKind::UPVALUE, *index, upvalues(function_index)[*index].is_mutable};
+  }
+  return resolve_global(globals_, name);
+}
+
+RegisterCompiler::Local* RegisterCompiler::find_local(
+    size_t function_index, const std::string& name) {
+  std::vector<Local>& locals = functions_[function_index].locals;
+  for (size_t i = locals.size(); i > 0; --i) {
+    if (locals[i - 1].name == name) {
+      return &locals[i - 1];
+    }
+  }
+  return nullptr;
+}
+
+void RegisterCompiler::declare_local(const std::string& name, uint32_t reg, bool is_mutable) {
+  FunctionState& function = current();
+  function.locals.push_back({name, reg, is_mutable, function.depth, false});
+}
+
+void RegisterCompiler::emit_return(std::optional<uint32_t> result) {
+  if (!result) {
+    result = allocate_register();
+    emit(RegisterOpCode::LOAD_NULL, *result);
+  }
+  emit(RegisterOpCode::RETURN, *result);
+}
+
+void RegisterCompiler::error(const std::string& message, const Token* token) {
+  has_error_ = true;
+  report_compile_error(message, token);
+}
@@ -0,0 +1,131 @@
+/**
+ * @file register_compiler.hpp
+ * @brief AST to register bytecode compiler for the PEBBL language
+ */
+
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "compiler.hpp"
+#include "gc.hpp"
+
+/**
+ * @brief Compiler targeting the register instruction set (RegisterOpCode)
+ *
+ * Produces the same programs as Compiler, but for the three-address register machine:
+ * parameters and locals are assigned fixed registers of their function's frame, and every
+ * expression is compiled into a destination register. Temporaries are allocated above the
+ * locals in stack order and released when the expression that needed them is done, so a call's
+ * function and arguments always occupy the highest live registers, where the callee's frame
+ * begins.
+ */
+class RegisterCompiler {
+public:
+  /**
+   * @brief Constructor
+   * @param heap GC heap for allocating string and function constants
+   * @param globals Global slot table shared with the VM that runs the compiled chunks
+   */
+  RegisterCompiler(GCHeap& heap, GlobalTable& globals);
+
+  /**
+   * @brief Destructor; stops the heap from tracing this compiler's constants
+   */
+  ~RegisterCompiler();
+
+  /**
+   * @brief Compile a program AST to register code
+   * @param program The program AST node
+   * @return Compiled chunk, or nullptr if the program has a compile error
+   */
+  std::unique_ptr<Chunk> compile(const ProgramNode& program);
+
+  /**
+   * @brief Trace GC roots (constants of the chunks being compiled)
+   * @param tracer GC tracer
+   */
+  void trace_roots(class Tracer& tracer);
+
+private:
+  /**
+   * @brief Local variable bound to a register of its function's frame
+   */
+  struct Local {
+    std::string name;
+    uint32_t reg;
+    bool is_mutable;
+    uint32_t depth;  // Block nesting depth it was declared at
+    bool captured;   // Whether a nested function captures it
+  };
+
+  /**
+   * @brief State of a function being compiled; the outermost one is the top-level program
+   */
+  struct FunctionState {
+    std::unique_ptr<Chunk> chunk;
+    std::vector<Local> locals;          // In declaration order, so also in register order
+    std::vector<UpvalueInfo> upvalues;  // Variables the function captures, by upvalue index
+    uint32_t depth = 0;                 // Block nesting depth, 0 for the function body
+    uint32_t free_register = 0;         // Lowest register not holding a local or temporary
+  };
+
+  GCHeap& heap_;
+  RootToken root_tracer_token_;  // Registration of trace_roots with the heap
+  GlobalTable& globals_;
+  std::vector<FunctionState> functions_;  // Functions being compiled, innermost last
+  bool has_error_;
+  uint32_t current_line_;  // Source line recorded for emitted instructions
+
+  // Statements
+  std::optional<uint32_t> compile_statement_list(
+      const std::vector<std::unique_ptr<StatementNode>>& statements);
+  void compile_statement(const StatementNode& stmt);
+  void compile_variable_statement(const VariableStatementNode& stmt);
+  void compile_return_statement(const ReturnStatementNode& stmt);
+  void compile_block_statement(const BlockStatementNode& stmt);
+  void compile_while_statement(const WhileLoopStatementNode& stmt);
+  void compile_function_statement(const FunctionStatementNode& stmt);
+
+  // Expressions; each writes its value to the target register as its last step
+  uint32_t compile_operand(const ExpressionNode& expr, bool allow_local = true);
+  uint32_t compile_binary_operand(const ExpressionNode& expr, bool allow_local);
+  void compile_expression(const ExpressionNode& expr, uint32_t target);
+  void compile_identifier(const IdentifierNode& expr, uint32_t target);
+  void compile_binary_expression(const BinaryExpressionNode& expr, uint32_t target);
+  void compile_unary_expression(const UnaryExpressionNode& expr, uint32_t target);
+  void compile_assignment_expression(const AssignmentExpressionNode& expr,
+                                     std::optional<uint32_t> target);
+  void compile_if_else_expression(const IfElseExpressionNode& expr, uint32_t target);
+  void compile_collection(const std::vector<const ExpressionNode*>& elements,
+                          RegisterOpCode opcode, uint32_t target);
+  void compile_call_expression(const CallExpressionNode& expr, uint32_t target);
+
+  // Code emission
+  void emit(RegisterOpCode opcode, uint32_t a, uint32_t b = 0, uint32_t c = 0);
+  void emit_constant(PEBBLObject value, uint32_t target);
+  uint32_t emit_jump(RegisterOpCode opcode, uint32_t condition = 0);
+  void patch_jump(uint32_t instruction_index);
+  uint32_t add_constant(PEBBLObject constant);
+
+  // Registers and scopes
+  FunctionState& current();
+  uint32_t allocate_register();
+  bool is_temporary(uint32_t reg);
+  void begin_scope();
+  void end_scope();
+  bool is_global_scope() const;
+
+  // Variables
+  ResolvedVariable resolve_variable(const std::string& name);
+  Local* find_local(size_t function_index, const std::string& name);
+  void declare_local(const std::string& name, uint32_t reg, bool is_mutable);
+
+  void emit_return(std::optional<uint32_t> result);
+  void error(const std::string& message, const Token* token);
+};
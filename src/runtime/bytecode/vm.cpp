@@ -5,517 +5,1330 @@
 
 #include "vm.hpp"
 
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 
 #include "builtin_funcs.hpp"
 #include "builtin_objects.hpp"
 
-VM::VM(GCHeap& heap) : heap_(heap), has_error_(false) {
-  stack_.reserve(STACK_MAX);
-  frames_.reserve(FRAMES_MAX);
+// Direct-threaded dispatch relies on the "labels as values" extension offered by GCC and Clang.
+// Other compilers fall back to the portable switch; build with -DPEBBL_COMPUTED_GOTO=0 to force it.
+#ifndef PEBBL_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define PEBBL_COMPUTED_GOTO 1
+#else
+#define PEBBL_COMPUTED_GOTO 0
+#endif
+#endif
+
+namespace {
+
+/**
+ * @brief Read the operands of a _DOUBLE instruction
+ * @return False unless both are numbers and at least one is a double, the case the generic
+ *         instruction computes in double precision
+ */
+inline bool double_operands(PEBBLObject left, PEBBLObject right, double& a, double& b) {
+  if (!(left.is_double() || left.is_int32()) || !(right.is_double() || right.is_int32()) ||
+      (left.is_int32() && right.is_int32())) {
+    return false;
+  }
+  a = left.is_int32() ? left.as_int32() : left.as_double();
+  b = right.is_int32() ? right.as_int32() : right.as_double();
+  return true;
+}
+
+/**
+ * @brief Add two values as ADD does, for the superinstructions that include an addition
+ * @return False if the operands are not numbers
+ */
+inline bool add_numbers(PEBBLObject left, PEBBLObject right, PEBBLObject& result) {
+  double a, b;
+  if (left.is_int32() && right.is_int32()) {
+    result = PEBBLObject::make_int32(left.as_int32() + right.as_int32());
+  } else if (double_operands(left, right, a, b)) {
+    result = PEBBLObject::make_double(a + b);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
 
-  global_env_ = std::make_shared<Environment>();
-  current_env_ = global_env_;
+VM::VM(GCHeap& heap) :
+    heap_(heap), stack_(STACK_MAX), open_upvalues_(nullptr), has_error_(false) {
+#if PEBBL_OPCODE_PAIRS
+  opcode_pairs_.resize(OPCODE_COUNT * OPCODE_COUNT);
+#endif
+  stack_top_ = stack_.data();
+  frames_.reserve(FRAMES_MAX);
 
   // Register this VM as a GC root tracer
-  heap_.add_root_tracer([this](Tracer& tracer) { this->trace_roots(tracer); });
+  root_tracer_token_ = heap_.add_root_tracer([this](Tracer& tracer) { this->trace_roots(tracer); });
 
   // For now, skip builtin registration - will be handled during integration
 }
 
-VMResult VM::execute(const Chunk& chunk) {
+VM::~VM() {
+  heap_.remove_root_tracer(root_tracer_token_);
+#if PEBBL_OPCODE_PAIRS
+  report_opcode_pairs(std::cerr);
+#endif
+}
+
+VMResult VM::execute(Chunk& chunk) {
   reset();
 
+  // Give globals reserved while compiling this chunk a slot holding the undefined sentinel
+  globals_.resize(global_table_.size(), PEBBLObject::make_undefined());
+
   // Push initial call frame
   frames_.emplace_back(&chunk, 0, 0);
 
-  return run();
+  // The caller may free the chunk once it has run, so no frame can be left pointing at it for
+  // a later collection to trace
+  VMResult result;
+  try {
+    if (!chunk.has_register_code()) {
+      result = run();
+    } else if (chunk.register_count > stack_.size()) {
+      runtime_error("Stack overflow");
+      result = VMResult::RUNTIME_ERROR;
+    } else {
+      // The program's registers start out null, so the collector never traces stale values
+      stack_top_ = stack_.data() + chunk.register_count;
+      std::fill(stack_.data(), stack_top_, PEBBLObject::make_null());
+      result = run_registers();
+    }
+  } catch (const OutOfMemoryError& e) {
+    runtime_error(e.what());
+    result = VMResult::RUNTIME_ERROR;
+  }
+  frames_.clear();
+  return result;
 }
 
 PEBBLObject VM::get_result() const {
-  if (stack_.empty()) {
+  if (stack_top_ == stack_.data()) {
     return PEBBLObject::make_null();
   }
-  return stack_.back();
+  return stack_top_[-1];
 }
 
 void VM::reset() {
-  stack_.clear();
+  // Closures that outlive a failed run must not keep pointing into the stack
+  close_upvalues(stack_.data());
+  reset_stack();
   frames_.clear();
   has_error_ = false;
   error_message_.clear();
-  current_env_ = global_env_;
 }
 
+#if PEBBL_COMPUTED_GOTO && defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
 VMResult VM::run() {
-  while (!frames_.empty()) {
-    CallFrame& frame = current_frame();
-    const Chunk& chunk = *frame.chunk;
-
-    if (frame.instruction_pointer >= chunk.instructions.size()) {
-      // End of chunk reached
-      if (frames_.size() == 1) {
-        // Main program finished
-        break;
-      } else {
-        // Function finished, pop frame
-        frames_.pop_back();
-        continue;
-      }
+  // The hot interpreter state lives in locals. It is written back to the current CallFrame and
+  // stack_top_ only when control leaves the loop: calls, returns, allocation and errors.
+  CallFrame* frame = &frames_.back();
+  uint8_t* code = frame->chunk->code.data();
+  uint8_t* ip = code + frame->instruction_pointer;
+  const PEBBLObject* constants = frame->chunk->constants.data();
+  PEBBLObject* slots = stack_.data() + frame->stack_base;
+  PEBBLUpvalue* const* upvalues = frame->closure ? frame->closure->upvalues.data() : nullptr;
+  PEBBLObject* const globals = globals_.data();
+  PEBBLObject* sp = stack_top_;
+  PEBBLObject* const stack_limit = stack_.data() + stack_.size();
+  uint32_t operand = 0;
+
+#if PEBBL_OPCODE_PAIRS
+  size_t previous_opcode = OPCODE_COUNT;  // None before the first instruction
+#define COUNT_PAIR() \
+  do { \
+    size_t next_opcode = *ip == static_cast<uint8_t>(OpCode::WIDE) ? ip[1] : *ip; \
+    if (previous_opcode != OPCODE_COUNT) { \
+      ++opcode_pairs_[previous_opcode * OPCODE_COUNT + next_opcode]; \
+    } \
+    previous_opcode = next_opcode; \
+  } while (0)
+#else
+#define COUNT_PAIR() \
+  do { \
+  } while (0)
+#endif
+
+#define SAVE_STATE() \
+  do { \
+    frame->instruction_pointer = static_cast<uint32_t>(ip - code); \
+    stack_top_ = sp; \
+  } while (0)
+
+#define LOAD_FRAME() \
+  do { \
+    frame = &frames_.back(); \
+    code = frame->chunk->code.data(); \
+    ip = code + frame->instruction_pointer; \
+    constants = frame->chunk->constants.data(); \
+    slots = stack_.data() + frame->stack_base; \
+    upvalues = frame->closure ? frame->closure->upvalues.data() : nullptr; \
+  } while (0)
+
+#define RUNTIME_ERROR(message) \
+  do { \
+    SAVE_STATE(); \
+    runtime_error( \
+        (message), frame->chunk->instruction_index(static_cast<uint32_t>(ip - code - 1))); \
+    return VMResult::RUNTIME_ERROR; \
+  } while (0)
+
+#define PUSH(value) \
+  do { \
+    PEBBLObject pushed_value = (value); \
+    if (sp >= stack_limit) { \
+      RUNTIME_ERROR("Stack overflow"); \
+    } \
+    *sp++ = pushed_value; \
+  } while (0)
+
+// Rewrite the instruction being executed into another opcode. Generic instructions are only
+// specialized while their operand, which counts deoptimizations, is under the limit. The
+// operand is the single byte before ip, and the opcode the byte before it
+#define QUICKEN(specialized) \
+  do { \
+    if (ip[-1] < MAX_DEOPTIMIZATIONS) { \
+      ip[-2] = static_cast<uint8_t>(specialized); \
+    } \
+  } while (0)
+
+// Revert a specialized instruction whose operands failed its guard and run it again generically
+#define DEOPTIMIZE(generic) \
+  do { \
+    ip -= 2; \
+    ip[0] = static_cast<uint8_t>(generic); \
+    ++ip[1]; \
+  } while (0)
+
+#define BINARY_ARITHMETIC(name, op, message) \
+  do { \
+    PEBBLObject right = sp[-1]; \
+    PEBBLObject left = sp[-2]; \
+    double a, b; \
+    if (left.is_int32() && right.is_int32()) { \
+      sp[-2] = PEBBLObject::make_int32(left.as_int32() op right.as_int32()); \
+      QUICKEN(OpCode::name##_INT); \
+    } else if (double_operands(left, right, a, b)) { \
+      sp[-2] = PEBBLObject::make_double(a op b); \
+      QUICKEN(OpCode::name##_DOUBLE); \
+    } else { \
+      RUNTIME_ERROR(message); \
+    } \
+    --sp; \
+  } while (0)
+
+#define BINARY_COMPARISON(name, op, message) \
+  do { \
+    PEBBLObject right = sp[-1]; \
+    PEBBLObject left = sp[-2]; \
+    double a, b; \
+    if (left.is_int32() && right.is_int32()) { \
+      sp[-2] = PEBBLObject::make_bool(left.as_int32() op right.as_int32()); \
+      QUICKEN(OpCode::name##_INT); \
+    } else if (double_operands(left, right, a, b)) { \
+      sp[-2] = PEBBLObject::make_bool(a op b); \
+      QUICKEN(OpCode::name##_DOUBLE); \
+    } else { \
+      RUNTIME_ERROR(message); \
+    } \
+    --sp; \
+  } while (0)
+
+// Pop two operands and jump unless they compare as op, as a comparison and JUMP_IF_FALSE would
+#define JUMP_UNLESS_COMPARISON(op, message) \
+  do { \
+    PEBBLObject right = sp[-1]; \
+    PEBBLObject left = sp[-2]; \
+    double a, b; \
+    bool holds; \
+    if (left.is_int32() && right.is_int32()) { \
+      holds = left.as_int32() op right.as_int32(); \
+    } else if (double_operands(left, right, a, b)) { \
+      holds = a op b; \
+    } else { \
+      RUNTIME_ERROR(message); \
+    } \
+    sp -= 2; \
+    if (!holds) { \
+      ip = code + operand; \
+    } \
+  } while (0)
+
+// Bodies of the specialized forms: make is the PEBBLObject factory for the result type
+#define SPECIALIZED_INT(name, op, make) \
+  do { \
+    PEBBLObject right = sp[-1]; \
+    PEBBLObject left = sp[-2]; \
+    if (left.is_int32() && right.is_int32()) { \
+      sp[-2] = PEBBLObject::make(left.as_int32() op right.as_int32()); \
+      --sp; \
+    } else { \
+      DEOPTIMIZE(OpCode::name); \
+    } \
+  } while (0)
+
+#define SPECIALIZED_DOUBLE(name, op, make) \
+  do { \
+    double a, b; \
+    if (double_operands(sp[-2], sp[-1], a, b)) { \
+      sp[-2] = PEBBLObject::make(a op b); \
+      --sp; \
+    } else { \
+      DEOPTIMIZE(OpCode::name); \
+    } \
+  } while (0)
+
+#if PEBBL_COMPUTED_GOTO
+  // Indexed by OpCode; must list every opcode in declaration order
+  static const void* const dispatch_table[] = {
+      &&op_LOAD_CONST,          &&op_LOAD_NULL,              &&op_LOAD_TRUE,
+      &&op_LOAD_FALSE,          &&op_LOAD_LOCAL,             &&op_STORE_LOCAL,
+      &&op_LOAD_GLOBAL,         &&op_STORE_GLOBAL,           &&op_DEFINE_GLOBAL,
+      &&op_LOAD_UPVALUE,        &&op_STORE_UPVALUE,          &&op_ADD,
+      &&op_SUBTRACT,            &&op_MULTIPLY,               &&op_DIVIDE,
+      &&op_NEGATE,              &&op_EQUAL,                  &&op_NOT_EQUAL,
+      &&op_LESS,                &&op_GREATER,                &&op_LESS_EQUAL,
+      &&op_GREATER_EQUAL,       &&op_NOT,                    &&op_AND,
+      &&op_OR,                  &&op_JUMP,                   &&op_JUMP_IF_FALSE,
+      &&op_JUMP_IF_TRUE,        &&op_CALL,                   &&op_RETURN,
+      &&op_CLOSURE,             &&op_CLOSE_UPVALUE,          &&op_BUILD_ARRAY,
+      &&op_BUILD_DICT,          &&op_POP,                    &&op_DUP,
+      &&op_UNKNOWN,             &&op_UNKNOWN,                &&op_UNKNOWN,
+      &&op_UNKNOWN,             &&op_ADD_INT,                &&op_ADD_DOUBLE,
+      &&op_SUBTRACT_INT,        &&op_SUBTRACT_DOUBLE,        &&op_MULTIPLY_INT,
+      &&op_MULTIPLY_DOUBLE,     &&op_LESS_INT,               &&op_LESS_DOUBLE,
+      &&op_GREATER_INT,         &&op_GREATER_DOUBLE,         &&op_LESS_EQUAL_INT,
+      &&op_LESS_EQUAL_DOUBLE,   &&op_GREATER_EQUAL_INT,      &&op_GREATER_EQUAL_DOUBLE,
+      &&op_INC_LOCAL,           &&op_INC_GLOBAL,             &&op_STORE_LOCAL_POP,
+      &&op_STORE_GLOBAL_POP,    &&op_LOAD_LOCAL_LOAD_CONST,  &&op_JUMP_IF_NOT_LESS,
+      &&op_JUMP_IF_NOT_GREATER, &&op_JUMP_IF_NOT_LESS_EQUAL, &&op_JUMP_IF_NOT_GREATER_EQUAL,
+      &&op_WIDE,                &&op_HALT};
+  static_assert(
+      sizeof(dispatch_table) / sizeof(dispatch_table[0]) == static_cast<size_t>(OpCode::HALT) + 1,
+      "dispatch_table must cover every OpCode");
+
+  // Entry points past the operand decoding, for instructions whose WIDE prefix read the operand
+  static const void* const wide_dispatch_table[] = {
+      &&wide_LOAD_CONST,          &&wide_LOAD_NULL,              &&wide_LOAD_TRUE,
+      &&wide_LOAD_FALSE,          &&wide_LOAD_LOCAL,             &&wide_STORE_LOCAL,
+      &&wide_LOAD_GLOBAL,         &&wide_STORE_GLOBAL,           &&wide_DEFINE_GLOBAL,
+      &&wide_LOAD_UPVALUE,        &&wide_STORE_UPVALUE,          &&wide_ADD,
+      &&wide_SUBTRACT,            &&wide_MULTIPLY,               &&wide_DIVIDE,
+      &&wide_NEGATE,              &&wide_EQUAL,                  &&wide_NOT_EQUAL,
+      &&wide_LESS,                &&wide_GREATER,                &&wide_LESS_EQUAL,
+      &&wide_GREATER_EQUAL,       &&wide_NOT,                    &&wide_AND,
+      &&wide_OR,                  &&wide_JUMP,                   &&wide_JUMP_IF_FALSE,
+      &&wide_JUMP_IF_TRUE,        &&wide_CALL,                   &&wide_RETURN,
+      &&wide_CLOSURE,             &&wide_CLOSE_UPVALUE,          &&wide_BUILD_ARRAY,
+      &&wide_BUILD_DICT,          &&wide_POP,                    &&wide_DUP,
+      &&op_UNKNOWN,               &&op_UNKNOWN,                  &&op_UNKNOWN,
+      &&op_UNKNOWN,               &&wide_ADD_INT,                &&wide_ADD_DOUBLE,
+      &&wide_SUBTRACT_INT,        &&wide_SUBTRACT_DOUBLE,        &&wide_MULTIPLY_INT,
+      &&wide_MULTIPLY_DOUBLE,     &&wide_LESS_INT,               &&wide_LESS_DOUBLE,
+      &&wide_GREATER_INT,         &&wide_GREATER_DOUBLE,         &&wide_LESS_EQUAL_INT,
+      &&wide_LESS_EQUAL_DOUBLE,   &&wide_GREATER_EQUAL_INT,      &&wide_GREATER_EQUAL_DOUBLE,
+      &&wide_INC_LOCAL,           &&wide_INC_GLOBAL,             &&wide_STORE_LOCAL_POP,
+      &&wide_STORE_GLOBAL_POP,    &&wide_LOAD_LOCAL_LOAD_CONST,  &&wide_JUMP_IF_NOT_LESS,
+      &&wide_JUMP_IF_NOT_GREATER, &&wide_JUMP_IF_NOT_LESS_EQUAL, &&wide_JUMP_IF_NOT_GREATER_EQUAL,
+      &&op_UNKNOWN,               &&wide_HALT};
+  static_assert(sizeof(wide_dispatch_table) == sizeof(dispatch_table),
+                "wide_dispatch_table must cover every OpCode");
+
+// Each handler decodes its operand in the format of its opcode, known at compile time
+#define TARGET(op) \
+  op_##op: \
+  ip += read_operand<operand_format(OpCode::op)>(ip, operand); \
+  wide_##op:
+#define DISPATCH() \
+  do { \
+    COUNT_PAIR(); \
+    goto* dispatch_table[*ip++]; \
+  } while (0)
+
+  DISPATCH();
+
+op_WIDE: {
+  uint8_t prefixed = *ip;
+  operand = read_wide_operand(ip + 1);
+  ip += 5;
+  goto* wide_dispatch_table[prefixed];
+}
+#else
+#define TARGET(op) case OpCode::op:
+#define DISPATCH() continue
+
+  for (;;) {
+    COUNT_PAIR();
+    OpCode opcode;
+    ip += decode_instruction(ip, opcode, operand);
+    switch (opcode) {
+#endif
+
+  TARGET(LOAD_CONST) {
+    PUSH(constants[operand]);
+    DISPATCH();
+  }
+
+  TARGET(LOAD_NULL) {
+    PUSH(PEBBLObject::make_null());
+    DISPATCH();
+  }
+
+  TARGET(LOAD_TRUE) {
+    PUSH(PEBBLObject::make_bool(true));
+    DISPATCH();
+  }
+
+  TARGET(LOAD_FALSE) {
+    PUSH(PEBBLObject::make_bool(false));
+    DISPATCH();
+  }
+
+  TARGET(LOAD_LOCAL) {
+    PUSH(slots[operand]);
+    DISPATCH();
+  }
+
+  TARGET(STORE_LOCAL) {
+    // Assignment is an expression, so the value stays on the stack
+    slots[operand] = sp[-1];
+    DISPATCH();
+  }
+
+  TARGET(LOAD_GLOBAL) {
+    PEBBLObject value = globals[operand];
+    if (value.is_undefined()) {
+      RUNTIME_ERROR("Undefined variable '" + global_table_.get(operand).name + "'");
+    }
+    PUSH(value);
+    DISPATCH();
+  }
+
+  TARGET(STORE_GLOBAL) {
+    // Assignment is an expression, so the value stays on the stack
+    const VariableInfo& info = global_table_.get(operand);
+    if (globals[operand].is_undefined()) {
+      RUNTIME_ERROR("Undefined variable '" + info.name + "'");
+    }
+    if (!info.is_mutable) {
+      RUNTIME_ERROR("Cannot assign to immutable variable '" + info.name + "'");
     }
+    globals[operand] = sp[-1];
+    DISPATCH();
+  }
 
-    const Instruction& instruction = chunk.instructions[frame.instruction_pointer++];
-
-    switch (instruction.opcode) {
-      case OpCode::LOAD_CONST:
-        handle_load_const(instruction.operand);
-        break;
-      case OpCode::LOAD_NULL:
-        handle_load_null();
-        break;
-      case OpCode::LOAD_TRUE:
-        handle_load_true();
-        break;
-      case OpCode::LOAD_FALSE:
-        handle_load_false();
-        break;
-      case OpCode::LOAD_VAR:
-        handle_load_var(instruction.operand);
-        break;
-      case OpCode::STORE_VAR:
-        handle_store_var(instruction.operand);
-        break;
-      case OpCode::DEFINE_VAR:
-        handle_define_var(instruction.operand);
-        break;
-      case OpCode::ADD:
-        handle_add();
-        break;
-      case OpCode::SUBTRACT:
-        handle_subtract();
-        break;
-      case OpCode::MULTIPLY:
-        handle_multiply();
-        break;
-      case OpCode::DIVIDE:
-        handle_divide();
-        break;
-      case OpCode::NEGATE:
-        handle_negate();
-        break;
-      case OpCode::EQUAL:
-        handle_equal();
-        break;
-      case OpCode::NOT_EQUAL:
-        handle_not_equal();
-        break;
-      case OpCode::LESS:
-        handle_less();
-        break;
-      case OpCode::GREATER:
-        handle_greater();
-        break;
-      case OpCode::LESS_EQUAL:
-        handle_less_equal();
-        break;
-      case OpCode::GREATER_EQUAL:
-        handle_greater_equal();
-        break;
-      case OpCode::NOT:
-        handle_not();
-        break;
-      case OpCode::AND:
-        handle_and();
-        break;
-      case OpCode::OR:
-        handle_or();
-        break;
-      case OpCode::JUMP:
-        handle_jump(instruction.operand);
-        break;
-      case OpCode::JUMP_IF_FALSE:
-        handle_jump_if_false(instruction.operand);
-        break;
-      case OpCode::JUMP_IF_TRUE:
-        handle_jump_if_true(instruction.operand);
-        break;
-      case OpCode::CALL:
-        handle_call(instruction.operand);
-        break;
-      case OpCode::RETURN:
-        handle_return();
-        break;
-      case OpCode::BUILD_ARRAY:
-        handle_build_array(instruction.operand);
-        break;
-      case OpCode::BUILD_DICT:
-        handle_build_dict(instruction.operand);
-        break;
-      case OpCode::POP:
-        handle_pop();
-        break;
-      case OpCode::DUP:
-        handle_dup();
-        break;
-      case OpCode::HALT:
-        return VMResult::OK;
-      default:
-        runtime_error(
-            "Unknown instruction: " + std::to_string(static_cast<int>(instruction.opcode)));
-        return VMResult::RUNTIME_ERROR;
+  TARGET(DEFINE_GLOBAL) {
+    globals[operand] = *--sp;
+    DISPATCH();
+  }
+
+  TARGET(LOAD_UPVALUE) {
+    PUSH(*upvalues[operand]->location);
+    DISPATCH();
+  }
+
+  TARGET(STORE_UPVALUE) {
+    // Assignment is an expression, so the value stays on the stack
+    PEBBLUpvalue* upvalue = upvalues[operand];
+    *upvalue->location = sp[-1];
+    heap_.write_barrier(upvalue, sp[-1]);
+    DISPATCH();
+  }
+
+  TARGET(ADD) {
+    BINARY_ARITHMETIC(ADD, +, "Invalid operands for addition");
+    DISPATCH();
+  }
+
+  TARGET(SUBTRACT) {
+    BINARY_ARITHMETIC(SUBTRACT, -, "Invalid operands for subtraction");
+    DISPATCH();
+  }
+
+  TARGET(MULTIPLY) {
+    BINARY_ARITHMETIC(MULTIPLY, *, "Invalid operands for multiplication");
+    DISPATCH();
+  }
+
+  TARGET(DIVIDE) {
+    PEBBLObject right = sp[-1];
+    if ((right.is_int32() && right.as_int32() == 0) ||
+        (right.is_double() && right.as_double() == 0.0)) {
+      RUNTIME_ERROR("Division by zero");
+    }
+    if (!perform_numeric_operation(sp[-2], right, OpCode::DIVIDE, sp[-2])) {
+      RUNTIME_ERROR("Invalid operands for division");
+    }
+    --sp;
+    DISPATCH();
+  }
+
+  TARGET(NEGATE) {
+    PEBBLObject value = sp[-1];
+    if (value.is_int32()) {
+      sp[-1] = PEBBLObject::make_int32(-value.as_int32());
+    } else if (value.is_double()) {
+      sp[-1] = PEBBLObject::make_double(-value.as_double());
+    } else {
+      RUNTIME_ERROR("Invalid operand for negation");
+    }
+    DISPATCH();
+  }
+
+  TARGET(EQUAL) {
+    sp[-2] = PEBBLObject::make_bool(are_equal(sp[-2], sp[-1]));
+    --sp;
+    DISPATCH();
+  }
+
+  TARGET(NOT_EQUAL) {
+    sp[-2] = PEBBLObject::make_bool(!are_equal(sp[-2], sp[-1]));
+    --sp;
+    DISPATCH();
+  }
+
+  TARGET(LESS) {
+    BINARY_COMPARISON(LESS, <, "Invalid operands for less than comparison");
+    DISPATCH();
+  }
+
+  TARGET(GREATER) {
+    BINARY_COMPARISON(GREATER, >, "Invalid operands for greater than comparison");
+    DISPATCH();
+  }
+
+  TARGET(LESS_EQUAL) {
+    BINARY_COMPARISON(LESS_EQUAL, <=, "Invalid operands for less than or equal comparison");
+    DISPATCH();
+  }
+
+  TARGET(GREATER_EQUAL) {
+    BINARY_COMPARISON(GREATER_EQUAL, >=, "Invalid operands for greater than or equal comparison");
+    DISPATCH();
+  }
+
+  TARGET(NOT) {
+    sp[-1] = PEBBLObject::make_bool(!is_truthy(sp[-1]));
+    DISPATCH();
+  }
+
+  TARGET(AND) {
+    sp[-2] = PEBBLObject::make_bool(is_truthy(sp[-2]) && is_truthy(sp[-1]));
+    --sp;
+    DISPATCH();
+  }
+
+  TARGET(OR) {
+    sp[-2] = PEBBLObject::make_bool(is_truthy(sp[-2]) || is_truthy(sp[-1]));
+    --sp;
+    DISPATCH();
+  }
+
+  TARGET(JUMP) {
+    ip = code + operand;
+    DISPATCH();
+  }
+
+  TARGET(JUMP_IF_FALSE) {
+    if (!is_truthy(*--sp)) {
+      ip = code + operand;
+    }
+    DISPATCH();
+  }
+
+  TARGET(JUMP_IF_TRUE) {
+    if (is_truthy(*--sp)) {
+      ip = code + operand;
+    }
+    DISPATCH();
+  }
+
+  TARGET(CALL) {
+    SAVE_STATE();
+    if (!call_value(operand)) {
+      return VMResult::RUNTIME_ERROR;
+    }
+    LOAD_FRAME();
+    sp = stack_top_;
+    DISPATCH();
+  }
+
+  TARGET(RETURN) {
+    PEBBLObject result = *--sp;
+    close_upvalues(slots);
+    if (frames_.size() == 1) {
+      // Returning from the main program ends execution with the value as the result
+      *sp++ = result;
+      SAVE_STATE();
+      return VMResult::OK;
     }
 
+    // Drop the callee's locals and the function object below them, then resume the caller
+    sp = stack_.data() + frame->stack_base - 1;
+    frames_.pop_back();
+    LOAD_FRAME();
+    PUSH(result);
+    DISPATCH();
+  }
+
+  TARGET(CLOSURE) {
+    SAVE_STATE();
+    make_closure(constants[operand]);
     if (has_error_) {
       return VMResult::RUNTIME_ERROR;
     }
+    sp = stack_top_;
+    DISPATCH();
   }
 
-  return VMResult::OK;
-}
+  TARGET(CLOSE_UPVALUE) {
+    close_upvalues(sp - 1);
+    --sp;
+    DISPATCH();
+  }
 
-void VM::push(PEBBLObject value) {
-  if (stack_.size() >= STACK_MAX) {
-    runtime_error("Stack overflow");
-    return;
+  TARGET(BUILD_ARRAY) {
+    SAVE_STATE();
+    build_array(operand);
+    if (has_error_) {
+      return VMResult::RUNTIME_ERROR;
+    }
+    sp = stack_top_;
+    DISPATCH();
   }
-  stack_.push_back(value);
-}
 
-PEBBLObject VM::pop() {
-  if (stack_.empty()) {
-    runtime_error("Stack underflow");
-    return PEBBLObject::make_null();
+  TARGET(BUILD_DICT) {
+    SAVE_STATE();
+    build_dict(operand);
+    if (has_error_) {
+      return VMResult::RUNTIME_ERROR;
+    }
+    sp = stack_top_;
+    DISPATCH();
   }
-  PEBBLObject value = stack_.back();
-  stack_.pop_back();
-  return value;
-}
 
-PEBBLObject VM::peek(uint32_t distance) {
-  if (distance >= stack_.size()) {
-    runtime_error("Stack underflow in peek");
-    return PEBBLObject::make_null();
+  TARGET(POP) {
+    --sp;
+    DISPATCH();
   }
-  return stack_[stack_.size() - 1 - distance];
-}
 
-void VM::reset_stack() {
-  stack_.clear();
-}
+  TARGET(DUP) {
+    PUSH(sp[-1]);
+    DISPATCH();
+  }
 
-void VM::handle_load_const(uint32_t operand) {
-  const Chunk& chunk = current_chunk();
-  if (operand >= chunk.constants.size()) {
-    runtime_error("Invalid constant index: " + std::to_string(operand));
-    return;
+  TARGET(ADD_INT) {
+    SPECIALIZED_INT(ADD, +, make_int32);
+    DISPATCH();
   }
-  push(chunk.constants[operand]);
-}
 
-void VM::handle_load_null() {
-  push(PEBBLObject::make_null());
-}
+  TARGET(ADD_DOUBLE) {
+    SPECIALIZED_DOUBLE(ADD, +, make_double);
+    DISPATCH();
+  }
 
-void VM::handle_load_true() {
-  push(PEBBLObject::make_bool(true));
-}
+  TARGET(SUBTRACT_INT) {
+    SPECIALIZED_INT(SUBTRACT, -, make_int32);
+    DISPATCH();
+  }
 
-void VM::handle_load_false() {
-  push(PEBBLObject::make_bool(false));
-}
+  TARGET(SUBTRACT_DOUBLE) {
+    SPECIALIZED_DOUBLE(SUBTRACT, -, make_double);
+    DISPATCH();
+  }
 
-void VM::handle_load_var(uint32_t operand) {
-  const Chunk& chunk = current_chunk();
-  if (operand >= chunk.variable_names.size()) {
-    runtime_error("Invalid variable index: " + std::to_string(operand));
-    return;
+  TARGET(MULTIPLY_INT) {
+    SPECIALIZED_INT(MULTIPLY, *, make_int32);
+    DISPATCH();
   }
 
-  const std::string& var_name = chunk.variable_names[operand];
-  try {
-    PEBBLObject value = current_env_->get(var_name);
-    push(value);
-  } catch (const std::runtime_error& e) {
-    runtime_error("Undefined variable '" + var_name + "'");
+  TARGET(MULTIPLY_DOUBLE) {
+    SPECIALIZED_DOUBLE(MULTIPLY, *, make_double);
+    DISPATCH();
   }
-}
 
-void VM::handle_store_var(uint32_t operand) {
-  const Chunk& chunk = current_chunk();
-  if (operand >= chunk.variable_names.size()) {
-    runtime_error("Invalid variable index: " + std::to_string(operand));
-    return;
+  TARGET(LESS_INT) {
+    SPECIALIZED_INT(LESS, <, make_bool);
+    DISPATCH();
   }
 
-  const std::string& var_name = chunk.variable_names[operand];
-  PEBBLObject value = peek(0);  // Don't pop yet, assignment returns the value
+  TARGET(LESS_DOUBLE) {
+    SPECIALIZED_DOUBLE(LESS, <, make_bool);
+    DISPATCH();
+  }
 
-  try {
-    current_env_->set(var_name, value);
-  } catch (const std::runtime_error& e) {
-    runtime_error("Cannot assign to variable '" + var_name + "': " + e.what());
+  TARGET(GREATER_INT) {
+    SPECIALIZED_INT(GREATER, >, make_bool);
+    DISPATCH();
   }
-}
 
-void VM::handle_define_var(uint32_t operand) {
-  const Chunk& chunk = current_chunk();
-  if (operand >= chunk.variable_names.size()) {
-    runtime_error("Invalid variable index: " + std::to_string(operand));
-    return;
+  TARGET(GREATER_DOUBLE) {
+    SPECIALIZED_DOUBLE(GREATER, >, make_bool);
+    DISPATCH();
   }
 
-  const std::string& var_name = chunk.variable_names[operand];
-  PEBBLObject value = pop();
+  TARGET(LESS_EQUAL_INT) {
+    SPECIALIZED_INT(LESS_EQUAL, <=, make_bool);
+    DISPATCH();
+  }
 
-  // For simplicity, assume all variables are mutable
-  current_env_->define(var_name, value, true);
-}
+  TARGET(LESS_EQUAL_DOUBLE) {
+    SPECIALIZED_DOUBLE(LESS_EQUAL, <=, make_bool);
+    DISPATCH();
+  }
 
-void VM::handle_add() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+  TARGET(GREATER_EQUAL_INT) {
+    SPECIALIZED_INT(GREATER_EQUAL, >=, make_bool);
+    DISPATCH();
+  }
 
-  if (perform_numeric_operation(left, right, OpCode::ADD, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for addition");
+  TARGET(GREATER_EQUAL_DOUBLE) {
+    SPECIALIZED_DOUBLE(GREATER_EQUAL, >=, make_bool);
+    DISPATCH();
   }
-}
 
-void VM::handle_subtract() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+  TARGET(INC_LOCAL) {
+    PEBBLObject& local = slots[first_operand(operand)];
+    if (!add_numbers(local, constants[second_operand(operand)], local)) {
+      RUNTIME_ERROR("Invalid operands for addition");
+    }
+    DISPATCH();
+  }
 
-  if (perform_numeric_operation(left, right, OpCode::SUBTRACT, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for subtraction");
+  TARGET(INC_GLOBAL) {
+    // Checks in the order of the fused LOAD_GLOBAL, ADD and STORE_GLOBAL
+    uint32_t slot = first_operand(operand);
+    const VariableInfo& info = global_table_.get(slot);
+    PEBBLObject sum;
+    if (globals[slot].is_undefined()) {
+      RUNTIME_ERROR("Undefined variable '" + info.name + "'");
+    }
+    if (!add_numbers(globals[slot], constants[second_operand(operand)], sum)) {
+      RUNTIME_ERROR("Invalid operands for addition");
+    }
+    if (!info.is_mutable) {
+      RUNTIME_ERROR("Cannot assign to immutable variable '" + info.name + "'");
+    }
+    globals[slot] = sum;
+    DISPATCH();
   }
-}
 
-void VM::handle_multiply() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+  TARGET(STORE_LOCAL_POP) {
+    slots[operand] = *--sp;
+    DISPATCH();
+  }
 
-  if (perform_numeric_operation(left, right, OpCode::MULTIPLY, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for multiplication");
+  TARGET(STORE_GLOBAL_POP) {
+    const VariableInfo& info = global_table_.get(operand);
+    if (globals[operand].is_undefined()) {
+      RUNTIME_ERROR("Undefined variable '" + info.name + "'");
+    }
+    if (!info.is_mutable) {
+      RUNTIME_ERROR("Cannot assign to immutable variable '" + info.name + "'");
+    }
+    globals[operand] = *--sp;
+    DISPATCH();
   }
-}
 
-void VM::handle_divide() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+  TARGET(LOAD_LOCAL_LOAD_CONST) {
+    PUSH(slots[first_operand(operand)]);
+    PUSH(constants[second_operand(operand)]);
+    DISPATCH();
+  }
 
-  // Check for division by zero
-  if ((right.is_int32() && right.as_int32() == 0) ||
-      (right.is_double() && right.as_double() == 0.0)) {
-    runtime_error("Division by zero");
-    return;
+  TARGET(JUMP_IF_NOT_LESS) {
+    JUMP_UNLESS_COMPARISON(<, "Invalid operands for less than comparison");
+    DISPATCH();
   }
 
-  if (perform_numeric_operation(left, right, OpCode::DIVIDE, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for division");
+  TARGET(JUMP_IF_NOT_GREATER) {
+    JUMP_UNLESS_COMPARISON(>, "Invalid operands for greater than comparison");
+    DISPATCH();
   }
-}
 
-void VM::handle_negate() {
-  PEBBLObject operand = pop();
+  TARGET(JUMP_IF_NOT_LESS_EQUAL) {
+    JUMP_UNLESS_COMPARISON(<=, "Invalid operands for less than or equal comparison");
+    DISPATCH();
+  }
 
-  if (operand.is_int32()) {
-    push(PEBBLObject::make_int32(-operand.as_int32()));
-  } else if (operand.is_double()) {
-    push(PEBBLObject::make_double(-operand.as_double()));
-  } else {
-    runtime_error("Invalid operand for negation");
+  TARGET(JUMP_IF_NOT_GREATER_EQUAL) {
+    JUMP_UNLESS_COMPARISON(>=, "Invalid operands for greater than or equal comparison");
+    DISPATCH();
   }
-}
 
-void VM::handle_equal() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  push(PEBBLObject::make_bool(are_equal(left, right)));
-}
+  TARGET(HALT) {
+    SAVE_STATE();
+    return VMResult::OK;
+  }
 
-void VM::handle_not_equal() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  push(PEBBLObject::make_bool(!are_equal(left, right)));
+#if PEBBL_COMPUTED_GOTO
+op_UNKNOWN:
+#else
+      default:
+#endif
+  // Opcodes without a handler take no operand, so ip is just past them
+  RUNTIME_ERROR("Unknown instruction: " + std::to_string(static_cast<int>(ip[-1])));
+
+#if !PEBBL_COMPUTED_GOTO
+    }
+  }
+#endif
+
+#undef COUNT_PAIR
+#undef SAVE_STATE
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef PUSH
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef BINARY_ARITHMETIC
+#undef BINARY_COMPARISON
+#undef SPECIALIZED_INT
+#undef SPECIALIZED_DOUBLE
+#undef JUMP_UNLESS_COMPARISON
+#undef TARGET
+#undef DISPATCH
 }
 
-void VM::handle_less() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+VMResult VM::run_registers() {
+  // Each frame's registers are the window of the stack from its base up to the chunk's register
+  // count. stack_top_ stays at the end of the current window, so collections trace every register
+  // of the frame; registers only enter a window after being nulled or written.
+  CallFrame* frame = &frames_.back();
+  RegisterInstruction* code = frame->chunk->register_code.data();
+  RegisterInstruction* ip = code + frame->instruction_pointer;
+  const PEBBLObject* constants = frame->chunk->constants.data();
+  PEBBLObject* slots = stack_.data() + frame->stack_base;
+  PEBBLUpvalue* const* upvalues = frame->closure ? frame->closure->upvalues.data() : nullptr;
+  PEBBLObject* const globals = globals_.data();
+  PEBBLObject* const stack_limit = stack_.data() + stack_.size();
+// Operands of the instruction being executed
+#define A (ip[-1].a)
+#define B (ip[-1].b)
+#define C (ip[-1].c)
+
+#if PEBBL_OPCODE_PAIRS
+#define COUNT_INSTRUCTION() ++register_instructions_
+#else
+#define COUNT_INSTRUCTION() \
+  do { \
+  } while (0)
+#endif
+
+#define SAVE_STATE() \
+  do { \
+    frame->instruction_pointer = static_cast<uint32_t>(ip - code); \
+  } while (0)
+
+#define LOAD_FRAME() \
+  do { \
+    frame = &frames_.back(); \
+    code = frame->chunk->register_code.data(); \
+    ip = code + frame->instruction_pointer; \
+    constants = frame->chunk->constants.data(); \
+    slots = stack_.data() + frame->stack_base; \
+    upvalues = frame->closure ? frame->closure->upvalues.data() : nullptr; \
+  } while (0)
+
+#define RUNTIME_ERROR(message) \
+  do { \
+    SAVE_STATE(); \
+    runtime_error((message), static_cast<uint32_t>(ip - code - 1)); \
+    return VMResult::RUNTIME_ERROR; \
+  } while (0)
+
+// Value of an rk operand: a register, or a constant if flagged with CONSTANT_OPERAND
+#define RK(operand) \
+  (((operand) & CONSTANT_OPERAND) ? constants[(operand) & ~CONSTANT_OPERAND] : slots[operand])
+
+// make_int and make_double are the PEBBLObject factories for int32 and double operands
+#define BINARY_OPERATION(op, make_int, make_double, message) \
+  do { \
+    PEBBLObject left = RK(B); \
+    PEBBLObject right = RK(C); \
+    double x, y; \
+    if (left.is_int32() && right.is_int32()) { \
+      slots[A] = PEBBLObject::make_int(left.as_int32() op right.as_int32()); \
+    } else if (double_operands(left, right, x, y)) { \
+      slots[A] = PEBBLObject::make_double(x op y); \
+    } else { \
+      RUNTIME_ERROR(message); \
+    } \
+  } while (0)
+
+#if PEBBL_COMPUTED_GOTO
+  // Indexed by RegisterOpCode; must list every opcode in declaration order
+  static const void* const dispatch_table[] = {
+      &&op_LOAD_CONST,    &&op_LOAD_NULL,     &&op_LOAD_TRUE,     &&op_LOAD_FALSE,
+      &&op_MOVE,          &&op_LOAD_GLOBAL,   &&op_STORE_GLOBAL,  &&op_DEFINE_GLOBAL,
+      &&op_LOAD_UPVALUE,  &&op_STORE_UPVALUE, &&op_ADD,           &&op_SUBTRACT,
+      &&op_MULTIPLY,      &&op_DIVIDE,        &&op_EQUAL,         &&op_NOT_EQUAL,
+      &&op_LESS,          &&op_GREATER,       &&op_LESS_EQUAL,    &&op_GREATER_EQUAL,
+      &&op_AND,           &&op_OR,            &&op_NEGATE,        &&op_NOT,
+      &&op_JUMP,          &&op_JUMP_IF_FALSE, &&op_CALL,          &&op_RETURN,
+      &&op_CLOSURE,       &&op_CLOSE,         &&op_BUILD_ARRAY,   &&op_BUILD_DICT};
+  static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+                    static_cast<size_t>(RegisterOpCode::BUILD_DICT) + 1,
+                "dispatch_table must cover every RegisterOpCode");
+
+#define TARGET(op) op_##op:
+#define DISPATCH() \
+  do { \
+    COUNT_INSTRUCTION(); \
+    goto* dispatch_table[static_cast<uint8_t>((ip++)->opcode)]; \
+  } while (0)
+
+  DISPATCH();
+#else
+#define TARGET(op) case RegisterOpCode::op:
+#define DISPATCH() continue
+
+  for (;;) {
+    COUNT_INSTRUCTION();
+    switch ((ip++)->opcode) {
+#endif
+
+  TARGET(LOAD_CONST) {
+    slots[A] = constants[B];
+    DISPATCH();
+  }
 
-  if (perform_comparison_operation(left, right, OpCode::LESS, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for less than comparison");
+  TARGET(LOAD_NULL) {
+    slots[A] = PEBBLObject::make_null();
+    DISPATCH();
   }
-}
 
-void VM::handle_greater() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+  TARGET(LOAD_TRUE) {
+    slots[A] = PEBBLObject::make_bool(true);
+    DISPATCH();
+  }
 
-  if (perform_comparison_operation(left, right, OpCode::GREATER, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for greater than comparison");
+  TARGET(LOAD_FALSE) {
+    slots[A] = PEBBLObject::make_bool(false);
+    DISPATCH();
   }
-}
 
-void VM::handle_less_equal() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+  TARGET(MOVE) {
+    slots[A] = slots[B];
+    DISPATCH();
+  }
 
-  if (perform_comparison_operation(left, right, OpCode::LESS_EQUAL, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for less than or equal comparison");
+  TARGET(LOAD_GLOBAL) {
+    PEBBLObject value = globals[B];
+    if (value.is_undefined()) {
+      RUNTIME_ERROR("Undefined variable '" + global_table_.get(B).name + "'");
+    }
+    slots[A] = value;
+    DISPATCH();
+  }
+
+  TARGET(STORE_GLOBAL) {
+    const VariableInfo& info = global_table_.get(B);
+    if (globals[B].is_undefined()) {
+      RUNTIME_ERROR("Undefined variable '" + info.name + "'");
+    }
+    if (!info.is_mutable) {
+      RUNTIME_ERROR("Cannot assign to immutable variable '" + info.name + "'");
+    }
+    globals[B] = slots[A];
+    DISPATCH();
   }
-}
 
-void VM::handle_greater_equal() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  PEBBLObject result;
+  TARGET(DEFINE_GLOBAL) {
+    globals[B] = slots[A];
+    DISPATCH();
+  }
 
-  if (perform_comparison_operation(left, right, OpCode::GREATER_EQUAL, result)) {
-    push(result);
-  } else {
-    runtime_error("Invalid operands for greater than or equal comparison");
+  TARGET(LOAD_UPVALUE) {
+    slots[A] = *upvalues[B]->location;
+    DISPATCH();
   }
-}
 
-void VM::handle_not() {
-  PEBBLObject operand = pop();
-  push(PEBBLObject::make_bool(!is_truthy(operand)));
-}
+  TARGET(STORE_UPVALUE) {
+    PEBBLUpvalue* upvalue = upvalues[B];
+    *upvalue->location = slots[A];
+    heap_.write_barrier(upvalue, slots[A]);
+    DISPATCH();
+  }
 
-void VM::handle_and() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  push(PEBBLObject::make_bool(is_truthy(left) && is_truthy(right)));
-}
+  TARGET(ADD) {
+    BINARY_OPERATION(+, make_int32, make_double, "Invalid operands for addition");
+    DISPATCH();
+  }
+
+  TARGET(SUBTRACT) {
+    BINARY_OPERATION(-, make_int32, make_double, "Invalid operands for subtraction");
+    DISPATCH();
+  }
+
+  TARGET(MULTIPLY) {
+    BINARY_OPERATION(*, make_int32, make_double, "Invalid operands for multiplication");
+    DISPATCH();
+  }
+
+  TARGET(DIVIDE) {
+    PEBBLObject right = RK(C);
+    if ((right.is_int32() && right.as_int32() == 0) ||
+        (right.is_double() && right.as_double() == 0.0)) {
+      RUNTIME_ERROR("Division by zero");
+    }
+    if (!perform_numeric_operation(RK(B), right, OpCode::DIVIDE, slots[A])) {
+      RUNTIME_ERROR("Invalid operands for division");
+    }
+    DISPATCH();
+  }
+
+  TARGET(EQUAL) {
+    slots[A] = PEBBLObject::make_bool(are_equal(RK(B), RK(C)));
+    DISPATCH();
+  }
+
+  TARGET(NOT_EQUAL) {
+    slots[A] = PEBBLObject::make_bool(!are_equal(RK(B), RK(C)));
+    DISPATCH();
+  }
+
+  TARGET(LESS) {
+    BINARY_OPERATION(<, make_bool, make_bool, "Invalid operands for less than comparison");
+    DISPATCH();
+  }
+
+  TARGET(GREATER) {
+    BINARY_OPERATION(>, make_bool, make_bool, "Invalid operands for greater than comparison");
+    DISPATCH();
+  }
+
+  TARGET(LESS_EQUAL) {
+    BINARY_OPERATION(
+        <=, make_bool, make_bool, "Invalid operands for less than or equal comparison");
+    DISPATCH();
+  }
+
+  TARGET(GREATER_EQUAL) {
+    BINARY_OPERATION(
+        >=, make_bool, make_bool, "Invalid operands for greater than or equal comparison");
+    DISPATCH();
+  }
+
+  TARGET(AND) {
+    slots[A] = PEBBLObject::make_bool(is_truthy(RK(B)) && is_truthy(RK(C)));
+    DISPATCH();
+  }
+
+  TARGET(OR) {
+    slots[A] = PEBBLObject::make_bool(is_truthy(RK(B)) || is_truthy(RK(C)));
+    DISPATCH();
+  }
 
-void VM::handle_or() {
-  PEBBLObject right = pop();
-  PEBBLObject left = pop();
-  push(PEBBLObject::make_bool(is_truthy(left) || is_truthy(right)));
+  TARGET(NEGATE) {
+    PEBBLObject value = slots[B];
+    if (value.is_int32()) {
+      slots[A] = PEBBLObject::make_int32(-value.as_int32());
+    } else if (value.is_double()) {
+      slots[A] = PEBBLObject::make_double(-value.as_double());
+    } else {
+      RUNTIME_ERROR("Invalid operand for negation");
+    }
+    DISPATCH();
+  }
+
+  TARGET(NOT) {
+    slots[A] = PEBBLObject::make_bool(!is_truthy(slots[B]));
+    DISPATCH();
+  }
+
+  TARGET(JUMP) {
+    ip = code + B;
+    DISPATCH();
+  }
+
+  TARGET(JUMP_IF_FALSE) {
+    if (!is_truthy(slots[A])) {
+      ip = code + B;
+    }
+    DISPATCH();
+  }
+
+  TARGET(CALL) {
+    // call_value expects the function and its arguments at the top of the stack
+    SAVE_STATE();
+    size_t frame_count = frames_.size();
+    PEBBLObject* window_end = stack_top_;
+    stack_top_ = slots + A + 1 + B;
+    if (!call_value(B)) {
+      return VMResult::RUNTIME_ERROR;
+    }
+
+    if (frames_.size() == frame_count) {
+      // A builtin replaced the function with its result. Registers above the arguments were not
+      // traced during the call, so they are cleared before the window covers them again
+      std::fill(slots + A + 1 + B, window_end, PEBBLObject::make_null());
+      stack_top_ = window_end;
+      DISPATCH();
+    }
+
+    // The arguments are the callee's first registers and the rest start out null
+    PEBBLObject* callee_slots = stack_.data() + frames_.back().stack_base;
+    PEBBLObject* callee_end = callee_slots + frames_.back().chunk->register_count;
+    if (callee_end > stack_limit) {
+      frames_.pop_back();
+      stack_top_ = window_end;
+      RUNTIME_ERROR("Stack overflow");
+    }
+    std::fill(callee_slots + B, callee_end, PEBBLObject::make_null());
+    stack_top_ = callee_end;
+    LOAD_FRAME();
+    DISPATCH();
+  }
+
+  TARGET(RETURN) {
+    PEBBLObject result = slots[A];
+    close_upvalues(slots);
+    if (frames_.size() == 1) {
+      // Returning from the main program ends execution with the value as the result
+      slots[0] = result;
+      stack_top_ = slots + 1;
+      SAVE_STATE();
+      return VMResult::OK;
+    }
+
+    // The result replaces the function below the callee's registers, in the caller's CALL register
+    PEBBLObject* callee_end = stack_top_;
+    slots[-1] = result;
+    frames_.pop_back();
+    LOAD_FRAME();
+
+    // Caller registers above the callee's window were not traced while it ran
+    stack_top_ = slots + frame->chunk->register_count;
+    if (callee_end < stack_top_) {
+      std::fill(callee_end, stack_top_, PEBBLObject::make_null());
+    }
+    DISPATCH();
+  }
+
+  TARGET(CLOSURE) {
+    // make_closure leaves the closure on the stack, just above the window
+    SAVE_STATE();
+    make_closure(constants[B]);
+    if (has_error_) {
+      return VMResult::RUNTIME_ERROR;
+    }
+    slots[A] = *--stack_top_;
+    DISPATCH();
+  }
+
+  TARGET(CLOSE) {
+    close_upvalues(slots + A);
+    DISPATCH();
+  }
+
+  TARGET(BUILD_ARRAY) {
+    SAVE_STATE();
+    PEBBLObject array = new_array(slots + B, C);
+    slots[A] = array;
+    DISPATCH();
+  }
+
+  TARGET(BUILD_DICT) {
+    SAVE_STATE();
+    PEBBLObject dict = new_dict(slots + B, C);
+    if (has_error_) {
+      return VMResult::RUNTIME_ERROR;
+    }
+    slots[A] = dict;
+    DISPATCH();
+  }
+
+#if !PEBBL_COMPUTED_GOTO
+      default:
+        RUNTIME_ERROR("Unknown instruction: " + std::to_string(static_cast<int>(ip[-1].opcode)));
+    }
+  }
+#endif
+
+#undef COUNT_INSTRUCTION
+#undef A
+#undef B
+#undef C
+#undef SAVE_STATE
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef RK
+#undef BINARY_OPERATION
+#undef TARGET
+#undef DISPATCH
 }
 
-void VM::handle_jump(uint32_t operand) {
-  current_frame().instruction_pointer = operand;
+#if PEBBL_COMPUTED_GOTO && defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+void VM::push(PEBBLObject value) {
+  if (stack_top_ >= stack_.data() + stack_.size()) {
+    runtime_error("Stack overflow");
+    return;
+  }
+  *stack_top_++ = value;
 }
 
-void VM::handle_jump_if_false(uint32_t operand) {
-  PEBBLObject condition = pop();
-  if (!is_truthy(condition)) {
-    current_frame().instruction_pointer = operand;
+PEBBLObject VM::pop() {
+  if (stack_top_ == stack_.data()) {
+    runtime_error("Stack underflow");
+    return PEBBLObject::make_null();
   }
+  return *--stack_top_;
 }
 
-void VM::handle_jump_if_true(uint32_t operand) {
-  PEBBLObject condition = pop();
-  if (is_truthy(condition)) {
-    current_frame().instruction_pointer = operand;
+PEBBLObject VM::peek(uint32_t distance) {
+  if (distance >= static_cast<size_t>(stack_top_ - stack_.data())) {
+    runtime_error("Stack underflow in peek");
+    return PEBBLObject::make_null();
   }
+  return stack_top_[-1 - static_cast<ptrdiff_t>(distance)];
+}
+
+void VM::reset_stack() {
+  stack_top_ = stack_.data();
 }
 
-void VM::handle_call(uint32_t argc) {
+bool VM::call_value(uint32_t argc) {
+  // Calls are a safepoint: state is saved and the arguments are on the stack
+  heap_.check_heap_limit();
+
   PEBBLObject function = peek(argc);  // Function is below the arguments
 
   if (!function.is_gc_ptr()) {
     runtime_error("Not a function");
-    return;
+    return false;
   }
 
   auto* gc_obj = function.as_gc_ptr();
 
   if (gc_obj->tag == GCTag::BUILTIN_FUNCTION) {
-    call_builtin(static_cast<PEBBLBuiltinFunction*>(gc_obj), argc);
+    return call_builtin(static_cast<PEBBLBuiltinFunction*>(gc_obj), argc);
   } else if (gc_obj->tag == GCTag::FUNCTION) {
-    call_function(static_cast<PEBBLFunction*>(gc_obj), argc);
-  } else {
-    runtime_error("Not a callable object");
+    return call_function(static_cast<PEBBLFunction*>(gc_obj), argc);
+  } else if (gc_obj->tag == GCTag::CLOSURE) {
+    auto* closure = static_cast<PEBBLClosure*>(gc_obj);
+    return call_function(closure->function, argc, closure);
   }
+
+  runtime_error("Not a callable object");
+  return false;
 }
 
-void VM::handle_return() {
-  PEBBLObject result = pop();
+void VM::build_array(uint32_t count) {
+  // The elements stay on the stack (reachable, and updated if a collection moves them) until the
+  // array has copied them
+  PEBBLObject* first = stack_top_ - count;
+  PEBBLObject array = new_array(first, count);
+  stack_top_ = first;
+  push(array);
+}
 
-  if (frames_.size() <= 1) {
-    // Returning from main program
-    push(result);
+void VM::build_dict(uint32_t count) {
+  // Like array elements, the pairs stay on the stack until the dict has copied them
+  PEBBLObject* first = stack_top_ - 2 * static_cast<size_t>(count);
+  PEBBLObject dict = new_dict(first, count);
+  if (has_error_) {
     return;
   }
+  stack_top_ = first;
+  push(dict);
+}
 
-  // Pop the call frame
-  CallFrame frame = frames_.back();
-  frames_.pop_back();
+PEBBLObject VM::new_array(const PEBBLObject* first, uint32_t count) {
+  note_allocation_site();
+  auto* array_obj = heap_.allocate<PEBBLArray>(std::span<const PEBBLObject>(first, count));
+  return PEBBLObject::make_gc_ptr(array_obj);
+}
 
-  // Remove local variables from stack
-  while (stack_.size() > frame.stack_base) {
-    stack_.pop_back();
+PEBBLObject VM::new_dict(const PEBBLObject* first, uint32_t count) {
+  const PEBBLObject* end = first + 2 * static_cast<size_t>(count);
+  for (const PEBBLObject* pair = first; pair < end; pair += 2) {
+    PEBBLObject key = pair[0];
+    if (!key.is_gc_ptr() || key.as_gc_ptr()->tag != GCTag::STRING) {
+      runtime_error("Dictionary keys must be strings");
+      return PEBBLObject::make_null();
+    }
   }
 
-  // Push return value
-  push(result);
+  note_allocation_site();
+  auto* dict_obj = heap_.allocate<PEBBLDict>(
+      std::span<const PEBBLObject>(first, 2 * static_cast<size_t>(count)));
+  return PEBBLObject::make_gc_ptr(dict_obj);
 }
 
-void VM::handle_build_array(uint32_t count) {
-  std::vector<PEBBLObject> elements;
-  elements.reserve(count);
-
-  // Pop elements in reverse order
-  for (uint32_t i = 0; i < count; ++i) {
-    elements.insert(elements.begin(), pop());
+void VM::make_closure(const PEBBLObject& function_constant) {
+  // The closure goes on the stack first so it stays reachable while its upvalues are allocated.
+  // Allocating can move the function and the closure itself, so both are re-read from their
+  // traced slots (the constant pool and the stack) after every allocation
+  note_allocation_site();
+  auto* closure = heap_.allocate<PEBBLClosure>();
+  push(PEBBLObject::make_gc_ptr(closure));
+  if (has_error_) {
+    return;
+  }
+  PEBBLObject* closure_slot = stack_top_ - 1;
+  closure->function = static_cast<PEBBLFunction*>(function_constant.as_gc_ptr());
+  closure->upvalues.reserve(closure->function->upvalues.size());
+  heap_.account_payload_growth(closure, closure->payload_size());
+
+  const CallFrame& frame = frames_.back();
+  PEBBLObject* slots = stack_.data() + frame.stack_base;
+  for (size_t i = 0; i < closure->function->upvalues.size(); ++i) {
+    const UpvalueInfo& info = closure->function->upvalues[i];
+    PEBBLUpvalue* upvalue = info.is_local ? capture_upvalue(slots + info.index)
+                                          : frame.closure->upvalues[info.index];
+    closure = static_cast<PEBBLClosure*>(closure_slot->as_gc_ptr());
+    closure->upvalues.push_back(upvalue);
+    heap_.write_barrier(closure, upvalue);
   }
-
-  auto* array_obj = heap_.allocate<PEBBLArray>(std::move(elements));
-  push(PEBBLObject::make_gc_ptr(array_obj));
 }
 
-void VM::handle_build_dict(uint32_t count) {
-  std::unordered_map<std::string, PEBBLObject> entries;
-
-  // Pop key-value pairs
-  for (uint32_t i = 0; i < count; ++i) {
-    PEBBLObject value = pop();
-    PEBBLObject key = pop();
-
-    // Convert key to string
-    if (key.is_gc_ptr() && key.as_gc_ptr()->tag == GCTag::STRING) {
-      auto* str_obj = static_cast<PEBBLString*>(key.as_gc_ptr());
-      entries[str_obj->value] = value;
-    } else {
-      runtime_error("Dictionary keys must be strings");
-      return;
-    }
+PEBBLUpvalue* VM::capture_upvalue(PEBBLObject* local) {
+  // Closures capturing the same slot share one upvalue
+  PEBBLUpvalue* upvalue = open_upvalues_;
+  while (upvalue && upvalue->location > local) {
+    upvalue = upvalue->next_open;
+  }
+  if (upvalue && upvalue->location == local) {
+    return upvalue;
   }
 
-  auto* dict_obj = heap_.allocate<PEBBLDict>(std::move(entries));
-  push(PEBBLObject::make_gc_ptr(dict_obj));
-}
-
-void VM::handle_pop() {
-  pop();
+  // Allocating can move the open upvalues, so the insertion point is found afterwards
+  auto* created = heap_.allocate<PEBBLUpvalue>(local);
+  PEBBLUpvalue** link = &open_upvalues_;
+  while (*link && (*link)->location > local) {
+    link = &(*link)->next_open;
+  }
+  created->next_open = *link;
+  *link = created;
+  return created;
 }
 
-void VM::handle_dup() {
-  push(peek(0));
+void VM::close_upvalues(PEBBLObject* last) {
+  while (open_upvalues_ && open_upvalues_->location >= last) {
+    PEBBLUpvalue* upvalue = open_upvalues_;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    heap_.write_barrier(upvalue, upvalue->closed);
+    open_upvalues_ = upvalue->next_open;
+    upvalue->next_open = nullptr;
+  }
 }
 
 bool VM::is_truthy(PEBBLObject value) {
@@ -564,8 +1377,15 @@ CallFrame& VM::current_frame() {
   return frames_.back();
 }
 
-const Chunk& VM::current_chunk() {
-  return *current_frame().chunk;
+void VM::note_allocation_site() {
+  if (heap_.profiling_allocations()) {
+    // The saved instruction pointer is already past the executing instruction
+    const CallFrame& frame = frames_.back();
+    uint32_t instruction = frame.chunk->has_register_code()
+                               ? frame.instruction_pointer - 1
+                               : frame.chunk->instruction_index(frame.instruction_pointer - 1);
+    heap_.set_allocation_site(frame.chunk->get_line(instruction));
+  }
 }
 
 void VM::runtime_error(const std::string& message) {
@@ -624,51 +1444,48 @@ bool VM::perform_numeric_operation(
   return false;
 }
 
-bool VM::perform_comparison_operation(
-    PEBBLObject left, PEBBLObject right, OpCode operation, PEBBLObject& result) {
-  if (left.is_int32() && right.is_int32()) {
-    int32_t a = left.as_int32();
-    int32_t b = right.as_int32();
-    switch (operation) {
-      case OpCode::LESS:
-        result = PEBBLObject::make_bool(a < b);
-        return true;
-      case OpCode::GREATER:
-        result = PEBBLObject::make_bool(a > b);
-        return true;
-      case OpCode::LESS_EQUAL:
-        result = PEBBLObject::make_bool(a <= b);
-        return true;
-      case OpCode::GREATER_EQUAL:
-        result = PEBBLObject::make_bool(a >= b);
-        return true;
-      default:
-        return false;
+#if PEBBL_OPCODE_PAIRS
+void VM::report_opcode_pairs(std::ostream& out) const {
+  constexpr size_t MAX_PAIRS = 40;
+
+  std::vector<size_t> pairs;
+  uint64_t total = 0;
+  for (size_t pair = 0; pair < opcode_pairs_.size(); ++pair) {
+    if (opcode_pairs_[pair] != 0) {
+      pairs.push_back(pair);
+      total += opcode_pairs_[pair];
     }
-  } else if (left.is_double() || right.is_double()) {
-    double a = left.is_int32() ? left.as_int32() : left.as_double();
-    double b = right.is_int32() ? right.as_int32() : right.as_double();
-    switch (operation) {
-      case OpCode::LESS:
-        result = PEBBLObject::make_bool(a < b);
-        return true;
-      case OpCode::GREATER:
-        result = PEBBLObject::make_bool(a > b);
-        return true;
-      case OpCode::LESS_EQUAL:
-        result = PEBBLObject::make_bool(a <= b);
-        return true;
-      case OpCode::GREATER_EQUAL:
-        result = PEBBLObject::make_bool(a >= b);
-        return true;
-      default:
-        return false;
+  }
+  std::sort(pairs.begin(), pairs.end(), [this](size_t a, size_t b) {
+    if (opcode_pairs_[a] != opcode_pairs_[b]) {
+      return opcode_pairs_[a] > opcode_pairs_[b];
+    }
+    return a < b;
+  });
+
+  std::ostringstream text;
+  if (register_instructions_ != 0) {
+    text << "register instructions: " << register_instructions_ << " executed\n";
+    if (total == 0) {
+      out << text.str();
+      return;
     }
   }
-  return false;
+  text << "opcode pairs: " << total << " executed, " << pairs.size() << " distinct\n";
+  text << std::setw(14) << "count" << std::setw(8) << "share" << "  pair\n";
+  text.setf(std::ios::fixed);
+  for (size_t i = 0; i < pairs.size() && i < MAX_PAIRS; ++i) {
+    uint64_t count = opcode_pairs_[pairs[i]];
+    text << std::setw(14) << count << std::setw(7) << std::setprecision(1)
+         << 100.0 * static_cast<double>(count) / static_cast<double>(total) << "%  "
+         << opcode_to_string(static_cast<OpCode>(pairs[i] / OPCODE_COUNT)) << " -> "
+         << opcode_to_string(static_cast<OpCode>(pairs[i] % OPCODE_COUNT)) << "\n";
+  }
+  out << text.str();
 }
+#endif
 
-bool VM::call_function(PEBBLFunction* function, uint32_t argc) {
+bool VM::call_function(PEBBLFunction* function, uint32_t argc, PEBBLClosure* closure) {
   if (argc != function->arity()) {
     runtime_error(
         "Wrong number of arguments. Expected " + std::to_string(function->arity()) + ", got " +
@@ -676,13 +1493,20 @@ bool VM::call_function(PEBBLFunction* function, uint32_t argc) {
     return false;
   }
 
-  // TODO: Implement user-defined function calls
-  // This would require:
-  // 1. Creating a new call frame
-  // 2. Setting up parameter bindings
-  // 3. Executing the function's bytecode
-  runtime_error("User-defined functions not yet implemented in VM");
-  return false;
+  if (!function->chunk) {
+    runtime_error("Function '" + function->name + "' has no compiled body");
+    return false;
+  }
+
+  if (frames_.size() >= FRAMES_MAX) {
+    runtime_error("Stack overflow");
+    return false;
+  }
+
+  // The arguments already sit on the stack in order, so they become the callee's first locals
+  uint32_t stack_base = static_cast<uint32_t>(stack_top_ - stack_.data()) - argc;
+  frames_.emplace_back(function->chunk.get(), 0, stack_base, closure);
+  return true;
 }
 
 bool VM::call_builtin(PEBBLBuiltinFunction* function, uint32_t argc) {
@@ -693,48 +1517,64 @@ bool VM::call_builtin(PEBBLBuiltinFunction* function, uint32_t argc) {
     return false;
   }
 
-  // Collect arguments
-  std::vector<PEBBLObject> args;
-  args.reserve(argc);
-  for (uint32_t i = 0; i < argc; ++i) {
-    args.insert(args.begin(), pop());
+  // The builtin reads its arguments in place; they stay on the stack (and rooted) during the call
+  note_allocation_site();
+  PEBBLObject* args = stack_top_ - argc;
+  PEBBLObject result = function->function(std::span<const PEBBLObject>(args, argc), *this);
+  if (has_error_) {
+    return false;
   }
 
-  // Pop the function from the stack
-  pop();
-
-  // For now, we'll need to skip builtin function calls until we properly integrate
-  // with the interpreter interface. This is a temporary limitation.
-  runtime_error("Builtin function calls not yet implemented in VM: " + function->name);
-  PEBBLObject result = PEBBLObject::make_null();
+  // Replace the function and its arguments with the result
+  stack_top_ = args - 1;
   push(result);
+  return true;
+}
 
-  return !has_error_;
+void VM::report_error(const std::string& message) {
+  runtime_error(message);
 }
 
 void VM::set_global(const std::string& name, PEBBLObject value) {
-  global_env_->define(name, value, false);
+  uint32_t index = global_table_.define(name, false);
+  if (index >= globals_.size()) {
+    globals_.resize(global_table_.size(), PEBBLObject::make_undefined());
+  }
+  globals_[index] = value;
 }
 
 PEBBLObject VM::get_global(const std::string& name) {
-  try {
-    return global_env_->get(name);
-  } catch (const std::runtime_error&) {
+  const VariableInfo* info = global_table_.find(name);
+  if (!info || info->index >= globals_.size() || globals_[info->index].is_undefined()) {
     return PEBBLObject::make_null();
   }
+  return globals_[info->index];
 }
 
 void VM::trace_roots(Tracer& tracer) {
-  // Trace all objects on the stack
-  for (const auto& value : stack_) {
-    if (value.is_gc_ptr()) {
-      tracer.mark(value.as_gc_ptr());
+  // Trace all live objects on the stack
+  for (PEBBLObject* slot = stack_.data(); slot < stack_top_; ++slot) {
+    tracer.visit(*slot);
+  }
+
+  // Trace constants and closures of every frame being executed (functions also trace their own
+  // chunk). Frames only point at chunks, which never move
+  for (CallFrame& frame : frames_) {
+    for (PEBBLObject& constant : frame.chunk->constants) {
+      tracer.visit(constant);
     }
+    tracer.visit(frame.closure);
   }
 
-  // Trace all objects in the global environment
-  if (global_env_) {
-    global_env_->trace_objects(tracer);
+  // Open upvalues are only referenced from closures, but must live as long as they are linked
+  // here. Every link is visited, since a young upvalue may hang off an old one
+  for (PEBBLUpvalue** link = &open_upvalues_; *link; link = &(*link)->next_open) {
+    tracer.visit(*link);
+  }
+
+  // Trace all global values
+  for (PEBBLObject& global : globals_) {
+    tracer.visit(global);
   }
 }
 
@@ -780,6 +1620,10 @@ std::string VM::stringify(PEBBLObject value) {
         auto* func = static_cast<PEBBLFunction*>(gc_obj);
         return "<function " + func->name + ">";
       }
+      case GCTag::CLOSURE: {
+        auto* closure = static_cast<PEBBLClosure*>(gc_obj);
+        return "<function " + closure->function->name + ">";
+      }
       case GCTag::BUILTIN_FUNCTION: {
         auto* builtin = static_cast<PEBBLBuiltinFunction*>(gc_obj);
         return "<builtin " + builtin->name + ">";
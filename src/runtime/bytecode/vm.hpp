@@ -5,30 +5,40 @@
 
 #pragma once
 
+#include <iosfwd>
 #include <memory>
 #include <stack>
 #include <unordered_map>
 #include <vector>
 
 #include "bytecode.hpp"
-#include "environment.hpp"
 #include "gc.hpp"
 #include "object.hpp"
+#include "runtime_context.hpp"
+
+// Build with -DPEBBL_OPCODE_PAIRS=1 (the CMake option of the same name) to count how often each
+// opcode is followed by each other one and print the most frequent pairs when the VM is destroyed
+#ifndef PEBBL_OPCODE_PAIRS
+#define PEBBL_OPCODE_PAIRS 0
+#endif
 
 // Forward declarations to avoid circular includes
 class PEBBLFunction;
 class PEBBLBuiltinFunction;
+class PEBBLClosure;
+class PEBBLUpvalue;
 
 /**
  * @brief Call frame for function calls
  */
 struct CallFrame {
-  const Chunk* chunk;
-  uint32_t instruction_pointer;
-  uint32_t stack_base;  // Base of this frame's local variables on the stack
+  Chunk* chunk;                  // Mutable so the VM can quicken its instructions in place
+  uint32_t instruction_pointer;  // Offset in the chunk's code, or index in its register code
+  uint32_t stack_base;    // Base of this frame's local variables (the first argument) on the stack
+  PEBBLClosure* closure;  // Closure being executed, null for functions without upvalues
 
-  CallFrame(const Chunk* c, uint32_t ip, uint32_t base) :
-      chunk(c), instruction_pointer(ip), stack_base(base) {
+  CallFrame(Chunk* c, uint32_t ip, uint32_t base, PEBBLClosure* cl = nullptr) :
+      chunk(c), instruction_pointer(ip), stack_base(base), closure(cl) {
   }
 };
 
@@ -40,7 +50,7 @@ enum class VMResult { OK, COMPILE_ERROR, RUNTIME_ERROR };
 /**
  * @brief Virtual machine for executing bytecode
  */
-class VM {
+class VM : public RuntimeContext {
 public:
   /**
    * @brief Constructor
@@ -48,12 +58,18 @@ public:
    */
   explicit VM(GCHeap& heap);
 
+  /**
+   * @brief Destructor; stops the heap from tracing this VM
+   */
+  ~VM();
+
   /**
    * @brief Execute a bytecode chunk
-   * @param chunk The bytecode chunk to execute
+   * @param chunk The bytecode chunk to execute, on the register machine if it holds register
+   *        code; stack instructions may be quickened
    * @return Execution result
    */
-  VMResult execute(const Chunk& chunk);
+  VMResult execute(Chunk& chunk);
 
   /**
    * @brief Get the top value from the stack (result of execution)
@@ -96,6 +112,14 @@ public:
    */
   PEBBLObject get_global(const std::string& name);
 
+  /**
+   * @brief Get the global slot table compilers must resolve globals against
+   * @return Global table owned by this VM
+   */
+  GlobalTable& global_table() {
+    return global_table_;
+  }
+
   /**
    * @brief Trace GC roots
    * @param tracer GC tracer
@@ -107,89 +131,94 @@ public:
    * @param value The value to stringify
    * @return String representation
    */
-  std::string stringify(PEBBLObject value);
+  std::string stringify(PEBBLObject value) override;
+
+  /**
+   * @brief Get the GC heap (for builtin functions)
+   * @return GC heap used for object allocation
+   */
+  GCHeap& get_heap() const override {
+    return heap_;
+  }
+
+  /**
+   * @brief Report an error from a builtin function
+   * @param message Error message
+   *
+   * The error is recorded and execution stops once the builtin returns.
+   */
+  void report_error(const std::string& message) override;
 
 private:
   GCHeap& heap_;
-  std::vector<PEBBLObject> stack_;
+  RootToken root_tracer_token_;     ///< Registration of trace_roots with the heap
+  std::vector<PEBBLObject> stack_;  ///< Fixed-size value stack (never reallocated)
+  PEBBLObject* stack_top_;          ///< One past the topmost live value in stack_
   std::vector<CallFrame> frames_;
-  std::shared_ptr<Environment> global_env_;
-  std::shared_ptr<Environment> current_env_;
+  PEBBLUpvalue* open_upvalues_;  ///< Upvalues still pointing into stack_, highest slot first
+  GlobalTable global_table_;
+  std::vector<PEBBLObject> globals_;  ///< Global values indexed by GlobalTable slot
 
   // Error handling
   bool has_error_;
   std::string error_message_;
 
   // Constants for stack management
-  static constexpr size_t STACK_MAX = 256;
-  static constexpr size_t FRAMES_MAX = 64;
+  static constexpr size_t FRAMES_MAX = 256;
+  static constexpr size_t STACK_MAX = FRAMES_MAX * 256;
+
+  // Times an instruction may fall back from a specialized form before it stays generic
+  static constexpr uint32_t MAX_DEOPTIMIZATIONS = 4;
+
+#if PEBBL_OPCODE_PAIRS
+  // Executions of each opcode pair, indexed by first * OPCODE_COUNT + second
+  std::vector<uint64_t> opcode_pairs_;
+  uint64_t register_instructions_ = 0;  // Register instructions executed, which are not paired
+  void report_opcode_pairs(std::ostream& out) const;
+#endif
 
   // Execution methods
   VMResult run();
+  VMResult run_registers();  // Dispatch loop of the register instruction set
 
-  // Stack manipulation
+  // Stack manipulation (used outside the dispatch loop, which works on a cached stack pointer)
   void push(PEBBLObject value);
   PEBBLObject pop();
   PEBBLObject peek(uint32_t distance = 0);
   void reset_stack();
 
-  // Instruction handlers
-  void handle_load_const(uint32_t operand);
-  void handle_load_null();
-  void handle_load_true();
-  void handle_load_false();
-  void handle_load_var(uint32_t operand);
-  void handle_store_var(uint32_t operand);
-  void handle_define_var(uint32_t operand);
-  void handle_add();
-  void handle_subtract();
-  void handle_multiply();
-  void handle_divide();
-  void handle_negate();
-  void handle_equal();
-  void handle_not_equal();
-  void handle_less();
-  void handle_greater();
-  void handle_less_equal();
-  void handle_greater_equal();
-  void handle_not();
-  void handle_and();
-  void handle_or();
-  void handle_jump(uint32_t operand);
-  void handle_jump_if_false(uint32_t operand);
-  void handle_jump_if_true(uint32_t operand);
-  void handle_call(uint32_t argc);
-  void handle_return();
-  void handle_build_array(uint32_t count);
-  void handle_build_dict(uint32_t count);
-  void handle_pop();
-  void handle_dup();
+  // Call dispatch for CALL instructions (function object sits below the arguments)
+  bool call_value(uint32_t argc);
+  void build_array(uint32_t count);
+  void build_dict(uint32_t count);
+
+  // Collections made of count values (key-value pairs for dicts) from first, which must stay
+  // rooted; new_dict returns null after reporting a runtime error
+  PEBBLObject new_array(const PEBBLObject* first, uint32_t count);
+  PEBBLObject new_dict(const PEBBLObject* first, uint32_t count);
+
+  // Closure support
+  void make_closure(const PEBBLObject& function_constant);
+  PEBBLUpvalue* capture_upvalue(PEBBLObject* local);
+  void close_upvalues(PEBBLObject* last);
 
   // Utility methods
   bool is_truthy(PEBBLObject value);
   bool are_equal(PEBBLObject left, PEBBLObject right);
   CallFrame& current_frame();
-  const Chunk& current_chunk();
+
+  // Attribute the allocations of the instruction being executed to its line, when profiling
+  void note_allocation_site();
 
   // Error reporting
   void runtime_error(const std::string& message);
   void runtime_error(const std::string& message, uint32_t instruction);
 
-  // Environment management
-  void push_environment(std::shared_ptr<Environment> env);
-  void pop_environment();
-
-  // Builtin function support
-  PEBBLObject call_builtin_function(
-      PEBBLBuiltinFunction* func, const std::vector<PEBBLObject>& args);
-
   // Function calling support
-  bool call_function(PEBBLFunction* function, uint32_t argc);
+  bool call_function(PEBBLFunction* function, uint32_t argc, PEBBLClosure* closure = nullptr);
   bool call_builtin(PEBBLBuiltinFunction* function, uint32_t argc);
 
   // Arithmetic operation helpers
   bool perform_numeric_operation(
       PEBBLObject left, PEBBLObject right, OpCode operation, PEBBLObject& result);
-  bool perform_comparison_operation(
-      PEBBLObject left, PEBBLObject right, OpCode operation, PEBBLObject& result);
 };
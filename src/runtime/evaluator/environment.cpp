@@ -7,13 +7,19 @@
 
 #include <stdexcept>
 
-#include "gc.hpp"
+#include "heap_snapshot.hpp"
 
-Environment::Environment(std::shared_ptr<Environment> parent) : parent_(parent) {
+Environment::Environment(GCHeap& heap, std::shared_ptr<Environment> parent) :
+    heap_(heap), parent_(parent) {
+}
+
+Environment::~Environment() {
+  heap_.forget(this);
 }
 
 void Environment::define(const std::string& name, PEBBLObject value, bool is_mutable) {
   variables_.emplace(name, Variable(value, is_mutable));
+  heap_.write_barrier(this, value);
 }
 
 PEBBLObject Environment::get(const std::string& name) const {
@@ -36,6 +42,7 @@ void Environment::set(const std::string& name, PEBBLObject value) {
       throw std::runtime_error("Cannot assign to immutable variable '" + name + "'");
     }
     it->second.value = value;
+    heap_.write_barrier(this, value);
     return;
   }
 
@@ -59,11 +66,40 @@ bool Environment::exists(const std::string& name) const {
   return false;
 }
 
-void Environment::trace_objects(Tracer& tracer) const {
-  // Trace all GC objects in this environment's variables
+size_t Environment::payload_size() const {
+  // Bucket array plus one node per variable, whose name may own a buffer
+  size_t bytes = variables_.bucket_count() * sizeof(void*);
   for (const auto& [name, variable] : variables_) {
-    if (variable.value.is_gc_ptr()) {
-      tracer.mark(variable.value.as_gc_ptr());
+    bytes += sizeof(void*) + sizeof(std::pair<const std::string, Variable>);
+    if (name.capacity() > std::string().capacity()) {
+      bytes += name.capacity() + 1;
+    }
+  }
+  return bytes;
+}
+
+void Environment::trace_slots(Tracer& tracer) {
+  // Trace all GC objects in this environment's variables
+  for (auto& [name, variable] : variables_) {
+    tracer.visit(variable.value);
+  }
+}
+
+void Environment::trace_chain(Tracer& tracer) {
+  // Snapshots keep environments as nodes of their own rather than tracing through them
+  if (HeapSnapshot* snapshot = tracer.snapshot()) {
+    snapshot->add_edge(this);
+    return;
+  }
+
+  // Many functions share the same scopes; once an environment is traced, so are its parents
+  // Parallel markers may race up the same chain; whoever stamps an environment traces it
+  uint64_t cycle = tracer.cycle();
+  for (Environment* env = this; env; env = env->parent_.get()) {
+    if (env->traced_cycle_.load(std::memory_order_relaxed) == cycle ||
+        env->traced_cycle_.exchange(cycle, std::memory_order_relaxed) == cycle) {
+      break;
     }
+    env->trace_slots(tracer);
   }
 }
\ No newline at end of file
@@ -5,28 +5,39 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <unordered_map>
 
+#include "gc.hpp"
 #include "object.hpp"
 
-class Tracer;
-
 /**
  * @brief Environment for storing variables and managing scopes
  *
  * The Environment class manages variable storage with lexical scoping.
  * Each environment can have a parent environment, forming a scope chain
  * for variable resolution.
+ *
+ * Environments are reference counted, not collected. Their values are
+ * traced through the interpreter's active scopes and through the functions
+ * that captured them; every store goes through the heap's write barrier so
+ * minor collections also find young values held here.
  */
-class Environment {
+class Environment : public RememberedSlots {
 public:
   /**
    * @brief Create a new environment
+   * @param heap GC heap owning the stored values
    * @param parent Optional parent environment for scope chaining
    */
-  explicit Environment(std::shared_ptr<Environment> parent = nullptr);
+  explicit Environment(GCHeap& heap, std::shared_ptr<Environment> parent = nullptr);
+
+  ~Environment();
+
+  Environment(const Environment&) = delete;
+  Environment& operator=(const Environment&) = delete;
 
   /**
    * @brief Define a new variable in this environment
@@ -67,11 +78,34 @@ public:
     return parent_;
   }
 
+  /**
+   * @brief Call a function with the name and value of every variable defined here
+   */
+  template <typename Visit>
+  void for_each_variable(Visit&& visit) const {
+    for (const auto& [name, variable] : variables_) {
+      visit(name, variable.value);
+    }
+  }
+
+  /**
+   * @brief Estimated heap bytes of the variable table, not counting the values' objects
+   */
+  size_t payload_size() const;
+
   /**
    * @brief Trace all GC objects in this environment
-   * @param tracer GC tracer to mark objects
+   * @param tracer GC tracer to visit the variable slots
+   */
+  void trace_slots(Tracer& tracer) override;
+
+  /**
+   * @brief Trace this environment and its parents, each at most once per collection
+   * @param tracer GC tracer to visit the variable slots
+   *
+   * A snapshot tracer records a reference to this environment instead.
    */
-  void trace_objects(class Tracer& tracer) const;
+  void trace_chain(Tracer& tracer);
 
 private:
   struct Variable {
@@ -82,6 +116,8 @@ private:
     }
   };
 
+  GCHeap& heap_;
   std::shared_ptr<Environment> parent_;
   std::unordered_map<std::string, Variable> variables_;
+  std::atomic<uint64_t> traced_cycle_ = 0;  // Last collection that traced this environment
 };
\ No newline at end of file
@@ -13,35 +13,45 @@
 #include "compiler.hpp"
 #include "vm.hpp"
 
-Interpreter::Interpreter(GCHeap& heap, bool use_bytecode) :
-    heap_(heap), use_bytecode_(use_bytecode) {
-  global_env_ = std::make_shared<Environment>();
+Interpreter::Interpreter(GCHeap& heap, bool use_bytecode, bool use_registers) :
+    heap_(heap), use_bytecode_(use_bytecode), use_registers_(use_registers) {
+  global_env_ = std::make_shared<Environment>(heap_);
   current_env_ = global_env_;
 
   // Register this interpreter as a GC root tracer
-  heap_.add_root_tracer([this](Tracer& tracer) { this->trace_roots(tracer); });
+  root_tracer_token_ = heap_.add_root_tracer([this](Tracer& tracer) { this->trace_roots(tracer); });
 
   // Initialize bytecode components if requested
   if (use_bytecode_) {
-    compiler_ = std::make_unique<Compiler>(heap_);
     vm_ = std::make_unique<VM>(heap_);
+    if (use_registers_) {
+      register_compiler_ = std::make_unique<RegisterCompiler>(heap_, vm_->global_table());
+    } else {
+      compiler_ = std::make_unique<Compiler>(heap_, vm_->global_table());
+    }
   }
 
   register_builtin_functions();
 }
 
+Interpreter::~Interpreter() {
+  heap_.remove_root_tracer(root_tracer_token_);
+}
+
 PEBBLObject Interpreter::execute(const ProgramNode& program) {
-  if (use_bytecode_ && compiler_ && vm_) {
+  if (use_bytecode_ && (compiler_ || register_compiler_) && vm_) {
+    // Transfer global variables from interpreter environment to VM. This allocates, so it runs
+    // before compiling: nothing roots the finished chunk until the VM starts executing it.
+    sync_globals_to_vm();
+
     // Use bytecode compilation and execution
-    auto chunk = compiler_->compile(program);
+    auto chunk = register_compiler_ ? register_compiler_->compile(program)
+                                     : compiler_->compile(program);
     if (!chunk) {
       runtime_error("Failed to compile program to bytecode");
       return PEBBLObject::make_null();
     }
 
-    // Transfer global variables from interpreter environment to VM
-    sync_globals_to_vm();
-
     VMResult result = vm_->execute(*chunk);
     if (result != VMResult::OK) {
       runtime_error("VM execution failed: " + vm_->get_error());
@@ -59,14 +69,20 @@ PEBBLObject Interpreter::execute(const ProgramNode& program) {
     // Reset return state for each program execution
     has_return_ = false;
     return_value_ = PEBBLObject::make_null();
+    value_stack_.clear();
+    saved_envs_.clear();
 
-    for (const auto& statement : program.statements) {
-      // Ensure we're always in the global environment for top-level statements
-      current_env_ = global_env_;
-      result = execute(*statement);
-      if (has_return_) {
-        break;
+    try {
+      for (const auto& statement : program.statements) {
+        // Ensure we're always in the global environment for top-level statements
+        current_env_ = global_env_;
+        result = execute(*statement);
+        if (has_return_) {
+          break;
+        }
       }
+    } catch (const OutOfMemoryError& e) {
+      runtime_error(e.what());
     }
 
     return result;
@@ -156,6 +172,7 @@ PEBBLObject Interpreter::evaluate_literal(const LiteralNode& expr) {
 
     case ASTType::STRING_LITERAL: {
       const auto& string_literal = static_cast<const StringLiteralNode&>(expr);
+      note_allocation_site(expr);
       auto* str_obj = heap_.allocate<PEBBLString>(string_literal.value);
       return PEBBLObject::make_gc_ptr(str_obj);
     }
@@ -182,7 +199,17 @@ PEBBLObject Interpreter::evaluate_identifier(const IdentifierNode& expr) {
 
 PEBBLObject Interpreter::evaluate_binary(const BinaryExpressionNode& expr) {
   PEBBLObject left = evaluate(*expr.left);
-  PEBBLObject right = evaluate(*expr.right);
+  PEBBLObject right;
+  if (left.is_gc_ptr()) {
+    // A heap operand stays on the value stack while the right one is evaluated, in case that
+    // allocates and the collector moves it
+    value_stack_.push_back(left);
+    right = evaluate(*expr.right);
+    left = value_stack_.back();
+    value_stack_.pop_back();
+  } else {
+    right = evaluate(*expr.right);
+  }
 
   switch (expr.operator_token.type) {
     case TokenType::PLUS:
@@ -374,46 +401,50 @@ PEBBLObject Interpreter::evaluate_if_else(const IfElseExpressionNode& expr) {
 }
 
 PEBBLObject Interpreter::evaluate_array_literal(const ArrayLiteralNode& expr) {
-  std::vector<PEBBLObject> elements;
-  elements.reserve(expr.elements.size());
-
+  // Elements are evaluated onto the value stack so they stay rooted until the array owns them
+  size_t base = value_stack_.size();
   for (const auto& element : expr.elements) {
-    elements.push_back(evaluate(*element));
+    PEBBLObject value = evaluate(*element);
+    value_stack_.push_back(value);
   }
 
-  auto* array_obj = heap_.allocate<PEBBLArray>(std::move(elements));
+  note_allocation_site(expr);
+  auto* array_obj = heap_.allocate<PEBBLArray>(
+      std::span<const PEBBLObject>(value_stack_.data() + base, expr.elements.size()));
+  value_stack_.resize(base);
   return PEBBLObject::make_gc_ptr(array_obj);
 }
 
 PEBBLObject Interpreter::evaluate_dict_literal(const DictLiteralNode& expr) {
-  std::unordered_map<std::string, PEBBLObject> entries;
-
+  // Keys and values are evaluated onto the value stack as pairs until the dict owns them
+  size_t base = value_stack_.size();
   for (const auto& [key_ptr, value_ptr] : expr.entries) {
     PEBBLObject key_value = evaluate(*key_ptr);
-    PEBBLObject value = evaluate(*value_ptr);
-
-    std::string key_str;
-    if (key_value.is_gc_ptr()) {
-      auto* gc_obj = key_value.as_gc_ptr();
-      if (gc_obj->tag == GCTag::STRING) {
-        auto* str_obj = static_cast<PEBBLString*>(gc_obj);
-        key_str = str_obj->value;
-      } else {
-        runtime_error("Dictionary keys must be strings", expr.get_token());
-        return PEBBLObject::make_null();
-      }
-    } else {
+    if (!key_value.is_gc_ptr() || key_value.as_gc_ptr()->tag != GCTag::STRING) {
       runtime_error("Dictionary keys must be strings", expr.get_token());
       return PEBBLObject::make_null();
     }
+    value_stack_.push_back(key_value);
 
-    entries[key_str] = value;
+    PEBBLObject value = evaluate(*value_ptr);
+    value_stack_.push_back(value);
   }
 
-  auto* dict_obj = heap_.allocate<PEBBLDict>(std::move(entries));
+  note_allocation_site(expr);
+  auto* dict_obj = heap_.allocate<PEBBLDict>(
+      std::span<const PEBBLObject>(value_stack_.data() + base, value_stack_.size() - base));
+  value_stack_.resize(base);
   return PEBBLObject::make_gc_ptr(dict_obj);
 }
 
+void Interpreter::note_allocation_site(const ASTNode& node) {
+  if (heap_.profiling_allocations()) {
+    if (const Token* token = node.get_token()) {
+      heap_.set_allocation_site(static_cast<uint32_t>(token->line));
+    }
+  }
+}
+
 bool Interpreter::is_truthy(PEBBLObject value) {
   if (value.is_bool()) {
     return value.as_bool();
@@ -498,6 +529,10 @@ std::string Interpreter::stringify(PEBBLObject value) {
         auto* func = static_cast<PEBBLFunction*>(gc_obj);
         return "<function " + func->name + ">";
       }
+      case GCTag::CLOSURE: {
+        auto* closure = static_cast<PEBBLClosure*>(gc_obj);
+        return "<function " + closure->function->name + ">";
+      }
       case GCTag::BUILTIN_FUNCTION: {
         auto* builtin = static_cast<PEBBLBuiltinFunction*>(gc_obj);
         return "<builtin " + builtin->name + ">";
@@ -533,7 +568,7 @@ PEBBLObject Interpreter::execute_return_statement(const ReturnStatementNode& stm
 }
 
 PEBBLObject Interpreter::execute_block_statement(const BlockStatementNode& stmt) {
-  auto block_env = std::make_shared<Environment>(current_env_);
+  auto block_env = std::make_shared<Environment>(heap_, current_env_);
   push_environment(block_env);
 
   PEBBLObject result = PEBBLObject::make_null();
@@ -555,15 +590,20 @@ PEBBLObject Interpreter::execute_block_statement(const BlockStatementNode& stmt)
 }
 
 PEBBLObject Interpreter::execute_while_statement(const WhileLoopStatementNode& stmt) {
-  PEBBLObject result = PEBBLObject::make_null();
+  // The last iteration's value is kept on the value stack while the condition is re-evaluated
+  size_t result_slot = value_stack_.size();
+  value_stack_.push_back(PEBBLObject::make_null());
 
   while (is_truthy(evaluate(*stmt.condition))) {
-    result = execute(*stmt.block);
+    PEBBLObject value = execute(*stmt.block);
+    value_stack_[result_slot] = value;
     if (has_return_) {
       break;
     }
   }
 
+  PEBBLObject result = value_stack_[result_slot];
+  value_stack_.resize(result_slot);
   return result;
 }
 
@@ -577,9 +617,14 @@ PEBBLObject Interpreter::execute_for_statement(const ForLoopStatementNode& stmt)
   }
 
   // Create new scope for the loop
-  auto loop_env = std::make_shared<Environment>(current_env_);
+  auto loop_env = std::make_shared<Environment>(heap_, current_env_);
   push_environment(loop_env);
 
+  // The iterable stays on the value stack so the body cannot collect it, and is re-read after
+  // every iteration in case the collector moved it
+  size_t iterable_slot = value_stack_.size();
+  value_stack_.push_back(iterable);
+
   PEBBLObject result = PEBBLObject::make_null();
 
   try {
@@ -588,8 +633,13 @@ PEBBLObject Interpreter::execute_for_statement(const ForLoopStatementNode& stmt)
 
       if (gc_obj->tag == GCTag::ARRAY) {
         // Iterate over array elements
-        auto* array = static_cast<PEBBLArray*>(gc_obj);
-        for (const auto& element : array->elements) {
+        for (size_t i = 0;; ++i) {
+          auto* array = static_cast<PEBBLArray*>(value_stack_[iterable_slot].as_gc_ptr());
+          if (i >= array->elements.size()) {
+            break;
+          }
+          PEBBLObject element = array->elements[i];
+
           // Bind loop variable to current element
           // Use define for first iteration, then set for subsequent ones
           if (!current_env_->exists(stmt.identifier->name)) {
@@ -607,10 +657,12 @@ PEBBLObject Interpreter::execute_for_statement(const ForLoopStatementNode& stmt)
           }
         }
       } else if (gc_obj->tag == GCTag::DICT) {
-        // Iterate over dictionary keys
-        auto* dict = static_cast<PEBBLDict*>(gc_obj);
-        for (const auto& [key, value] : dict->entries) {
+        // Iterate over a snapshot of the dictionary keys, since allocating each key string can
+        // move the dictionary
+        std::vector<std::string> keys = static_cast<PEBBLDict*>(gc_obj)->keys();
+        for (const auto& key : keys) {
           // Bind loop variable to current key
+          note_allocation_site(stmt);
           PEBBLObject key_obj = PEBBLObject::make_gc_ptr(heap_.allocate<PEBBLString>(key));
           // Use define for first iteration, then set for subsequent ones
           if (!current_env_->exists(stmt.identifier->name)) {
@@ -635,11 +687,13 @@ PEBBLObject Interpreter::execute_for_statement(const ForLoopStatementNode& stmt)
     }
   } catch (...) {
     // Restore previous environment on exception
+    value_stack_.resize(iterable_slot);
     pop_environment();
     throw;
   }
 
   // Restore previous environment
+  value_stack_.resize(iterable_slot);
   pop_environment();
 
   return result;
@@ -664,6 +718,7 @@ PEBBLObject Interpreter::execute_function_statement(const FunctionStatementNode&
   }
 
   // Create function object with current environment as closure
+  note_allocation_site(stmt);
   auto func = heap_.allocate<PEBBLFunction>(
       stmt.name->name, std::move(param_names), current_env_, stmt.body.get());
 
@@ -684,63 +739,65 @@ PEBBLObject Interpreter::evaluate_call(const CallExpressionNode& expr) {
   }
 
   auto* gc_obj = function.as_gc_ptr();
+  size_t expected_arity;
 
   if (gc_obj->tag == GCTag::BUILTIN_FUNCTION) {
-    auto* builtin_func = static_cast<PEBBLBuiltinFunction*>(gc_obj);
-
-    // Check arity for functions that have fixed arity (SIZE_MAX means variable arguments)
-    if (builtin_func->arity != SIZE_MAX && expr.arguments.size() != builtin_func->arity) {
-      runtime_error(
-          "Wrong number of arguments. Expected " + std::to_string(builtin_func->arity) + ", got " +
-              std::to_string(expr.arguments.size()),
-          expr.get_token());
-      return PEBBLObject::make_null();
-    }
-
-    // Evaluate arguments
-    std::vector<PEBBLObject> args;
-    for (const auto& arg : expr.arguments) {
-      args.push_back(evaluate(*arg));
-    }
-
-    return builtin_func->function(args, *this);
-  }
-
-  if (gc_obj->tag != GCTag::FUNCTION) {
+    expected_arity = static_cast<PEBBLBuiltinFunction*>(gc_obj)->arity;
+  } else if (gc_obj->tag == GCTag::FUNCTION) {
+    expected_arity = static_cast<PEBBLFunction*>(gc_obj)->arity();
+  } else {
     runtime_error("Not a function", expr.get_token());
     return PEBBLObject::make_null();
   }
 
-  auto* func = static_cast<PEBBLFunction*>(gc_obj);
-
-  // Check arity
-  if (expr.arguments.size() != func->arity()) {
+  // Check arity for functions that have fixed arity (SIZE_MAX means variable arguments)
+  if (expected_arity != SIZE_MAX && expr.arguments.size() != expected_arity) {
     runtime_error(
-        "Wrong number of arguments. Expected " + std::to_string(func->arity()) + ", got " +
+        "Wrong number of arguments. Expected " + std::to_string(expected_arity) + ", got " +
             std::to_string(expr.arguments.size()),
         expr.get_token());
     return PEBBLObject::make_null();
   }
 
-  // Evaluate arguments
-  std::vector<PEBBLObject> arg_values;
-  arg_values.reserve(expr.arguments.size());
+  // Evaluate arguments onto the value stack above the callee. Evaluating them can allocate, and
+  // a collection may move the function object, so it is re-read from its slot afterwards
+  size_t callee_slot = value_stack_.size();
+  size_t args_base = callee_slot + 1;
+  value_stack_.push_back(function);
   for (const auto& arg : expr.arguments) {
-    arg_values.push_back(evaluate(*arg));
+    PEBBLObject value = evaluate(*arg);
+    value_stack_.push_back(value);
+  }
+  // Calls are a safepoint: the callee and arguments are rooted on the value stack
+  heap_.check_heap_limit();
+  gc_obj = value_stack_[callee_slot].as_gc_ptr();
+
+  if (gc_obj->tag == GCTag::BUILTIN_FUNCTION) {
+    // Hand the builtin a view of its arguments in place
+    note_allocation_site(expr);
+    PEBBLObject result = static_cast<PEBBLBuiltinFunction*>(gc_obj)->function(
+        std::span<const PEBBLObject>(value_stack_.data() + args_base, expr.arguments.size()),
+        *this);
+    value_stack_.resize(callee_slot);
+    return result;
   }
 
+  auto* func = static_cast<PEBBLFunction*>(gc_obj);
+
   // Create new environment for function execution
-  auto call_env = std::make_shared<Environment>(func->closure);
+  auto call_env = std::make_shared<Environment>(heap_, func->closure);
 
   // Bind parameters to arguments
   for (size_t i = 0; i < func->parameters.size(); ++i) {
-    call_env->define(func->parameters[i], arg_values[i], true);
+    call_env->define(func->parameters[i], value_stack_[args_base + i], true);
   }
 
-  // Save current environment and switch to call environment
-  auto prev_env = current_env_;
+  // Save the caller's state where the collector can see it: its scope is not on the callee's
+  // environment chain, and the callee's slot is reused for the pending return value
+  saved_envs_.push_back(current_env_);
+  value_stack_[callee_slot] = return_value_;
+  value_stack_.resize(args_base);
   auto prev_return = has_return_;
-  auto prev_return_value = return_value_;
 
   current_env_ = call_env;
   has_return_ = false;
@@ -748,6 +805,14 @@ PEBBLObject Interpreter::evaluate_call(const CallExpressionNode& expr) {
 
   PEBBLObject result = PEBBLObject::make_null();
 
+  auto restore_caller = [&]() {
+    current_env_ = saved_envs_.back();
+    saved_envs_.pop_back();
+    has_return_ = prev_return;
+    return_value_ = value_stack_[callee_slot];
+    value_stack_.resize(callee_slot);
+  };
+
   try {
     // Execute function body
     result = execute(*func->body);
@@ -758,16 +823,12 @@ PEBBLObject Interpreter::evaluate_call(const CallExpressionNode& expr) {
     }
   } catch (...) {
     // Restore state on exception
-    current_env_ = prev_env;
-    has_return_ = prev_return;
-    return_value_ = prev_return_value;
+    restore_caller();
     throw;
   }
 
   // Restore previous state
-  current_env_ = prev_env;
-  has_return_ = prev_return;
-  return_value_ = prev_return_value;
+  restore_caller();
 
   return result;
 }
@@ -807,43 +868,46 @@ void Interpreter::register_builtin_functions() {
   // Register pop function
   auto* pop_builtin = heap_.allocate<PEBBLBuiltinFunction>("pop", 1, BuiltinFunctions::pop_impl);
   global_env_->define("pop", PEBBLObject::make_gc_ptr(pop_builtin), false);
+
+  // Register gc_stats function
+  auto* gc_stats_builtin =
+      heap_.allocate<PEBBLBuiltinFunction>("gc_stats", 0, BuiltinFunctions::gc_stats_impl);
+  global_env_->define("gc_stats", PEBBLObject::make_gc_ptr(gc_stats_builtin), false);
+
+  // Register heap_snapshot function
+  auto* heap_snapshot_builtin = heap_.allocate<PEBBLBuiltinFunction>(
+      "heap_snapshot", 1, BuiltinFunctions::heap_snapshot_impl);
+  global_env_->define("heap_snapshot", PEBBLObject::make_gc_ptr(heap_snapshot_builtin), false);
 }
 
 void Interpreter::trace_roots(Tracer& tracer) {
-  // Trace all objects stored in the global environment
-  trace_environment_objects(global_env_, tracer);
-
-  // Also trace the current environment if it's different from global
-  if (current_env_ != global_env_) {
-    trace_environment_objects(current_env_, tracer);
+  // Trace the global environment and every scope chain still in use: the current one and
+  // those of callers waiting for a function call to return
+  global_env_->trace_chain(tracer);
+  current_env_->trace_chain(tracer);
+  for (const auto& env : saved_envs_) {
+    env->trace_chain(tracer);
   }
 
   // Trace the return value if it's a GC object
-  if (return_value_.is_gc_ptr()) {
-    tracer.mark(return_value_.as_gc_ptr());
-  }
-}
-
-void Interpreter::trace_environment_objects(std::shared_ptr<Environment> env, Tracer& tracer) {
-  if (!env) return;
+  tracer.visit(return_value_);
 
-  // Trace all objects in this environment
-  env->trace_objects(tracer);
-
-  // Recursively trace parent environments
-  trace_environment_objects(env->get_parent(), tracer);
+  // Trace values that are still being evaluated
+  for (auto& value : value_stack_) {
+    tracer.visit(value);
+  }
 }
 
 void Interpreter::set_bytecode_mode(bool enable) {
   use_bytecode_ = enable;
 
-  if (enable && !compiler_) {
-    compiler_ = std::make_unique<Compiler>(heap_);
-  }
-
   if (enable && !vm_) {
     vm_ = std::make_unique<VM>(heap_);
   }
+
+  if (enable && !compiler_ && !register_compiler_) {
+    compiler_ = std::make_unique<Compiler>(heap_, vm_->global_table());
+  }
 }
 
 void Interpreter::sync_globals_to_vm() {
@@ -875,6 +939,16 @@ void Interpreter::sync_globals_to_vm() {
   // Register pop function
   auto* pop_builtin = heap_.allocate<PEBBLBuiltinFunction>("pop", 1, BuiltinFunctions::pop_impl);
   vm_->set_global("pop", PEBBLObject::make_gc_ptr(pop_builtin));
+
+  // Register gc_stats function
+  auto* gc_stats_builtin =
+      heap_.allocate<PEBBLBuiltinFunction>("gc_stats", 0, BuiltinFunctions::gc_stats_impl);
+  vm_->set_global("gc_stats", PEBBLObject::make_gc_ptr(gc_stats_builtin));
+
+  // Register heap_snapshot function
+  auto* heap_snapshot_builtin = heap_.allocate<PEBBLBuiltinFunction>(
+      "heap_snapshot", 1, BuiltinFunctions::heap_snapshot_impl);
+  vm_->set_global("heap_snapshot", PEBBLObject::make_gc_ptr(heap_snapshot_builtin));
 }
 
 void Interpreter::sync_globals_from_vm() {
@@ -13,6 +13,8 @@
 #include "environment.hpp"
 #include "gc.hpp"
 #include "object.hpp"
+#include "register_compiler.hpp"
+#include "runtime_context.hpp"
 #include "vm.hpp"
 
 /**
@@ -39,14 +41,20 @@ private:
  * It manages environments for variable scoping and integrates with the
  * garbage collection system for memory management.
  */
-class Interpreter {
+class Interpreter : public RuntimeContext {
 public:
   /**
    * @brief Constructor
    * @param heap GC heap for object allocation
    * @param use_bytecode Whether to use bytecode interpreter (default: false for tree-walker)
+   * @param use_registers Whether bytecode mode compiles to the register instruction set
    */
-  explicit Interpreter(GCHeap& heap, bool use_bytecode = false);
+  explicit Interpreter(GCHeap& heap, bool use_bytecode = false, bool use_registers = false);
+
+  /**
+   * @brief Destructor; stops the heap from tracing this interpreter
+   */
+  ~Interpreter();
 
   /**
    * @brief Execute a program
@@ -74,18 +82,18 @@ public:
    * @param value The value to stringify
    * @return String representation of the value
    */
-  std::string stringify(PEBBLObject value);
+  std::string stringify(PEBBLObject value) override;
 
   // GC root tracing
   void trace_roots(class Tracer& tracer);
 
   // Heap access for builtin functions
-  GCHeap& get_heap() const {
+  GCHeap& get_heap() const override {
     return heap_;
   }
 
   // Public error reporting for builtin functions
-  void report_error(const std::string& message) {
+  void report_error(const std::string& message) override {
     runtime_error(message);
   }
 
@@ -105,6 +113,7 @@ public:
 
 private:
   GCHeap& heap_;
+  RootToken root_tracer_token_;  ///< Registration of trace_roots with the heap
   std::shared_ptr<Environment> global_env_;
   std::shared_ptr<Environment> current_env_;
 
@@ -112,9 +121,18 @@ private:
   bool has_return_ = false;
   PEBBLObject return_value_;
 
+  // Intermediate values (operands, call arguments, literal elements), kept here so they stay
+  // rooted and are updated if the collector moves them
+  std::vector<PEBBLObject> value_stack_;
+
+  // Environments of callers suspended while a function call runs
+  std::vector<std::shared_ptr<Environment>> saved_envs_;
+
   // Bytecode execution components
   bool use_bytecode_;
+  bool use_registers_;
   std::unique_ptr<Compiler> compiler_;
+  std::unique_ptr<RegisterCompiler> register_compiler_;  // Used instead of compiler_ if set
   std::unique_ptr<VM> vm_;
 
   // Expression evaluation methods
@@ -141,13 +159,13 @@ private:
   bool is_truthy(PEBBLObject value);
   bool are_equal(PEBBLObject left, PEBBLObject right);
 
+  // Attribute the allocations a node is about to make to its line, when profiling
+  void note_allocation_site(const ASTNode& node);
+
   // Scope management
   void push_environment(std::shared_ptr<Environment> env);
   void pop_environment();
 
-  // Helper method for tracing environment objects
-  void trace_environment_objects(std::shared_ptr<Environment> env, class Tracer& tracer);
-
   // Error reporting
   void runtime_error(const std::string& message, const Token* token = nullptr);
 
@@ -6,104 +6,816 @@
 #include "gc.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <sstream>
 
-GCHeap::GCHeap() : objects_(nullptr), object_count_(0), next_gc_(8) {
+#include "gc_dispatch.hpp"
+#include "heap_snapshot.hpp"
+
+namespace {
+
+// The nursery must at least hold one object of the biggest size class
+constexpr size_t MIN_NURSERY_BYTES = 4 * 1024;
+
+// Pages at most this full are emptied by compaction, if the rest of their class has room
+constexpr double MAX_COMPACTED_OCCUPANCY = 0.5;
+
+}  // namespace
+
+const char* gc_tag_name(GCTag tag) {
+  switch (tag) {
+    case GCTag::STRING:
+      return "string";
+    case GCTag::ARRAY:
+      return "array";
+    case GCTag::DICT:
+      return "dict";
+    case GCTag::CLOSURE:
+      return "closure";
+    case GCTag::UPVALUE:
+      return "upvalue";
+    case GCTag::FUNCTION:
+      return "function";
+    case GCTag::BUILTIN_FUNCTION:
+      break;
+  }
+  return "builtin_function";
+}
+
+GCHeap::GCHeap(GCConfig config) :
+    config_(config), large_objects_(nullptr), object_count_(0), bytes_allocated_(0),
+    next_gc_bytes_(config.min_heap_bytes), large_bytes_allocated_(0),
+    next_large_gc_bytes_(config.min_heap_bytes), cycle_(0), marked_count_(0), marked_bytes_(0),
+    marked_large_bytes_(0), marked_by_tag_{}, sample_countdown_(SIZE_MAX),
+    heap_limit_reached_(false), marking_(false), sweep_cursor_(0), sweep_requested_(false),
+    stop_sweeper_(false), nursery_payload_bytes_(0) {
+  // The payload trigger in allocate compares against the same clamped size, so a tiny configured
+  // nursery cannot force a minor collection on every allocation
+  config_.nursery_bytes = std::max(config_.nursery_bytes, MIN_NURSERY_BYTES);
+  size_t nursery_size = config_.nursery_bytes & ~(SizeClasses::GRANULE - 1);
+  nursery_begin_ = static_cast<char*>(
+      ::operator new(nursery_size, std::align_val_t{SizeClasses::GRANULE}));
+  nursery_top_ = nursery_begin_;
+  nursery_end_ = nursery_begin_ + nursery_size;
+
+  if (config_.profile_sample_bytes > 0) {
+    profiler_ = std::make_unique<AllocationProfiler>(config_.profile_sample_bytes);
+    sample_countdown_ = profiler_->next_sample_distance();
+  }
+
+  if (config_.sweep_mode == GCConfig::SweepMode::BACKGROUND) {
+    sweeper_ = std::thread(&GCHeap::run_sweeper, this);
+  }
 }
 
 GCHeap::~GCHeap() {
+  if (sweeper_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(sweeper_mutex_);
+      stop_sweeper_ = true;
+    }
+    sweeper_wake_.notify_one();
+    sweeper_.join();
+  }
+
+  if (profiler_) {
+    profiler_->report(std::cerr);
+  }
+
+  marker_.reset();
+  marking_ = false;
+
+  // Containers destroyed along with the objects below must not touch the remembered list
+  for (RememberedSlots* holder : remembered_slots_) {
+    holder->remembered_index_ = RememberedSlots::NOT_REMEMBERED;
+  }
+  remembered_slots_.clear();
+
   // Clean up all remaining objects
-  GCObject* current = objects_;
+  for (char* cursor = nursery_begin_; cursor < nursery_top_;) {
+    auto* obj = reinterpret_cast<GCObject*>(cursor);
+    cursor += obj->alloc_size;
+    finalize_gc_object(obj);
+  }
+  ::operator delete(nursery_begin_, std::align_val_t{SizeClasses::GRANULE});
+
+  // Pages still pending a sweep hold their dead objects too, which die here all the same
+  for (auto& size_class : size_classes_) {
+    for (HeapPage* page : size_class.pages) {
+      page->for_each_object([](void* cell) { finalize_gc_object(static_cast<GCObject*>(cell)); });
+      HeapPage::destroy(page);
+    }
+  }
+
+  LargeObjectHeader* current = large_objects_;
   while (current) {
-    GCObject* next = current->next;
-    delete current;
+    LargeObjectHeader* next = current->next;
+    destroy_large(current);
     current = next;
   }
 }
 
-void GCHeap::add_root(GCObject** ref) {
-  roots_.push_back(ref);
+void GCHeap::destroy_large(LargeObjectHeader* header) {
+  finalize_gc_object(header->object());
+  ::operator delete(header, std::align_val_t{SizeClasses::GRANULE});
 }
 
-void GCHeap::remove_root(GCObject** ref) {
-  roots_.erase(std::remove(roots_.begin(), roots_.end(), ref), roots_.end());
+RootToken GCHeap::add_root(GCObject** ref) {
+  return roots_.add(ref);
 }
 
-void GCHeap::add_root_tracer(std::function<void(Tracer&)> tracer) {
-  root_tracers_.push_back(tracer);
+void GCHeap::remove_root(RootToken token) {
+  roots_.remove(token);
 }
 
-void GCHeap::remove_root_tracer(std::function<void(Tracer&)> /* tracer */) {
-  // Note: This is a simplified removal - in practice you'd need a better way to identify tracers
-  // For now, this is sufficient for our use case
+RootToken GCHeap::add_root_tracer(std::function<void(Tracer&)> tracer) {
+  return root_tracers_.add(std::move(tracer));
+}
+
+void GCHeap::remove_root_tracer(RootToken token) {
+  root_tracers_.remove(token);
+}
+
+void GCHeap::forget(RememberedSlots* holder) {
+  size_t index = holder->remembered_index_;
+  if (index == RememberedSlots::NOT_REMEMBERED) {
+    return;
+  }
+
+  // Swap the last entry into the vacated position
+  RememberedSlots* last = remembered_slots_.back();
+  remembered_slots_[index] = last;
+  last->remembered_index_ = index;
+  remembered_slots_.pop_back();
+  holder->remembered_index_ = RememberedSlots::NOT_REMEMBERED;
+}
+
+const char* GCCollectionStats::kind_name() const {
+  switch (kind) {
+    case Kind::MINOR:
+      return "minor";
+    case Kind::INCREMENTAL:
+      return "incremental";
+    case Kind::MAJOR:
+      break;
+  }
+  return "major";
 }
 
 void GCHeap::collect() {
+  begin_collection();
+  evacuate_nursery();
+  if (marking_) {
+    finish_marking();
+  } else {
+    collect_old();
+  }
+  end_collection();
+
+  // Everything unreachable is gone, so what remains is all live
+  if (over_heap_limit()) {
+    throw OutOfMemoryError("Out of memory: " + std::to_string(heap_bytes()) +
+                           " bytes live, over the heap limit of " +
+                           std::to_string(config_.max_heap_bytes) + " bytes");
+  }
+}
+
+void GCHeap::collect_young() {
+  begin_collection();
+  evacuate_nursery();
+  if (marking_) {
+    mark_slice();
+  } else if (major_gc_due()) {
+    if (config_.incremental) {
+      start_marking();
+    } else {
+      collect_old();
+    }
+  }
+  end_collection();
+
+  // Promotion may have pushed the heap over its limit, unless the old space holds garbage
+  if (over_heap_limit()) {
+    collect();
+  }
+}
+
+void GCHeap::begin_collection() {
+  collection_ = GCCollectionStats{};
+  collection_.heap_bytes_before = heap_bytes();
+  pause_start_ = std::chrono::steady_clock::now();
+}
+
+void GCHeap::end_collection() {
+  std::chrono::duration<double, std::milli> pause =
+      std::chrono::steady_clock::now() - pause_start_;
+  collection_.pause_ms = pause.count();
+  collection_.heap_bytes_after = heap_bytes();
+  if (collection_.heap_bytes_before > collection_.heap_bytes_after) {
+    collection_.bytes_freed = collection_.heap_bytes_before - collection_.heap_bytes_after;
+  }
+
+  if (collection_.kind == GCCollectionStats::Kind::MAJOR) {
+    stats_.major_collections++;
+  } else {
+    stats_.minor_collections++;
+  }
+  stats_.total_pause_ms += collection_.pause_ms;
+  stats_.max_pause_ms = std::max(stats_.max_pause_ms, collection_.pause_ms);
+  size_t bucket = 0;
+  double bound = GCStats::FIRST_PAUSE_BUCKET_MS;
+  while (bucket + 1 < GCStats::PAUSE_BUCKETS && collection_.pause_ms >= bound) {
+    bucket++;
+    bound *= 2;
+  }
+  stats_.pause_histogram[bucket]++;
+  stats_.objects_freed += collection_.objects_freed;
+  stats_.bytes_freed += collection_.bytes_freed;
+  stats_.last = collection_;
+
+  if (config_.trace) {
+    print_collection(collection_, stats_.minor_collections + stats_.major_collections);
+  }
+}
+
+void GCHeap::print_collection(const GCCollectionStats& collection, size_t number) {
+  // Format the whole line first so output from other threads can't split it
+  std::ostringstream line;
+  line.setf(std::ios::fixed);
+  line.precision(3);
+  line << "gc " << number << " " << collection.kind_name() << ": " << collection.pause_ms
+       << " ms, heap " << collection.heap_bytes_before << " -> " << collection.heap_bytes_after
+       << " bytes, survived " << collection.objects_survived << " objects ("
+       << collection.bytes_survived << " bytes), freed " << collection.objects_freed
+       << " objects (" << collection.bytes_freed << " bytes)\n";
+  std::cerr << line.str();
+}
+
+void GCHeap::sample_allocation(const GCObject* obj, size_t bytes) {
+  if (!profiler_) {
+    sample_countdown_ = SIZE_MAX;
+    return;
+  }
+  profiler_->record(obj->tag, bytes);
+  sample_countdown_ = profiler_->next_sample_distance();
+}
+
+size_t GCHeap::write_snapshot(std::ostream& out) {
+  HeapSnapshot snapshot;
+  Tracer tracer(*this, snapshot);
+  trace_roots(tracer);
+  snapshot.build(tracer);
+  snapshot.write(out);
+  return snapshot.node_count();
+}
+
+void GCHeap::trace_roots(Tracer& tracer) {
+  roots_.for_each([&tracer](GCObject** root) { tracer.visit(*root); });
+
+  // Call all custom root tracers
+  root_tracers_.for_each([&tracer](auto& root_tracer) { root_tracer(tracer); });
+}
+
+void GCHeap::evacuate_nursery() {
+  cycle_++;
+  Tracer tracer(*this, Tracer::Mode::MINOR);
+  trace_roots(tracer);
+
+  // Old objects and off-heap containers that were given young references act as extra roots
+  for (GCObject* obj : remembered_objects_) {
+    obj->remembered = false;
+    trace_gc_object(obj, tracer);
+  }
+  remembered_objects_.clear();
+
+  for (RememberedSlots* holder : remembered_slots_) {
+    holder->remembered_index_ = RememberedSlots::NOT_REMEMBERED;
+    holder->trace_slots(tracer);
+  }
+  remembered_slots_.clear();
+
+  // Copy everything reachable from the promoted objects
+  tracer.drain();
+
+  // Survivors now live in the old space; destroy the dead objects and the moved-from husks
+  for (char* cursor = nursery_begin_; cursor < nursery_top_;) {
+    auto* obj = reinterpret_cast<GCObject*>(cursor);
+    cursor += obj->alloc_size;
+    if (!obj->forwarded) {
+      collection_.objects_freed++;
+    }
+    finalize_gc_object(obj);
+  }
+  nursery_top_ = nursery_begin_;
+  nursery_payload_bytes_ = 0;
+}
+
+GCObject* GCHeap::evacuate(GCObject* obj) {
+  size_t size_class = SizeClasses::class_for_size(obj->alloc_size);
+  GCObject* copy = relocate_gc_object(obj, allocate_cell(size_class));
+  copy->alloc_size = SizeClasses::CELL_SIZES[size_class];
+
+  size_t payload = gc_object_payload_size(copy);
+  object_count_++;
+  account_old_object(copy->alloc_size, payload);
+  collection_.objects_survived++;
+  collection_.bytes_survived += copy->alloc_size + payload;
+  // Promoted during incremental marking: grey, since its old referents were stored unbarriered
+  if (marking_) {
+    marker_->shade(copy);
+  }
+
+  // Leave a forwarding pointer for other references to the same object
+  obj->forwarded = true;
+  obj->next = copy;
+  return copy;
+}
+
+void GCHeap::collect_old() {
   mark();
   sweep();
-  // Set next collection threshold to double the current live objects
-  next_gc_ = object_count_ * 2;
+  update_threshold();
+}
+
+void GCHeap::update_threshold() {
+  // Let the heap grow in proportion to what survived, but never collect a nearly empty heap
+  next_gc_bytes_ = std::max(
+      config_.min_heap_bytes,
+      static_cast<size_t>(static_cast<double>(bytes_allocated_) * config_.growth_factor));
+  // Large payloads grow their own budget, leaving the small-object schedule alone
+  next_large_gc_bytes_ = std::max(
+      config_.min_heap_bytes,
+      static_cast<size_t>(static_cast<double>(large_bytes_allocated_) * config_.growth_factor));
+}
+
+void GCHeap::begin_mark() {
+  // Sweeping clears the mark bits, so it must be complete before anything is marked again
+  finish_sweeping();
+  cycle_++;
+  marked_count_ = 0;
+  marked_bytes_ = 0;
+  marked_large_bytes_ = 0;
+  marked_by_tag_.fill(0);
+}
+
+void GCHeap::start_marking() {
+  collection_.kind = GCCollectionStats::Kind::INCREMENTAL;
+  begin_mark();
+  marker_ = std::make_unique<Tracer>(*this, Tracer::Mode::MAJOR);
+  marking_ = true;
+  trace_roots(*marker_);
+}
+
+void GCHeap::mark_slice() {
+  collection_.kind = GCCollectionStats::Kind::INCREMENTAL;
+  bool done = marker_->drain(config_.mark_slice_objects);
+  // Don't let the mutator outrun the marker indefinitely
+  if (done || bytes_allocated_ >= 2 * next_gc_bytes_ ||
+      large_bytes_allocated_ >= 2 * next_large_gc_bytes_) {
+    finish_marking();
+  }
+}
+
+void GCHeap::finish_marking() {
+  // Roots are not barriered, so they are scanned once more before the sweep
+  trace_roots(*marker_);
+  marker_->drain();
+  add_marked_counts(*marker_);
+  marker_.reset();
+  marking_ = false;
+
+  sweep();
+  update_threshold();
+}
+
+void GCHeap::shade(GCObject* obj) {
+  if (!in_nursery(obj) && !is_marked(obj)) {
+    marker_->shade(obj);
+  }
+}
+
+void GCHeap::rescan(GCObject* obj) {
+  marker_->rescan(obj);
 }
 
 void GCHeap::mark() {
-  Tracer tracer(*this);
+  begin_mark();
+  if (config_.mark_threads > 1) {
+    mark_parallel();
+    return;
+  }
+
+  Tracer tracer(*this, Tracer::Mode::MAJOR);
 
   // Mark all objects reachable from roots
-  for (GCObject** root : roots_) {
-    if (*root) {
-      tracer.mark(*root);
+  trace_roots(tracer);
+  tracer.drain();
+  add_marked_counts(tracer);
+}
+
+void GCHeap::add_marked_counts(const Tracer& tracer) {
+  marked_count_ += tracer.marked_count();
+  marked_bytes_ += tracer.marked_bytes();
+  marked_large_bytes_ += tracer.marked_large_bytes();
+  for (size_t tag = 0; tag < GC_TAG_COUNT; ++tag) {
+    marked_by_tag_[tag] += tracer.marked_by_tag()[tag];
+  }
+}
+
+void GCHeap::mark_parallel() {
+  size_t thread_count = config_.mark_threads;
+  std::vector<std::unique_ptr<MarkDeque>> deques;
+  std::vector<std::unique_ptr<Tracer>> tracers;
+  for (size_t i = 0; i < thread_count; ++i) {
+    deques.push_back(std::make_unique<MarkDeque>());
+    tracers.push_back(std::make_unique<Tracer>(*this, *deques.back()));
+  }
+
+  // The roots all land in the first deque; the other threads steal from there
+  trace_roots(*tracers[0]);
+
+  std::atomic<size_t> active(thread_count);
+  auto steal = [&](size_t self) -> GCObject* {
+    for (size_t i = 1; i < thread_count; ++i) {
+      if (GCObject* obj = deques[(self + i) % thread_count]->steal()) {
+        return obj;
+      }
+    }
+    return nullptr;
+  };
+  auto has_work = [&] {
+    return std::any_of(deques.begin(), deques.end(),
+                       [](const std::unique_ptr<MarkDeque>& deque) { return !deque->empty(); });
+  };
+
+  auto worker = [&](size_t self) {
+    Tracer& tracer = *tracers[self];
+    MarkDeque& deque = *deques[self];
+    while (true) {
+      while (GCObject* obj = deque.pop()) {
+        trace_gc_object(obj, tracer);
+      }
+      if (GCObject* obj = steal(self)) {
+        trace_gc_object(obj, tracer);
+        continue;
+      }
+
+      // Out of work. Only active threads can push, so once none are left marking is done.
+      active.fetch_sub(1);
+      GCObject* obj = nullptr;
+      while (!obj) {
+        if (active.load() == 0) {
+          return;
+        }
+        if (has_work()) {
+          active.fetch_add(1);
+          obj = steal(self);
+          if (!obj) {
+            active.fetch_sub(1);
+          }
+        }
+        if (!obj) {
+          std::this_thread::yield();
+        }
+      }
+      trace_gc_object(obj, tracer);
     }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (std::thread& thread : threads) {
+    thread.join();
   }
 
-  // Call all custom root tracers
-  for (auto& root_tracer : root_tracers_) {
-    root_tracer(tracer);
+  for (const auto& tracer : tracers) {
+    add_marked_counts(*tracer);
   }
 }
 
 void GCHeap::sweep() {
-  GCObject** current = &objects_;
-  size_t alive_count = 0;
+  collection_.kind = GCCollectionStats::Kind::MAJOR;
+  if (object_count_ > marked_count_) {
+    collection_.objects_freed += object_count_ - marked_count_;
+  }
+  collection_.objects_survived = marked_count_;
+  collection_.bytes_survived = marked_bytes_ + marked_large_bytes_;
+  stats_.live_objects = marked_by_tag_;
+
+  // Everything reached by the mark phase is what is live now
+  object_count_ = marked_count_;
+  bytes_allocated_ = marked_bytes_;
+  large_bytes_allocated_ = marked_large_bytes_;
 
-  // Walk through the object list, removing unmarked objects
+  // Large objects own their memory individually and are few, so they are freed right away
+  LargeObjectHeader** current = &large_objects_;
   while (*current) {
-    GCObject* obj = *current;
-    if (obj->marked) {
-      // Object is alive, reset mark flag and continue
-      obj->marked = false;
-      current = &obj->next;
-      alive_count++;
+    LargeObjectHeader* header = *current;
+    if (header->marked) {
+      header->marked = false;
+      current = &header->next;
     } else {
-      // Object is dead, remove from list and delete
-      *current = obj->next;
-      delete obj;
+      *current = header->next;
+      destroy_large(header);
+    }
+  }
+
+  // Allocation must go through allocate_cell_slow so that it never uses an unswept page
+  {
+    std::lock_guard<std::mutex> lock(sweeper_mutex_);
+    for (auto& size_class : size_classes_) {
+      for (HeapPage* page : size_class.pages) {
+        page->set_sweep_pending();
+        pending_pages_.push_back(page);
+      }
+      size_class.current = nullptr;
+      size_class.cursor = 0;
+    }
+    sweep_cursor_.store(0, std::memory_order_relaxed);
+    sweep_requested_ = true;
+  }
+
+  switch (config_.sweep_mode) {
+    case GCConfig::SweepMode::EAGER:
+      finish_sweeping();
+      break;
+    case GCConfig::SweepMode::LAZY:
+      break;
+    case GCConfig::SweepMode::BACKGROUND:
+      sweeper_wake_.notify_one();
+      break;
+  }
+
+  if (config_.compact) {
+    compact();
+  }
+}
+
+void GCHeap::compact() {
+  // Once every page is swept, each allocated cell holds a live object
+  finish_sweeping();
+
+  std::vector<HeapPage*> evacuated;
+  for (auto& size_class : size_classes_) {
+    select_pages_to_compact(size_class, evacuated);
+  }
+  if (evacuated.empty()) {
+    return;
+  }
+
+  // Move the survivors, leaving forwarding pointers behind as a minor collection does
+  for (HeapPage* page : evacuated) {
+    page->for_each_object([this](void* cell) {
+      auto* obj = static_cast<GCObject*>(cell);
+      size_t size_class = SizeClasses::class_for_size(obj->alloc_size);
+      GCObject* copy = relocate_gc_object(obj, allocate_cell(size_class));
+      copy->alloc_size = obj->alloc_size;
+      obj->forwarded = true;
+      obj->next = copy;
+    });
+  }
+
+  // Redirect the roots and every slot of every live object
+  cycle_++;
+  Tracer tracer(*this, Tracer::Mode::COMPACT);
+  trace_roots(tracer);
+  for (auto& size_class : size_classes_) {
+    for (HeapPage* page : size_class.pages) {
+      page->for_each_object(
+          [&tracer](void* cell) { trace_gc_object(static_cast<GCObject*>(cell), tracer); });
+    }
+  }
+  for (LargeObjectHeader* header = large_objects_; header; header = header->next) {
+    trace_gc_object(header->object(), tracer);
+  }
+
+  // Only the moved-from husks are left in the evacuated pages
+  for (HeapPage* page : evacuated) {
+    page->for_each_object([](void* cell) { finalize_gc_object(static_cast<GCObject*>(cell)); });
+    HeapPage::destroy(page);
+  }
+}
+
+void GCHeap::select_pages_to_compact(SizeClassPages& pages, std::vector<HeapPage*>& selected) {
+  if (pages.pages.size() < 2) {
+    return;
+  }
+
+  size_t free_cells = 0;
+  for (HeapPage* page : pages.pages) {
+    free_cells += page->capacity() - page->live_count();
+  }
+
+  std::vector<HeapPage*> by_occupancy = pages.pages;
+  std::sort(by_occupancy.begin(), by_occupancy.end(), [](HeapPage* a, HeapPage* b) {
+    return a->live_count() < b->live_count();
+  });
+
+  // Empty the sparsest pages first, as long as the pages that stay can take their objects
+  size_t moved_cells = 0;
+  size_t first_selected = selected.size();
+  for (HeapPage* page : by_occupancy) {
+    size_t live = page->live_count();
+    size_t capacity = page->capacity();
+    if (static_cast<double>(live) > static_cast<double>(capacity) * MAX_COMPACTED_OCCUPANCY) {
+      break;
+    }
+    size_t free_elsewhere = free_cells - (capacity - live);
+    if (moved_cells + live > free_elsewhere) {
+      break;
     }
+    free_cells = free_elsewhere;
+    moved_cells += live;
+    selected.push_back(page);
   }
+  if (selected.size() == first_selected) {
+    return;
+  }
+
+  // Selected pages must not receive the objects moved out of them
+  auto is_selected = [&](HeapPage* page) {
+    return std::find(selected.begin() + first_selected, selected.end(), page) != selected.end();
+  };
+  pages.pages.erase(std::remove_if(pages.pages.begin(), pages.pages.end(), is_selected),
+                    pages.pages.end());
+  pages.current = nullptr;
+  pages.cursor = 0;
+}
 
-  object_count_ = alive_count;
+void GCHeap::sweep_page(HeapPage* page) {
+  page->sweep([](void* cell) { finalize_gc_object(static_cast<GCObject*>(cell)); });
 }
 
-void Tracer::mark(GCObject* obj) {
-  if (!obj || obj->marked) {
+void GCHeap::sweep_pending_pages() {
+  size_t index;
+  while ((index = sweep_cursor_.fetch_add(1, std::memory_order_relaxed)) <
+         pending_pages_.size()) {
+    HeapPage* page = pending_pages_[index];
+    if (page->try_claim_sweep()) {
+      sweep_page(page);
+      page->finish_sweep();
+    }
+  }
+}
+
+void GCHeap::finish_sweeping() {
+  if (pending_pages_.empty()) {
     return;
   }
 
-  // Mark the object and add to worklist
-  obj->marked = true;
-  worklist_.push_back(obj);
+  // Help with whatever is left, then wait for pages the sweeper is still working on
+  sweep_pending_pages();
+  for (HeapPage* page : pending_pages_) {
+    page->wait_swept();
+  }
+
+  {
+    // Once the sweeper lets go of the lock it is done reading pending_pages_
+    std::lock_guard<std::mutex> lock(sweeper_mutex_);
+    pending_pages_.clear();
+    sweep_requested_ = false;
+  }
+  release_empty_pages();
+}
+
+void GCHeap::run_sweeper() {
+  std::unique_lock<std::mutex> lock(sweeper_mutex_);
+  while (true) {
+    sweeper_wake_.wait(lock, [this] { return sweep_requested_ || stop_sweeper_; });
+    if (stop_sweeper_) {
+      return;
+    }
+    sweep_requested_ = false;
+    sweep_pending_pages();
+  }
+}
+
+void* GCHeap::allocate_cell_slow(size_t size_class) {
+  SizeClassPages& pages = size_classes_[size_class];
+
+  // Reuse cells freed by earlier sweeps before growing the heap
+  while (pages.cursor < pages.pages.size()) {
+    HeapPage* page = pages.pages[pages.cursor++];
+    ensure_swept(page);
+    if (page->has_free_cells()) {
+      pages.current = page;
+      return page->allocate();
+    }
+  }
 
-  // Process worklist until empty
+  HeapPage* page = HeapPage::create(static_cast<uint8_t>(size_class));
+  pages.pages.push_back(page);
+  pages.cursor = pages.pages.size();
+  pages.current = page;
+  return page->allocate();
+}
+
+void GCHeap::release_empty_pages() {
+  for (auto& size_class : size_classes_) {
+    // Keep one empty page per class so a heap hovering at a page boundary doesn't thrash
+    bool kept_spare = false;
+    auto& pages = size_class.pages;
+    size_t kept = 0;
+    for (HeapPage* page : pages) {
+      if (page->is_empty() && kept_spare) {
+        HeapPage::destroy(page);
+        continue;
+      }
+      kept_spare = kept_spare || page->is_empty();
+      pages[kept++] = page;
+    }
+    pages.resize(kept);
+
+    // Start allocating from the first page again to fill the holes left by the sweep
+    size_class.current = nullptr;
+    size_class.cursor = 0;
+  }
+}
+
+GCObject* Tracer::visit_object(GCObject* obj) {
+  if (mode_ == Mode::COMPACT) {
+    return obj->forwarded ? obj->next : obj;
+  }
+
+  if (mode_ == Mode::SNAPSHOT) {
+    snapshot_->add_edge(obj);
+    return obj;
+  }
+
+  if (mode_ == Mode::MINOR) {
+    // Old objects are not traced by a minor collection; the remembered set covers their fields
+    if (!heap_.in_nursery(obj)) {
+      return obj;
+    }
+    if (obj->forwarded) {
+      return obj->next;
+    }
+    GCObject* copy = heap_.evacuate(obj);
+    // Leaf objects have nothing to trace, so they never go on the worklist
+    if (!is_leaf_tag(copy->tag)) {
+      worklist_.push_back(copy);
+    }
+    return copy;
+  }
+
+  if (deque_) {
+    // Other marking threads may reach the same object; whoever sets the mark traces it
+    if (GCHeap::set_mark_atomic(obj)) {
+      count_marked(obj);
+      if (!is_leaf_tag(obj->tag)) {
+        deque_->push(obj);
+      }
+    }
+    return obj;
+  }
+
+  if (GCHeap::set_mark(obj)) {
+    count_marked(obj);
+    if (!is_leaf_tag(obj->tag)) {
+      worklist_.push_back(obj);
+    }
+  }
+  return obj;
+}
+
+void Tracer::count_marked(const GCObject* obj) {
+  marked_count_++;
+  marked_by_tag_[static_cast<size_t>(obj->tag)]++;
+  marked_bytes_ += obj->alloc_size;
+  size_t payload = gc_object_payload_size(obj);
+  if (GCHeap::is_large_payload(payload)) {
+    marked_large_bytes_ += payload;
+  } else {
+    marked_bytes_ += payload;
+  }
+}
+
+void Tracer::drain() {
   while (!worklist_.empty()) {
     GCObject* current = worklist_.back();
     worklist_.pop_back();
     // Let the object trace its references
-    current->trace(*this);
+    trace_gc_object(current, *this);
+  }
+}
+
+bool Tracer::drain(size_t budget) {
+  for (; budget > 0 && !worklist_.empty(); --budget) {
+    GCObject* current = worklist_.back();
+    worklist_.pop_back();
+    trace_gc_object(current, *this);
   }
+  return worklist_.empty();
 }
 
-RootHandle::RootHandle(GCHeap& heap, GCObject*& ref) : heap_(heap), ref_(ref) {
-  heap_.add_root(&ref_);
+RootHandle::RootHandle(GCHeap& heap, GCObject*& ref) :
+    heap_(heap), ref_(ref), token_(heap_.add_root(&ref_)) {
 }
 
 RootHandle::~RootHandle() {
-  heap_.remove_root(&ref_);
+  heap_.remove_root(token_);
 }
\ No newline at end of file
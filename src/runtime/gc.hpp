@@ -4,15 +4,33 @@
  */
 
 #pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <iosfwd>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
 
+#include "alloc_profiler.hpp"
+#include "heap_page.hpp"
+#include "large_object_space.hpp"
+#include "mark_deque.hpp"
+#include "object.hpp"
+#include "root_registry.hpp"
+
 struct GCObject;
 class GCHeap;
+class HeapSnapshot;
 class Tracer;
 
 /**
@@ -42,17 +60,38 @@ enum class GCTag : uint8_t {
   BUILTIN_FUNCTION  ///< Native function that can't be written in pure PEBBL
 };
 
+/**
+ * @brief Number of GCTag values
+ */
+constexpr size_t GC_TAG_COUNT = static_cast<size_t>(GCTag::BUILTIN_FUNCTION) + 1;
+
+/**
+ * @brief Lower-case name of a tag, as used in GC statistics
+ */
+const char* gc_tag_name(GCTag tag);
+
 /**
  * @brief Base class for all garbage-collected objects
  *
  * All objects that need to be managed by the garbage collector must inherit
- * from this class. The GC uses a mark-and-sweep algorithm with a linked list
- * of all allocated objects.
+ * from this class. Objects start out in the nursery; survivors of a minor
+ * collection are moved into the old space, which is collected by
+ * mark-and-sweep. Mark state is kept outside the object, in the bitmaps of
+ * its HeapPage or the LargeObjectHeader in front of it.
+ *
+ * There is no vtable: the collector switches on tag to reach the concrete
+ * type (see gc_dispatch.hpp). Every subclass provides
+ * - void trace(Tracer&), visiting each slot holding a heap reference;
+ * - GCObject* relocate(void* cell), moving the object into cell (used to
+ *   promote nursery survivors; the moved-from object is destroyed later);
+ * - optionally size_t payload_size() const, hiding the default below.
  */
 struct GCObject {
-  bool marked = false;       ///< Mark flag for garbage collection
+  bool forwarded = false;    ///< Nursery object that has been evacuated to next
+  bool remembered = false;   ///< Old object recorded in the remembered set
   GCTag tag;                 ///< Type tag for this object
-  GCObject* next = nullptr;  ///< Next object in the allocation list
+  uint32_t alloc_size = 0;   ///< Heap bytes holding the object itself (its cell if small)
+  GCObject* next = nullptr;  ///< Evacuated copy of a forwarded nursery object
 
   /**
    * @brief Constructor that sets the object type tag
@@ -62,18 +101,179 @@ struct GCObject {
   }
 
   /**
-   * @brief Virtual destructor for proper cleanup
+   * @brief Out-of-line bytes owned by this object
+   * @return Size of string, vector or map storage allocated outside the object
+   *
+   * Counted towards the heap size that schedules collections, so a
+   * million-element array weighs more than an empty one.
    */
-  virtual ~GCObject() = default;
+  size_t payload_size() const {
+    return 0;
+  }
 
+protected:
   /**
-   * @brief Trace method for marking reachable objects
-   * @param tracer The tracer object to use for marking
-   *
-   * Each GCObject subclass must implement this method to mark any
-   * other GCObjects that this object references.
+   * @brief Non-virtual: objects are destroyed only by the heap, through their tag
    */
-  virtual void trace(Tracer& tracer) = 0;
+  ~GCObject() = default;
+};
+
+/**
+ * @brief Bookkeeping placed in front of an object too large for any size class
+ */
+struct LargeObjectHeader {
+  LargeObjectHeader* next;  ///< Next large object
+  bool marked;              ///< Reached by the current or last mark phase
+
+  /**
+   * @brief Bytes reserved for the header, keeping the object granule-aligned
+   */
+  static constexpr size_t SIZE = SizeClasses::GRANULE;
+
+  /**
+   * @brief Find the header of a large object
+   */
+  static LargeObjectHeader* of(const GCObject* obj) {
+    return reinterpret_cast<LargeObjectHeader*>(reinterpret_cast<uintptr_t>(obj) - SIZE);
+  }
+
+  /**
+   * @brief The object following the header
+   */
+  GCObject* object() {
+    return reinterpret_cast<GCObject*>(reinterpret_cast<char*>(this) + SIZE);
+  }
+};
+
+static_assert(sizeof(LargeObjectHeader) <= LargeObjectHeader::SIZE);
+
+/**
+ * @brief Thrown when a full collection leaves the heap above GCConfig::max_heap_bytes
+ *
+ * Raised only where the heap is consistent and no object is half-built, so
+ * the engines can report it as an ordinary runtime error and keep running.
+ */
+class OutOfMemoryError : public std::runtime_error {
+public:
+  explicit OutOfMemoryError(const std::string& message) : std::runtime_error(message) {
+  }
+};
+
+/**
+ * @brief Tunable collection policy for GCHeap
+ *
+ * A minor collection runs whenever the nursery fills up. Major collections
+ * are scheduled by old-space size in bytes (objects plus their out-of-line
+ * payloads): after each one the next is due once the old space reaches
+ * growth_factor times the surviving bytes, but never below min_heap_bytes.
+ * Large payloads (see LargeObjectSpace) are budgeted the same way but on
+ * their own, so one huge array does not postpone collecting small garbage.
+ *
+ * A max_heap_bytes limit is enforced by running a full collection whenever
+ * the heap is found above it, and failing with OutOfMemoryError if that does
+ * not bring it back under.
+ */
+struct GCConfig {
+  /**
+   * @brief When the garbage found by a major collection is freed
+   */
+  enum class SweepMode : uint8_t {
+    EAGER,      ///< Sweep every page before the collection returns
+    LAZY,       ///< Sweep each page when the allocator next needs it
+    BACKGROUND  ///< Sweep pages on a background thread, racing the allocator for them
+  };
+
+  size_t min_heap_bytes = 1024 * 1024;  ///< Old-space size below which no major collection runs
+  double growth_factor = 2.0;           ///< Old-space growth allowed relative to live bytes
+  size_t nursery_bytes = 256 * 1024;    ///< Size of the young generation
+  bool incremental = false;             ///< Mark the old space in slices between minor GCs
+  size_t mark_slice_objects = 4096;     ///< Objects traced per incremental marking slice
+
+  SweepMode sweep_mode = SweepMode::EAGER;  ///< When dead small objects are freed
+  size_t mark_threads = 1;                  ///< Threads sharing a stop-the-world mark phase
+  bool compact = false;                     ///< Evacuate sparse old pages after each major GC
+  bool trace = false;                       ///< Print one line per collection to stderr
+  size_t profile_sample_bytes = 0;          ///< Mean bytes between allocation samples, 0 for none
+  size_t max_heap_bytes = 0;                ///< Limit on heap_bytes() after a collection, 0 for none
+};
+
+/**
+ * @brief What a single collection did
+ *
+ * Heap sizes cover both generations, payloads included.
+ */
+struct GCCollectionStats {
+  /**
+   * @brief How far a collection went
+   */
+  enum class Kind : uint8_t {
+    MINOR,        ///< Emptied the nursery
+    INCREMENTAL,  ///< Emptied the nursery and advanced incremental marking
+    MAJOR         ///< Collected the whole heap
+  };
+
+  Kind kind = Kind::MINOR;       ///< How far the collection went
+  double pause_ms = 0.0;         ///< Time the mutator was stopped
+  size_t heap_bytes_before = 0;  ///< Heap size on entry
+  size_t heap_bytes_after = 0;   ///< Heap size on exit
+  size_t objects_survived = 0;   ///< Objects promoted, or marked by a major collection
+  size_t bytes_survived = 0;     ///< Bytes (objects plus payloads) of the surviving objects
+  size_t objects_freed = 0;      ///< Objects found dead
+  size_t bytes_freed = 0;        ///< Drop in heap size
+
+  /**
+   * @brief Lower-case name of the kind, as used in GC statistics
+   */
+  const char* kind_name() const;
+};
+
+/**
+ * @brief Collection totals over the lifetime of a heap
+ *
+ * Pauses are binned by duration: bucket i holds pauses shorter than
+ * FIRST_PAUSE_BUCKET_MS * 2^i, and the last bucket holds everything longer.
+ */
+struct GCStats {
+  static constexpr size_t PAUSE_BUCKETS = 12;             ///< Number of pause histogram buckets
+  static constexpr double FIRST_PAUSE_BUCKET_MS = 0.125;  ///< Upper bound of the first bucket
+
+  size_t minor_collections = 0;  ///< Minor and incremental collections
+  size_t major_collections = 0;  ///< Full collections
+  double total_pause_ms = 0.0;   ///< Sum of all pauses
+  double max_pause_ms = 0.0;     ///< Longest pause
+  size_t objects_freed = 0;      ///< Objects reclaimed by all collections
+  size_t bytes_freed = 0;        ///< Bytes reclaimed by all collections
+
+  std::array<size_t, PAUSE_BUCKETS> pause_histogram{};  ///< Number of pauses per bucket
+  std::array<size_t, GC_TAG_COUNT> live_objects{};  ///< Objects per tag marked by the last major GC
+  GCCollectionStats last;                           ///< The most recent collection
+};
+
+/**
+ * @brief Storage outside the heap that holds references into it
+ *
+ * The tree-walker's environments are reference counted rather than
+ * collected, so an environment given a young object cannot be remembered
+ * like an old object. It derives from this class instead and reports such
+ * stores through GCHeap::write_barrier; the next minor collection visits
+ * its slots as roots.
+ */
+class RememberedSlots {
+public:
+  /**
+   * @brief Visit every heap reference held by this container
+   */
+  virtual void trace_slots(Tracer& tracer) = 0;
+
+protected:
+  ~RememberedSlots() = default;
+
+private:
+  static constexpr size_t NOT_REMEMBERED = SIZE_MAX;
+
+  size_t remembered_index_ = NOT_REMEMBERED;  ///< Position in the heap's remembered list
+
+  friend class GCHeap;
 };
 
 /**
@@ -108,23 +308,55 @@ public:
   RootHandle& operator=(const RootHandle&) = delete;
 
 private:
-  GCHeap& heap_;    ///< Reference to the GC heap
-  GCObject*& ref_;  ///< Reference to the managed pointer
+  GCHeap& heap_;     ///< Reference to the GC heap
+  GCObject*& ref_;   ///< Reference to the managed pointer
+  RootToken token_;  ///< Registration to remove on destruction
 };
 
 /**
  * @brief Garbage collection heap manager
  *
- * GCHeap manages allocation and collection of garbage-collected objects.
- * It uses a mark-and-sweep algorithm triggered when allocation thresholds
- * are reached. Objects are tracked in a linked list for efficient traversal.
+ * GCHeap is generational. Small objects are bump-allocated in a nursery;
+ * when it fills, a minor collection copies the survivors reachable from the
+ * roots and the remembered set into the old space and resets the nursery.
+ * Old objects that are given a reference to a young object are recorded in
+ * the remembered set by the write barrier, which every store into an
+ * existing object must go through.
+ *
+ * The old space is collected by mark-and-sweep once it grows past its
+ * threshold. In incremental mode the marking is spread over slices run
+ * after each minor collection, bounded by a work budget; while marking is
+ * in progress the write barrier also shades every stored object, so the
+ * mutator cannot hide a reachable object behind one already traced. A
+ * short final pause rescans the roots before the sweep.
+ *
+ * Small old objects are carved out of size-segregated HeapPages. Depending
+ * on the sweep mode, pages are swept right after marking, on demand by the
+ * allocator, or by a background thread; every page is swept before the next
+ * mark phase begins, and pages left empty are released then. Objects larger
+ * than the biggest size class are allocated individually, directly in the
+ * old space, and swept right after marking.
+ *
+ * With compaction enabled, each major collection finishes by moving the
+ * objects out of the sparsest pages of every size class into free cells of
+ * the others and releasing the emptied pages, so a long-running heap does
+ * not stay fragmented. Like minor collections, this relies on every
+ * reference being reachable through traced slots.
+ *
+ * When GCConfig::profile_sample_bytes is set, allocate() samples the
+ * allocations for an AllocationProfiler, whose report is printed to stderr
+ * when the heap is destroyed.
+ *
+ * Because collections move young objects, a raw object pointer must not be
+ * held across an allocation unless it is re-read from a traced slot.
  */
 class GCHeap {
 public:
   /**
    * @brief Constructor initializes empty heap
+   * @param config Collection scheduling policy
    */
-  GCHeap();
+  explicit GCHeap(GCConfig config = GCConfig());
 
   /**
    * @brief Destructor cleans up all remaining objects
@@ -138,111 +370,769 @@ public:
    * @param args Arguments to forward to the constructor
    * @return A pointer to the newly allocated object
    *
-   * This method allocates a new object of type T and adds it to the
-   * GC-managed object list. If the allocation threshold is reached,
-   * a garbage collection cycle is triggered.
+   * If the nursery is full, a collection runs before the object is
+   * constructed, so the new object is never collected before the caller
+   * has a chance to root it. Any object pointers among the arguments may be
+   * stale by the time the constructor runs; pass them in through a traced
+   * slot or store them after allocation instead.
    */
   template <typename T, typename... Args>
   GCRef<T> allocate(Args&&... args) {
     static_assert(
         std::is_base_of_v<GCObject, T>,
         "pebbli: Fatal: T in GCHeap::allocate must be a GCObject or derived from a GCObject");
+    static_assert(alignof(T) <= SizeClasses::GRANULE, "GC objects must fit cell alignment");
+
+    constexpr size_t size = (sizeof(T) + SizeClasses::GRANULE - 1) & ~(SizeClasses::GRANULE - 1);
 
-    T* obj = new T(std::forward<Args>(args)...);
-    obj->next = objects_;
-    objects_ = obj;
-    object_count_++;
+    T* obj;
+    size_t payload_size;
+    if constexpr (size <= SizeClasses::MAX_SMALL_SIZE) {
+      if (nursery_end_ - nursery_top_ < static_cast<ptrdiff_t>(size) ||
+          nursery_payload_bytes_ >= config_.nursery_bytes) {
+        collect_young();
+      }
+      obj = new (nursery_top_) T(std::forward<Args>(args)...);
+      nursery_top_ += size;
+      obj->alloc_size = size;
+      payload_size = obj->payload_size();
+      nursery_payload_bytes_ += payload_size;
+    } else {
+      if (major_gc_due()) {
+        collect();
+      }
+      void* memory = ::operator new(LargeObjectHeader::SIZE + sizeof(T),
+                                    std::align_val_t{SizeClasses::GRANULE});
+      try {
+        obj = new (static_cast<char*>(memory) + LargeObjectHeader::SIZE)
+            T(std::forward<Args>(args)...);
+      } catch (...) {
+        ::operator delete(memory, std::align_val_t{SizeClasses::GRANULE});
+        throw;
+      }
+      large_objects_ = new (memory) LargeObjectHeader{large_objects_, false};
+      obj->alloc_size = sizeof(T);
+      object_count_++;
+      payload_size = obj->payload_size();
+      account_old_object(obj->alloc_size, payload_size);
+      // Born old, so whatever young objects the constructor stored must be found by minor GCs
+      remember(obj);
+      if (marking_) {
+        shade(obj);
+      }
+    }
 
-    if (object_count_ >= next_gc_) {
-      collect();
+    // The sample countdown never runs out unless allocations are being profiled
+    if (size_t bytes = obj->alloc_size + payload_size; bytes >= sample_countdown_) [[unlikely]] {
+      sample_allocation(obj, bytes);
+    } else {
+      sample_countdown_ -= bytes;
     }
 
     return obj;
   }
 
+  /**
+   * @brief Record out-of-line memory an object acquired after allocation
+   * @param owner Object whose payload grew
+   * @param bytes Number of bytes the payload grew by
+   * @param large_payload Whether the payload is now large (see is_large_payload)
+   *
+   * Used by mutators that grow a payload in place (such as pushing onto an
+   * array) so the growth counts towards the next collection. The caller is
+   * still using the object, so growth past the heap limit is not acted upon
+   * here but at the next check_heap_limit().
+   */
+  void account_payload_growth(const GCObject* owner, size_t bytes, bool large_payload = false) {
+    if (in_nursery(owner)) {
+      nursery_payload_bytes_ += bytes;
+    } else if (large_payload) {
+      large_bytes_allocated_ += bytes;
+    } else {
+      bytes_allocated_ += bytes;
+    }
+    if (over_heap_limit()) {
+      heap_limit_reached_ = true;
+    }
+  }
+
+  /**
+   * @brief Enforce the heap limit after payload growth crossed it
+   * @throws OutOfMemoryError if a full collection cannot bring the heap under the limit
+   *
+   * Payloads can grow without any allocation going through the heap, so the
+   * engines call this where every object pointer they hold is rooted (before
+   * each call), like an allocation would. Costs a flag test otherwise.
+   */
+  void check_heap_limit() {
+    if (heap_limit_reached_) [[unlikely]] {
+      heap_limit_reached_ = false;
+      if (over_heap_limit()) {
+        collect();
+      }
+    }
+  }
+
+  /**
+   * @brief Check whether an object lives in the nursery
+   */
+  bool in_nursery(const void* ptr) const {
+    auto address = reinterpret_cast<uintptr_t>(ptr);
+    return address >= reinterpret_cast<uintptr_t>(nursery_begin_) &&
+           address < reinterpret_cast<uintptr_t>(nursery_end_);
+  }
+
+  /**
+   * @brief Write barrier for storing a value into an existing object
+   * @param owner Object the value was stored into
+   * @param value The stored value
+   *
+   * Must follow every store of a heap reference into an object after its
+   * construction, so old-to-young references are found by minor collections.
+   */
+  void write_barrier(GCObject* owner, PEBBLObject value) {
+    if (value.is_gc_ptr()) {
+      write_barrier(owner, value.as_gc_ptr());
+    }
+  }
+
+  /**
+   * @brief Write barrier for storing an object pointer into an existing object
+   */
+  void write_barrier(GCObject* owner, GCObject* target) {
+    if (!owner->remembered && in_nursery(target) && !in_nursery(owner)) {
+      remember(owner);
+    }
+    if (marking_) {
+      shade(target);
+    }
+  }
+
+  /**
+   * @brief Write barrier for storing a value into storage outside the heap
+   */
+  void write_barrier(RememberedSlots* holder, PEBBLObject value) {
+    if (!value.is_gc_ptr()) {
+      return;
+    }
+    if (holder->remembered_index_ == RememberedSlots::NOT_REMEMBERED &&
+        in_nursery(value.as_gc_ptr())) {
+      holder->remembered_index_ = remembered_slots_.size();
+      remembered_slots_.push_back(holder);
+    }
+    if (marking_) {
+      shade(value.as_gc_ptr());
+    }
+  }
+
+  /**
+   * @brief Add an old object to the remembered set unconditionally
+   *
+   * For bulk updates where checking every stored reference is pointless,
+   * such as moving a freshly compiled chunk into its function.
+   */
+  void remember(GCObject* owner) {
+    if (!owner->remembered && !in_nursery(owner)) {
+      owner->remembered = true;
+      remembered_objects_.push_back(owner);
+    }
+    if (marking_ && !in_nursery(owner) && is_marked(owner)) {
+      // The owner may already have been traced, so trace it again
+      rescan(owner);
+    }
+  }
+
+  /**
+   * @brief Check whether incremental marking of the old space is in progress
+   */
+  bool is_marking() const {
+    return marking_;
+  }
+
+  /**
+   * @brief Drop a container being destroyed from the remembered set
+   */
+  void forget(RememberedSlots* holder);
+
+  /**
+   * @brief Get the collection scheduling policy
+   */
+  const GCConfig& config() const {
+    return config_;
+  }
+
+  /**
+   * @brief Get the old-space size in bytes (live after the last collection plus promoted)
+   *
+   * Large payloads are not included; see large_bytes_allocated().
+   */
+  size_t bytes_allocated() const {
+    return bytes_allocated_;
+  }
+
+  /**
+   * @brief Get the bytes of large payloads owned by old objects
+   */
+  size_t large_bytes_allocated() const {
+    return large_bytes_allocated_;
+  }
+
+  /**
+   * @brief Get the size of both generations, payloads included
+   */
+  size_t heap_bytes() const {
+    return bytes_allocated_ + large_bytes_allocated_ +
+           static_cast<size_t>(nursery_top_ - nursery_begin_) + nursery_payload_bytes_;
+  }
+
+  /**
+   * @brief Get the statistics gathered over every collection so far
+   */
+  const GCStats& stats() const {
+    return stats_;
+  }
+
+  /**
+   * @brief Check whether allocations are being profiled (see GCConfig::profile_sample_bytes)
+   */
+  bool profiling_allocations() const {
+    return profiler_ != nullptr;
+  }
+
+  /**
+   * @brief Attribute the following allocations to a source line
+   *
+   * Called by the engines before they allocate, only while profiling_allocations() is true.
+   */
+  void set_allocation_site(uint32_t line) {
+    profiler_->set_site(line);
+  }
+
+  /**
+   * @brief Write the graph of objects reachable from the roots as JSON (see HeapSnapshot)
+   * @return Number of nodes written, the roots included
+   *
+   * Nothing is collected or moved, so this can run whenever an allocation could.
+   */
+  size_t write_snapshot(std::ostream& out);
+
+  /**
+   * @brief Check whether a payload is budgeted with the large-object space
+   */
+  static constexpr bool is_large_payload(size_t bytes) {
+    return bytes >= LargeObjectSpace::MIN_PAYLOAD_BYTES;
+  }
+
   /**
    * @brief Add a root reference to the GC system
    * @param ref Pointer to a GCObject pointer to register as a root
+   * @return Token to pass to remove_root
    */
-  void add_root(GCObject** ref);
+  RootToken add_root(GCObject** ref);
 
   /**
-   * @brief Remove a root reference from the GC system
-   * @param ref Pointer to a GCObject pointer to unregister as a root
+   * @brief Remove a root reference from the GC system in constant time
+   * @param token Token returned when the root was added
    */
-  void remove_root(GCObject** ref);
+  void remove_root(RootToken token);
 
   /**
    * @brief Add a custom root tracer callback
    * @param tracer Function that traces additional roots during GC
+   * @return Token to pass to remove_root_tracer
    */
-  void add_root_tracer(std::function<void(class Tracer&)> tracer);
+  RootToken add_root_tracer(std::function<void(class Tracer&)> tracer);
 
   /**
-   * @brief Remove a custom root tracer callback
-   * @param tracer Function to remove from root tracing
+   * @brief Remove a custom root tracer callback in constant time
+   *
+   * Owners of a root tracer must remove it before they are destroyed.
+   *
+   * @param token Token returned when the tracer was added
    */
-  void remove_root_tracer(std::function<void(class Tracer&)> tracer);
+  void remove_root_tracer(RootToken token);
 
   /**
-   * @brief Trigger a garbage collection cycle
+   * @brief Trigger a full garbage collection cycle
    *
-   * Performs a full mark-and-sweep garbage collection, freeing all
-   * unreachable objects and updating collection thresholds.
+   * Empties the nursery, then performs a mark-and-sweep collection of the
+   * old space, freeing all unreachable objects and updating collection
+   * thresholds.
+   *
+   * @throws OutOfMemoryError if the heap is still above GCConfig::max_heap_bytes
    */
   void collect();
 
+  /**
+   * @brief Trigger a minor collection, then advance or start old-space collection as due
+   */
+  void collect_young();
+
 private:
-  GCObject* objects_;    ///< Linked list of all allocated objects
-  size_t object_count_;  ///< Current number of allocated objects
-  size_t next_gc_;       ///< Threshold for triggering next collection
+  /**
+   * @brief Pages of one size class
+   */
+  struct SizeClassPages {
+    std::vector<HeapPage*> pages;  ///< Every page of this class
+    HeapPage* current = nullptr;   ///< Page allocations are served from
+    size_t cursor = 0;             ///< Next page to try once current is full
+  };
+
+  GCConfig config_;                   ///< Collection scheduling policy
+  LargeObjectHeader* large_objects_;  ///< List of objects too large for any size class
+  size_t object_count_;               ///< Current number of old objects
+  size_t bytes_allocated_;            ///< Old objects and small payloads, live or not yet collected
+  size_t next_gc_bytes_;              ///< Old-space size that triggers the next major collection
+  size_t large_bytes_allocated_;      ///< Large payloads of old objects, live or not yet collected
+  size_t next_large_gc_bytes_;        ///< Large-payload size that starts the next major collection
+  uint64_t cycle_;                    ///< Number of collections (minor or major) started so far
+  size_t marked_count_;               ///< Objects reached by the current mark phase
+  size_t marked_bytes_;               ///< Bytes of the objects reached by the current mark phase
+  size_t marked_large_bytes_;         ///< Large-payload bytes reached by the current mark phase
+
+  std::array<size_t, GC_TAG_COUNT> marked_by_tag_;     ///< Objects per tag reached by marking
+  GCStats stats_;                                      ///< Totals over all collections
+  GCCollectionStats collection_;                       ///< Collection in progress
+  std::chrono::steady_clock::time_point pause_start_;  ///< When the collection in progress began
+
+  std::unique_ptr<AllocationProfiler> profiler_;  ///< Allocation sampler, if profiling
+  size_t sample_countdown_;                       ///< Bytes left to allocate before the next sample
+  bool heap_limit_reached_;                       ///< Payload growth crossed max_heap_bytes
+
+  bool marking_;                    ///< Incremental marking of the old space is in progress
+  std::unique_ptr<Tracer> marker_;  ///< Tracer holding the grey objects between slices
+
+  std::vector<HeapPage*> pending_pages_;  ///< Pages queued by the last mark phase
+  std::atomic<size_t> sweep_cursor_;      ///< Next entry of pending_pages_ to claim
+  std::thread sweeper_;                   ///< Background sweeper thread, if enabled
+  std::mutex sweeper_mutex_;              ///< Guards pending_pages_ against the sweeper
+  std::condition_variable sweeper_wake_;  ///< Signals the sweeper that pages are pending
+  bool sweep_requested_;                  ///< A batch of pages waits for the sweeper
+  bool stop_sweeper_;                     ///< The sweeper thread must exit
+
+  char* nursery_begin_;           ///< Start of the young generation
+  char* nursery_top_;             ///< Next free byte in the nursery
+  char* nursery_end_;             ///< End of the young generation
+  size_t nursery_payload_bytes_;  ///< Out-of-line bytes owned by young objects
+
+  std::vector<GCObject*> remembered_objects_;       ///< Old objects that may reference young ones
+  std::vector<RememberedSlots*> remembered_slots_;  ///< Off-heap containers holding young refs
+
+  std::array<SizeClassPages, SizeClasses::COUNT> size_classes_;  ///< Small-object pages
 
-  std::vector<GCObject**> roots_;                           ///< List of registered root references
-  std::vector<std::function<void(Tracer&)>> root_tracers_;  ///< List of custom root tracers
+  RootRegistry<GCObject**> roots_;                          ///< Registered root references
+  RootRegistry<std::function<void(Tracer&)>> root_tracers_;  ///< Custom root tracers
+
+  /**
+   * @brief Start recording a collection
+   */
+  void begin_collection();
+
+  /**
+   * @brief Finish recording a collection and add it to the totals
+   */
+  void end_collection();
+
+  /**
+   * @brief Print a collection to stderr, as requested by GCConfig::trace
+   */
+  static void print_collection(const GCCollectionStats& collection, size_t number);
+
+  /**
+   * @brief Record an allocation that used up the sample countdown and restart the countdown
+   * @param bytes Size of the object including its payload
+   */
+  void sample_allocation(const GCObject* obj, size_t bytes);
+
+  /**
+   * @brief Add a finished marking tracer's counts to those of the mark phase
+   */
+  void add_marked_counts(const Tracer& tracer);
+
+  /**
+   * @brief Check whether the heap is above GCConfig::max_heap_bytes
+   */
+  bool over_heap_limit() const {
+    return config_.max_heap_bytes != 0 && heap_bytes() > config_.max_heap_bytes;
+  }
+
+  /**
+   * @brief Check whether either old-space budget is used up
+   */
+  bool major_gc_due() const {
+    return bytes_allocated_ >= next_gc_bytes_ || large_bytes_allocated_ >= next_large_gc_bytes_;
+  }
+
+  /**
+   * @brief Count an object that entered the old space towards the budget its payload belongs to
+   */
+  void account_old_object(size_t alloc_size, size_t payload_size) {
+    bytes_allocated_ += alloc_size;
+    if (is_large_payload(payload_size)) {
+      large_bytes_allocated_ += payload_size;
+    } else {
+      bytes_allocated_ += payload_size;
+    }
+  }
+
+  /**
+   * @brief Visit every registered root with the given tracer
+   */
+  void trace_roots(Tracer& tracer);
+
+  /**
+   * @brief Minor collection: promote live nursery objects and reset the nursery
+   */
+  void evacuate_nursery();
+
+  /**
+   * @brief Move a nursery object that has not been moved yet into the old space
+   */
+  GCObject* evacuate(GCObject* obj);
+
+  /**
+   * @brief Major collection of the old space (the nursery must be empty)
+   */
+  void collect_old();
+
+  /**
+   * @brief Begin incremental marking by shading the roots
+   */
+  void start_marking();
+
+  /**
+   * @brief Trace up to the slice budget, finishing the collection once nothing is left
+   */
+  void mark_slice();
+
+  /**
+   * @brief Final pause: rescan the roots, finish marking and sweep (the nursery must be empty)
+   */
+  void finish_marking();
+
+  /**
+   * @brief Grey an old object for the incremental marker
+   */
+  void shade(GCObject* obj);
+
+  /**
+   * @brief Have the incremental marker trace an already marked object again
+   */
+  void rescan(GCObject* obj);
+
+  /**
+   * @brief Finish the last sweep, which leaves every mark cleared, and start a mark phase
+   */
+  void begin_mark();
+
+  /**
+   * @brief Check whether an old object has been marked
+   */
+  static bool is_marked(const GCObject* obj) {
+    if (obj->alloc_size <= SizeClasses::MAX_SMALL_SIZE) {
+      return HeapPage::from_cell(obj)->is_marked(obj);
+    }
+    return LargeObjectHeader::of(obj)->marked;
+  }
+
+  /**
+   * @brief Mark an old object
+   * @return true if it was not marked before
+   */
+  static bool set_mark(GCObject* obj) {
+    if (obj->alloc_size <= SizeClasses::MAX_SMALL_SIZE) {
+      return HeapPage::from_cell(obj)->mark(obj);
+    }
+    LargeObjectHeader* header = LargeObjectHeader::of(obj);
+    bool was_marked = header->marked;
+    header->marked = true;
+    return !was_marked;
+  }
+
+  /**
+   * @brief Mark an old object, racing other marking threads
+   * @return true if this call set the mark
+   */
+  static bool set_mark_atomic(GCObject* obj) {
+    if (obj->alloc_size <= SizeClasses::MAX_SMALL_SIZE) {
+      return HeapPage::from_cell(obj)->mark_atomic(obj);
+    }
+    return !std::atomic_ref<bool>(LargeObjectHeader::of(obj)->marked)
+                .exchange(true, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Destroy a large object and free its memory
+   */
+  static void destroy_large(LargeObjectHeader* header);
+
+  /**
+   * @brief Compute the next major collection threshold from the surviving bytes
+   */
+  void update_threshold();
 
   /**
    * @brief Mark phase of garbage collection
    *
-   * Marks all reachable objects starting from registered roots.
+   * Marks all reachable objects starting from registered roots, on
+   * config_.mark_threads threads.
    */
   void mark();
 
+  /**
+   * @brief Mark phase shared by several threads that steal grey objects from each other
+   */
+  void mark_parallel();
+
   /**
    * @brief Sweep phase of garbage collection
    *
-   * Deallocates all unmarked objects and resets mark flags.
+   * Frees unmarked large objects and queues every page for sweeping in the
+   * configured mode.
    */
   void sweep();
 
+  /**
+   * @brief Move the objects out of sparse pages and redirect every reference to them
+   */
+  void compact();
+
+  /**
+   * @brief Pick the pages of a size class worth emptying and take them out of allocation
+   */
+  void select_pages_to_compact(SizeClassPages& pages, std::vector<HeapPage*>& selected);
+
+  /**
+   * @brief Free the unmarked objects of one claimed page
+   */
+  void sweep_page(HeapPage* page);
+
+  /**
+   * @brief Claim and sweep queued pages until none are left unclaimed
+   */
+  void sweep_pending_pages();
+
+  /**
+   * @brief Make sure a page holds no garbage, sweeping it now if nobody has claimed it
+   */
+  void ensure_swept(HeapPage* page) {
+    if (page->try_claim_sweep()) {
+      sweep_page(page);
+      page->finish_sweep();
+    } else {
+      page->wait_swept();
+    }
+  }
+
+  /**
+   * @brief Complete the last sweep and release the pages it emptied
+   */
+  void finish_sweeping();
+
+  /**
+   * @brief Body of the background sweeper thread
+   */
+  void run_sweeper();
+
+  /**
+   * @brief Get an uninitialized cell of the given size class
+   */
+  void* allocate_cell(size_t size_class) {
+    HeapPage* page = size_classes_[size_class].current;
+    if (page) {
+      if (void* cell = page->allocate()) {
+        return cell;
+      }
+    }
+    return allocate_cell_slow(size_class);
+  }
+
+  /**
+   * @brief Find a page with free cells, or add a new one, once the current page is full
+   */
+  void* allocate_cell_slow(size_t size_class);
+
+  /**
+   * @brief Return pages emptied by the last sweep to the system (all pages must be swept)
+   */
+  void release_empty_pages();
+
   friend class RootHandle;
+  friend class Tracer;
 };
 
 /**
- * @brief Tracer for marking reachable objects during garbage collection
+ * @brief Tracer for visiting reachable objects during garbage collection
  *
- * The Tracer class manages the marking phase of garbage collection,
- * using a worklist algorithm to traverse the object graph and mark
- * all reachable objects.
+ * Roots and objects hand the tracer each slot holding a heap reference.
+ * In a minor collection, young objects are evacuated to the old space and
+ * the slot is updated to the new address; old objects are left alone. In a
+ * major collection, objects are marked. Either way newly reached objects go
+ * on a worklist that the heap drains once all roots have been visited. After
+ * compaction, the heap hands every root and live object to a COMPACT tracer,
+ * which only rewrites slots pointing at moved objects.
+ *
+ * A parallel major collection gives each marking thread its own tracer
+ * feeding a MarkDeque instead of the worklist; mark bits are then set
+ * atomically so each object is traced by exactly one thread.
  */
 class Tracer {
 public:
+  /**
+   * @brief Kind of collection being traced
+   */
+  enum class Mode : uint8_t {
+    MINOR,   ///< Evacuate young objects only
+    MAJOR,    ///< Mark the whole (old) heap
+    COMPACT,  ///< Redirect slots to old objects moved by compaction
+    SNAPSHOT  ///< Report references to a HeapSnapshot, changing nothing
+  };
+
   /**
    * @brief Constructor
    * @param heap The GC heap this tracer belongs to
+   * @param mode Kind of collection being traced
    */
-  explicit Tracer(GCHeap& heap) : heap_(heap) {
+  Tracer(GCHeap& heap, Mode mode) :
+      heap_(heap), mode_(mode), cycle_(heap.cycle_), deque_(nullptr), marked_count_(0),
+      marked_bytes_(0), marked_large_bytes_(0), marked_by_tag_{}, snapshot_(nullptr) {
   }
 
   /**
-   * @brief Mark an object as reachable
-   * @param obj The object to mark (can be nullptr)
-   *
-   * If the object is not null and not already marked, it will be
-   * marked and added to the worklist for further tracing.
+   * @brief Constructor for one thread of a parallel major collection
+   * @param heap The GC heap this tracer belongs to
+   * @param deque The thread's own deque of grey objects
+   */
+  Tracer(GCHeap& heap, MarkDeque& deque) :
+      heap_(heap), mode_(Mode::MAJOR), cycle_(heap.cycle_), deque_(&deque), marked_count_(0),
+      marked_bytes_(0), marked_large_bytes_(0), marked_by_tag_{}, snapshot_(nullptr) {
+  }
+
+  /**
+   * @brief Constructor for recording the object graph in a snapshot
+   * @param heap The GC heap this tracer belongs to
+   * @param snapshot Snapshot every visited reference is reported to
+   */
+  Tracer(GCHeap& heap, HeapSnapshot& snapshot) :
+      heap_(heap), mode_(Mode::SNAPSHOT), cycle_(heap.cycle_), deque_(nullptr), marked_count_(0),
+      marked_bytes_(0), marked_large_bytes_(0), marked_by_tag_{}, snapshot_(&snapshot) {
+  }
+
+  /**
+   * @brief Visit a slot holding a value, updating it if its object moved
+   */
+  void visit(PEBBLObject& value) {
+    if (value.is_gc_ptr()) {
+      GCObject* obj = value.as_gc_ptr();
+      GCObject* current = visit_object(obj);
+      if (current != obj) {
+        value = PEBBLObject::make_gc_ptr(current);
+      }
+    }
+  }
+
+  /**
+   * @brief Visit a slot holding an object pointer (can be nullptr), updating it if it moved
+   */
+  template <GCManaged T>
+  void visit(T*& ref) {
+    if (ref) {
+      ref = static_cast<T*>(visit_object(ref));
+    }
+  }
+
+  /**
+   * @brief Trace objects reached so far until the worklist is empty
+   */
+  void drain();
+
+  /**
+   * @brief Trace at most budget objects from the worklist
+   * @return true if the worklist is now empty
+   */
+  bool drain(size_t budget);
+
+  /**
+   * @brief Mark or evacuate an object reached outside a traced slot
+   */
+  void shade(GCObject* obj) {
+    visit_object(obj);
+  }
+
+  /**
+   * @brief Queue an already marked object to be traced again
+   */
+  void rescan(GCObject* obj) {
+    worklist_.push_back(obj);
+  }
+
+  Mode mode() const {
+    return mode_;
+  }
+
+  /**
+   * @brief Snapshot being recorded, or nullptr unless in SNAPSHOT mode
+   */
+  HeapSnapshot* snapshot() const {
+    return snapshot_;
+  }
+
+  /**
+   * @brief Identifier of the current collection, for containers that trace themselves once
+   */
+  uint64_t cycle() const {
+    return cycle_;
+  }
+
+  /**
+   * @brief Number of objects this tracer has marked
+   */
+  size_t marked_count() const {
+    return marked_count_;
+  }
+
+  /**
+   * @brief Bytes (objects plus small payloads) of the objects this tracer has marked
+   */
+  size_t marked_bytes() const {
+    return marked_bytes_;
+  }
+
+  /**
+   * @brief Large-payload bytes of the objects this tracer has marked
    */
-  void mark(GCObject* obj);
+  size_t marked_large_bytes() const {
+    return marked_large_bytes_;
+  }
+
+  /**
+   * @brief Number of objects of each tag this tracer has marked
+   */
+  const std::array<size_t, GC_TAG_COUNT>& marked_by_tag() const {
+    return marked_by_tag_;
+  }
 
 private:
   GCHeap& heap_;                     ///< Reference to the owning heap
+  Mode mode_;                        ///< Kind of collection being traced
+  uint64_t cycle_;                   ///< Collection this tracer belongs to
   std::vector<GCObject*> worklist_;  ///< Worklist of objects to trace
+  MarkDeque* deque_;                 ///< Replaces the worklist in a parallel mark phase
+  size_t marked_count_;              ///< Objects marked by this tracer
+  size_t marked_bytes_;              ///< Bytes of the objects marked by this tracer
+  size_t marked_large_bytes_;        ///< Large-payload bytes of the objects marked by this tracer
+
+  std::array<size_t, GC_TAG_COUNT> marked_by_tag_;  ///< Objects marked by this tracer, per tag
+  HeapSnapshot* snapshot_;                          ///< Destination of SNAPSHOT-mode references
+
+  /**
+   * @brief Add a newly marked object to the counts
+   */
+  void count_marked(const GCObject* obj);
+
+  /**
+   * @brief Mark or evacuate an object
+   * @return The object's current address
+   */
+  GCObject* visit_object(GCObject* obj);
 };
\ No newline at end of file
@@ -0,0 +1,42 @@
+/**
+ * @file heap_page.cpp
+ * @brief Implementation of size-class heap pages
+ */
+
+#include "heap_page.hpp"
+
+#include <cstdlib>
+#include <new>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+HeapPage::HeapPage(uint8_t size_class) :
+    allocated_bits_{}, mark_bits_{}, free_list_(nullptr), sweep_state_(SweepState::SWEPT),
+    cell_size_(SizeClasses::CELL_SIZES[size_class]), live_count_(0), size_class_(size_class) {
+  bump_ = cells_begin();
+  size_t cell_count = (reinterpret_cast<char*>(this) + PAGE_SIZE - bump_) / cell_size_;
+  end_ = bump_ + cell_count * cell_size_;
+}
+
+HeapPage* HeapPage::create(uint8_t size_class) {
+#ifdef _MSC_VER
+  void* memory = _aligned_malloc(PAGE_SIZE, PAGE_SIZE);
+#else
+  void* memory = std::aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+#endif
+  if (!memory) {
+    throw std::bad_alloc();
+  }
+  return new (memory) HeapPage(size_class);
+}
+
+void HeapPage::destroy(HeapPage* page) {
+  page->~HeapPage();
+#ifdef _MSC_VER
+  _aligned_free(page);
+#else
+  std::free(page);
+#endif
+}
@@ -0,0 +1,289 @@
+/**
+ * @file heap_page.hpp
+ * @brief Size-class pages backing small object allocation in the GC heap
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+/**
+ * @brief Size classes for small GC objects
+ *
+ * Requests are rounded up to the next class; anything larger than the biggest class is
+ * allocated individually by GCHeap.
+ */
+namespace SizeClasses {
+
+constexpr size_t GRANULE = 16;  ///< Cell alignment and size-class granularity
+constexpr std::array<uint32_t, 12> CELL_SIZES = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256};
+constexpr size_t COUNT = CELL_SIZES.size();
+constexpr size_t MAX_SMALL_SIZE = CELL_SIZES[COUNT - 1];
+
+/**
+ * @brief Map an allocation size to its size class
+ * @param size Requested size in bytes (must not exceed MAX_SMALL_SIZE)
+ * @return Index into CELL_SIZES
+ */
+constexpr size_t class_for_size(size_t size) {
+  size_t index = 0;
+  while (CELL_SIZES[index] < size) {
+    ++index;
+  }
+  return index;
+}
+
+}  // namespace SizeClasses
+
+/**
+ * @brief A page of equally sized cells for one size class
+ *
+ * Pages are PAGE_SIZE bytes and aligned to PAGE_SIZE, so the page owning any cell is found by
+ * masking the cell's address. The header lives at the start of the page and cells follow it.
+ * Fresh cells are handed out by bumping a pointer; cells freed by the sweeper go on a per-page
+ * free list, so a page whose cells are all free can be returned to the system as a whole.
+ *
+ * Object state lives in side bitmaps with one bit per granule, indexed by the cell's offset in
+ * the page: the allocation bitmap records which cells hold objects and the mark bitmap which of
+ * them the last mark phase reached. Marking touches only the dense mark bitmap, and sweeping finds
+ * dead objects a word at a time. Pages are swept independently: after a major collection every
+ * page is left pending, and whoever claims it first (the allocator or the background sweeper)
+ * sweeps it.
+ */
+class HeapPage {
+public:
+  static constexpr size_t PAGE_SIZE = 64 * 1024;
+
+  /**
+   * @brief Allocate and initialize an empty page
+   * @param size_class Size class index of the page's cells
+   * @return The new page
+   */
+  static HeapPage* create(uint8_t size_class);
+
+  /**
+   * @brief Return a page's memory to the system (cells must already be destroyed)
+   */
+  static void destroy(HeapPage* page);
+
+  /**
+   * @brief Find the page containing a small-object cell
+   */
+  static HeapPage* from_cell(const void* cell) {
+    return reinterpret_cast<HeapPage*>(
+        reinterpret_cast<uintptr_t>(cell) & ~static_cast<uintptr_t>(PAGE_SIZE - 1));
+  }
+
+  /**
+   * @brief Take a cell from the page
+   * @return Uninitialized cell, or nullptr if the page is full
+   */
+  void* allocate() {
+    void* cell;
+    if (free_list_) {
+      cell = free_list_;
+      free_list_ = free_list_->next;
+    } else if (bump_ < end_) {
+      cell = bump_;
+      bump_ += cell_size_;
+    } else {
+      return nullptr;
+    }
+    ++live_count_;
+    allocated_bits_[word_index(cell)] |= bit_mask(cell);
+    return cell;
+  }
+
+  /**
+   * @brief Check whether the last mark phase reached the object in a cell
+   */
+  bool is_marked(const void* cell) const {
+    return mark_bits_[word_index(cell)] & bit_mask(cell);
+  }
+
+  /**
+   * @brief Mark the object in a cell
+   * @return true if it was not marked before
+   */
+  bool mark(const void* cell) {
+    uint64_t& word = mark_bits_[word_index(cell)];
+    uint64_t mask = bit_mask(cell);
+    if (word & mask) {
+      return false;
+    }
+    word |= mask;
+    return true;
+  }
+
+  /**
+   * @brief Mark the object in a cell, racing other marking threads
+   * @return true if this call set the mark
+   */
+  bool mark_atomic(const void* cell) {
+    std::atomic_ref<uint64_t> word(mark_bits_[word_index(cell)]);
+    uint64_t mask = bit_mask(cell);
+    if (word.load(std::memory_order_relaxed) & mask) {
+      return false;
+    }
+    return !(word.fetch_or(mask, std::memory_order_relaxed) & mask);
+  }
+
+  /**
+   * @brief Destroy the unmarked objects, free their cells and clear the mark bitmap
+   * @param destroy Called with each dead cell before it is freed
+   */
+  template <typename Destroy>
+  void sweep(Destroy&& destroy) {
+    for (size_t index = 0; index < BITMAP_WORDS; ++index) {
+      uint64_t dead = allocated_bits_[index] & ~mark_bits_[index];
+      allocated_bits_[index] &= mark_bits_[index];
+      mark_bits_[index] = 0;
+      while (dead) {
+        size_t bit = static_cast<size_t>(std::countr_zero(dead));
+        dead &= dead - 1;
+        void* cell = reinterpret_cast<char*>(this) + (index * 64 + bit) * SizeClasses::GRANULE;
+        destroy(cell);
+        release(cell);
+      }
+    }
+  }
+
+  /**
+   * @brief Call a function with every cell that holds an object
+   */
+  template <typename Visit>
+  void for_each_object(Visit&& visit) {
+    for (size_t index = 0; index < BITMAP_WORDS; ++index) {
+      for (uint64_t bits = allocated_bits_[index]; bits; bits &= bits - 1) {
+        size_t bit = static_cast<size_t>(std::countr_zero(bits));
+        visit(reinterpret_cast<char*>(this) + (index * 64 + bit) * SizeClasses::GRANULE);
+      }
+    }
+  }
+
+  uint8_t size_class() const {
+    return size_class_;
+  }
+
+  uint32_t cell_size() const {
+    return cell_size_;
+  }
+
+  uint32_t live_count() const {
+    return live_count_;
+  }
+
+  /**
+   * @brief Number of cells the page can hold
+   */
+  uint32_t capacity() const {
+    return static_cast<uint32_t>((PAGE_SIZE - header_size()) / cell_size_);
+  }
+
+  bool is_empty() const {
+    return live_count_ == 0;
+  }
+
+  bool has_free_cells() const {
+    return free_list_ || bump_ < end_;
+  }
+
+  /**
+   * @brief Flag the page as holding garbage from the last mark phase
+   */
+  void set_sweep_pending() {
+    sweep_state_.store(SweepState::PENDING, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Take the right to sweep a pending page
+   * @return true if the caller must now sweep the page and call finish_sweep
+   */
+  bool try_claim_sweep() {
+    SweepState expected = SweepState::PENDING;
+    return sweep_state_.compare_exchange_strong(expected, SweepState::SWEEPING,
+                                                std::memory_order_acquire);
+  }
+
+  /**
+   * @brief Publish the result of sweeping a claimed page
+   */
+  void finish_sweep() {
+    sweep_state_.store(SweepState::SWEPT, std::memory_order_release);
+  }
+
+  /**
+   * @brief Wait until another thread has finished sweeping the page
+   */
+  void wait_swept() const {
+    while (sweep_state_.load(std::memory_order_acquire) != SweepState::SWEPT) {
+      std::this_thread::yield();
+    }
+  }
+
+private:
+  static constexpr size_t BITMAP_WORDS = PAGE_SIZE / SizeClasses::GRANULE / 64;
+
+  /**
+   * @brief Progress of the page through the current sweep
+   */
+  enum class SweepState : uint8_t {
+    SWEPT,     ///< Holds no garbage the sweeper knows about
+    PENDING,   ///< Unmarked objects still need to be freed
+    SWEEPING,  ///< Claimed by a thread that is freeing them
+  };
+
+
+  struct FreeCell {
+    FreeCell* next;
+  };
+
+  std::array<uint64_t, BITMAP_WORDS> allocated_bits_;  ///< Cells holding objects
+  std::array<uint64_t, BITMAP_WORDS> mark_bits_;       ///< Cells reached by the last mark phase
+  char* bump_;                                         ///< Next never-used cell
+  char* end_;                                          ///< End of the last whole cell in the page
+  FreeCell* free_list_;                                ///< Cells freed by the sweeper
+  std::atomic<SweepState> sweep_state_;                ///< Whether the page still needs sweeping
+  uint32_t cell_size_;                                 ///< Size of every cell in bytes
+  uint32_t live_count_;                                ///< Number of cells holding objects
+  uint8_t size_class_;                                 ///< Index into SizeClasses::CELL_SIZES
+
+  explicit HeapPage(uint8_t size_class);
+
+  /**
+   * @brief Give a cell back to the page after its object has been destroyed
+   */
+  void release(void* cell) {
+    allocated_bits_[word_index(cell)] &= ~bit_mask(cell);
+    auto* free_cell = static_cast<FreeCell*>(cell);
+    free_cell->next = free_list_;
+    free_list_ = free_cell;
+    --live_count_;
+  }
+
+  static size_t granule_index(const void* cell) {
+    return (reinterpret_cast<uintptr_t>(cell) & (PAGE_SIZE - 1)) / SizeClasses::GRANULE;
+  }
+
+  static size_t word_index(const void* cell) {
+    return granule_index(cell) / 64;
+  }
+
+  static uint64_t bit_mask(const void* cell) {
+    return uint64_t{1} << (granule_index(cell) % 64);
+  }
+
+  char* cells_begin() {
+    return reinterpret_cast<char*>(this) + header_size();
+  }
+
+  static constexpr size_t header_size() {
+    return (sizeof(HeapPage) + SizeClasses::GRANULE - 1) & ~(SizeClasses::GRANULE - 1);
+  }
+};
@@ -0,0 +1,132 @@
+/**
+ * @file heap_snapshot.cpp
+ * @brief Implementation of heap snapshots
+ */
+
+#include "heap_snapshot.hpp"
+
+#include <ostream>
+
+#include "environment.hpp"
+#include "gc_dispatch.hpp"
+
+namespace {
+
+/**
+ * @brief Longest prefix of a string's value kept as its node name
+ */
+constexpr size_t MAX_STRING_NAME = 40;
+
+/**
+ * @brief Write a string as a JSON string literal
+ */
+void write_json_string(std::ostream& out, const std::string& text) {
+  static const char* const HEX_DIGITS = "0123456789abcdef";
+  out << '"';
+  for (char c : text) {
+    auto byte = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (byte < 0x20) {
+      out << "\\u00" << HEX_DIGITS[byte >> 4] << HEX_DIGITS[byte & 0xf];
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+}  // namespace
+
+HeapSnapshot::HeapSnapshot() : current_(0) {
+  nodes_.push_back(Node{"(roots)", 0, "", nullptr, nullptr});
+}
+
+void HeapSnapshot::add_edge(GCObject* target) {
+  add_edge_to(target);
+}
+
+void HeapSnapshot::add_edge(Environment* target) {
+  add_edge_to(target);
+}
+
+template <typename T>
+void HeapSnapshot::add_edge_to(T* target) {
+  auto [it, inserted] = ids_.try_emplace(target, static_cast<uint32_t>(nodes_.size()));
+  if (inserted) {
+    nodes_.push_back(describe(target));
+  }
+  edges_.push_back(Edge{current_, it->second, edge_name_});
+}
+
+HeapSnapshot::Node HeapSnapshot::describe(GCObject* obj) {
+  Node node{gc_tag_name(obj->tag), obj->alloc_size + gc_object_payload_size(obj), "", obj,
+            nullptr};
+  switch (obj->tag) {
+    case GCTag::STRING:
+      node.name = static_cast<PEBBLString*>(obj)->value.substr(0, MAX_STRING_NAME);
+      break;
+    case GCTag::FUNCTION:
+      node.name = static_cast<PEBBLFunction*>(obj)->name;
+      break;
+    case GCTag::CLOSURE:
+      if (PEBBLFunction* function = static_cast<PEBBLClosure*>(obj)->function) {
+        node.name = function->name;
+      }
+      break;
+    case GCTag::BUILTIN_FUNCTION:
+      node.name = static_cast<PEBBLBuiltinFunction*>(obj)->name;
+      break;
+    default:
+      break;
+  }
+  return node;
+}
+
+HeapSnapshot::Node HeapSnapshot::describe(Environment* env) {
+  return Node{"environment", sizeof(Environment) + env->payload_size(), "", nullptr, env};
+}
+
+void HeapSnapshot::build(Tracer& tracer) {
+  // Expanding a node appends the nodes it discovers, so this runs until the graph is closed
+  for (size_t index = 1; index < nodes_.size(); ++index) {
+    current_ = static_cast<uint32_t>(index);
+    if (GCObject* obj = nodes_[index].object) {
+      trace_gc_object(obj, tracer);
+    } else {
+      expand_environment(nodes_[index].environment);
+    }
+  }
+}
+
+void HeapSnapshot::expand_environment(Environment* env) {
+  env->for_each_variable([this](const std::string& name, PEBBLObject value) {
+    if (value.is_gc_ptr()) {
+      edge_name_ = name;
+      add_edge(value.as_gc_ptr());
+    }
+  });
+  if (Environment* parent = env->get_parent().get()) {
+    edge_name_ = "(parent)";
+    add_edge(parent);
+  }
+  edge_name_.clear();
+}
+
+void HeapSnapshot::write(std::ostream& out) const {
+  out << "{\"nodes\": [";
+  for (size_t index = 0; index < nodes_.size(); ++index) {
+    const Node& node = nodes_[index];
+    out << (index == 0 ? "\n" : ",\n") << "[\"" << node.type << "\", " << node.size << ", ";
+    write_json_string(out, node.name);
+    out << "]";
+  }
+  out << "],\n\"edges\": [";
+  for (size_t index = 0; index < edges_.size(); ++index) {
+    const Edge& edge = edges_[index];
+    out << (index == 0 ? "\n" : ",\n") << "[" << edge.from << ", " << edge.to << ", ";
+    write_json_string(out, edge.name);
+    out << "]";
+  }
+  out << "]}\n";
+}
@@ -0,0 +1,115 @@
+/**
+ * @file heap_snapshot.hpp
+ * @brief Graph of the live heap, written out for offline analysis
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct GCObject;
+class Environment;
+class Tracer;
+
+/**
+ * @brief Object graph of everything reachable from the GC roots
+ *
+ * Nodes are heap objects and the reference-counted Environments that functions capture, which
+ * keep values alive without being collected themselves; edges are the references between them.
+ * Node 0 stands for the roots. The graph is discovered by a Tracer in SNAPSHOT mode, which
+ * reports each reference here instead of marking or moving anything, so a snapshot can be
+ * taken whenever the mutator could allocate.
+ *
+ * write() produces JSON of the form
+ *
+ *     {"nodes": [[type, self_size, name], ...], "edges": [[from, to, name], ...]}
+ *
+ * with nodes identified by their index. Edges out of an environment are named after the
+ * variable holding the reference, or "(parent)" for the enclosing scope; other names are
+ * empty. tools/heap_analyzer.py computes dominators and retained sizes from the file.
+ */
+class HeapSnapshot {
+public:
+  HeapSnapshot();
+
+  /**
+   * @brief Record a reference from the node being expanded to an object
+   */
+  void add_edge(GCObject* target);
+
+  /**
+   * @brief Record a reference from the node being expanded to an environment
+   */
+  void add_edge(Environment* target);
+
+  /**
+   * @brief Record the references of every node discovered so far, until no new ones appear
+   * @param tracer SNAPSHOT-mode tracer reporting to this snapshot, which has traced the roots
+   */
+  void build(Tracer& tracer);
+
+  /**
+   * @brief Write the graph as JSON
+   */
+  void write(std::ostream& out) const;
+
+  /**
+   * @brief Number of nodes, the roots included
+   */
+  size_t node_count() const {
+    return nodes_.size();
+  }
+
+private:
+  /**
+   * @brief Object or environment in the graph
+   */
+  struct Node {
+    const char* type;          ///< GC tag name, "environment" or "(roots)"
+    size_t size;               ///< Bytes owned by the node alone, payload included
+    std::string name;          ///< Function name or string prefix, if any
+    GCObject* object;          ///< The object, if the node is one
+    Environment* environment;  ///< The environment, if the node is one
+  };
+
+  /**
+   * @brief Reference from one node to another
+   */
+  struct Edge {
+    uint32_t from;     ///< Referencing node
+    uint32_t to;       ///< Referenced node
+    std::string name;  ///< Variable name for edges out of environments
+  };
+
+  /**
+   * @brief Add an edge from the current node, creating the target node on first sight
+   */
+  template <typename T>
+  void add_edge_to(T* target);
+
+  /**
+   * @brief Create the node of an object
+   */
+  static Node describe(GCObject* obj);
+
+  /**
+   * @brief Create the node of an environment
+   */
+  static Node describe(Environment* env);
+
+  /**
+   * @brief Record the variables and parent of an environment
+   */
+  void expand_environment(Environment* env);
+
+  std::vector<Node> nodes_;                        ///< Nodes in discovery order
+  std::vector<Edge> edges_;                        ///< Every reference found
+  std::unordered_map<const void*, uint32_t> ids_;  ///< Node index of each address
+  uint32_t current_;                               ///< Node whose references are being recorded
+  std::string edge_name_;                          ///< Name given to edges being recorded
+};
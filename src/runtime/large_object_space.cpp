@@ -0,0 +1,43 @@
+/**
+ * @file large_object_space.cpp
+ * @brief Implementation of page-granular payload storage
+ */
+
+#include "large_object_space.hpp"
+
+#include <new>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace LargeObjectSpace {
+
+void* allocate_pages(size_t bytes) {
+#ifdef _MSC_VER
+  void* memory = _aligned_malloc(round_to_pages(bytes), PAGE_BYTES);
+  if (!memory) {
+    throw std::bad_alloc();
+  }
+#else
+  void* memory = mmap(nullptr, round_to_pages(bytes), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+#endif
+  return memory;
+}
+
+void release_pages(void* memory, size_t bytes) {
+#ifdef _MSC_VER
+  (void)bytes;
+  _aligned_free(memory);
+#else
+  munmap(memory, round_to_pages(bytes));
+#endif
+}
+
+}  // namespace LargeObjectSpace
@@ -0,0 +1,83 @@
+/**
+ * @file large_object_space.hpp
+ * @brief Page-granular storage for the large payloads of GC objects
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+/**
+ * @brief Memory for payload blocks too big to share malloc's arenas
+ *
+ * Blocks of at least MIN_PAYLOAD_BYTES are mapped straight from the OS in whole pages and
+ * unmapped as soon as they are freed, so a huge array neither fragments the allocator nor
+ * lingers after it dies. The objects owning such blocks stay in the regular heap; moving an
+ * object only hands its block over, never copies it. The collector schedules these bytes
+ * separately from small objects (see GCHeap::is_large_payload).
+ */
+namespace LargeObjectSpace {
+
+constexpr size_t PAGE_BYTES = 4096;              ///< Allocation granularity
+constexpr size_t MIN_PAYLOAD_BYTES = 64 * 1024;  ///< Smallest block served by this space
+
+/**
+ * @brief Round a block size up to whole pages
+ */
+constexpr size_t round_to_pages(size_t bytes) {
+  return (bytes + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1);
+}
+
+/**
+ * @brief Map a block of whole pages
+ * @throws std::bad_alloc if the OS refuses the mapping
+ */
+void* allocate_pages(size_t bytes);
+
+/**
+ * @brief Return a block obtained from allocate_pages to the OS
+ * @param bytes The size the block was allocated with
+ */
+void release_pages(void* memory, size_t bytes);
+
+}  // namespace LargeObjectSpace
+
+/**
+ * @brief Standard allocator sending large blocks to the LargeObjectSpace
+ *
+ * Smaller blocks come from std::allocator as usual. Stateless, so containers using it move
+ * their storage without copying.
+ */
+template <typename T>
+struct PayloadAllocator {
+  using value_type = T;
+
+  PayloadAllocator() = default;
+
+  template <typename U>
+  PayloadAllocator(const PayloadAllocator<U>& /* other */) {
+  }
+
+  T* allocate(size_t count) {
+    size_t bytes = count * sizeof(T);
+    if (bytes >= LargeObjectSpace::MIN_PAYLOAD_BYTES) {
+      return static_cast<T*>(LargeObjectSpace::allocate_pages(bytes));
+    }
+    return std::allocator<T>().allocate(count);
+  }
+
+  void deallocate(T* memory, size_t count) {
+    size_t bytes = count * sizeof(T);
+    if (bytes >= LargeObjectSpace::MIN_PAYLOAD_BYTES) {
+      LargeObjectSpace::release_pages(memory, bytes);
+      return;
+    }
+    std::allocator<T>().deallocate(memory, count);
+  }
+
+  template <typename U>
+  bool operator==(const PayloadAllocator<U>& /* other */) const {
+    return true;
+  }
+};
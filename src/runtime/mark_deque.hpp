@@ -0,0 +1,140 @@
+/**
+ * @file mark_deque.hpp
+ * @brief Work-stealing deque holding the grey objects of one parallel marking thread
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct GCObject;
+
+/**
+ * @brief Chase-Lev work-stealing deque of objects waiting to be traced
+ *
+ * The owning thread pushes and pops at the bottom without contention; other threads steal from
+ * the top when they run out of work. The buffer grows on demand; outgrown buffers are kept until
+ * the deque is destroyed, since a thief may still be reading from one.
+ */
+class MarkDeque {
+public:
+  MarkDeque() : top_(0), bottom_(0) {
+    buffers_.push_back(std::make_unique<Buffer>(INITIAL_CAPACITY));
+    buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+  }
+
+  MarkDeque(const MarkDeque&) = delete;
+  MarkDeque& operator=(const MarkDeque&) = delete;
+
+  /**
+   * @brief Add an object at the bottom (owner only)
+   */
+  void push(GCObject* obj) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_acquire);
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+    if (bottom - top >= buffer->capacity) {
+      buffer = grow(buffer, top, bottom);
+    }
+    buffer->put(bottom, obj);
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  /**
+   * @brief Take the most recently pushed object (owner only)
+   * @return The object, or nullptr if the deque is empty
+   */
+  GCObject* pop() {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_seq_cst);
+
+    if (top > bottom) {
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    GCObject* obj = buffer->get(bottom);
+    if (top == bottom) {
+      // Last object: race the thieves for it
+      if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        obj = nullptr;
+      }
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return obj;
+  }
+
+  /**
+   * @brief Take the oldest object (any thread)
+   * @return The object, or nullptr if the deque was empty or another thread won the race
+   */
+  GCObject* steal() {
+    int64_t top = top_.load(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_seq_cst);
+    if (top >= bottom) {
+      return nullptr;
+    }
+
+    Buffer* buffer = buffer_.load(std::memory_order_acquire);
+    GCObject* obj = buffer->get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return obj;
+  }
+
+  /**
+   * @brief Check whether the deque looks empty (may be stale by the time it returns)
+   */
+  bool empty() const {
+    return bottom_.load(std::memory_order_acquire) <= top_.load(std::memory_order_acquire);
+  }
+
+private:
+  static constexpr int64_t INITIAL_CAPACITY = 1024;
+
+  /**
+   * @brief Circular array of slots; capacity is a power of two
+   */
+  struct Buffer {
+    int64_t capacity;                                ///< Number of slots
+    std::unique_ptr<std::atomic<GCObject*>[]> slots;  ///< Slot storage
+
+    explicit Buffer(int64_t size) :
+        capacity(size), slots(std::make_unique<std::atomic<GCObject*>[]>(size)) {
+    }
+
+    GCObject* get(int64_t index) const {
+      return slots[index & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+
+    void put(int64_t index, GCObject* obj) {
+      slots[index & (capacity - 1)].store(obj, std::memory_order_relaxed);
+    }
+  };
+
+  std::atomic<int64_t> top_;                     ///< Next index thieves take from
+  std::atomic<int64_t> bottom_;                  ///< Next index the owner pushes to
+  std::atomic<Buffer*> buffer_;                  ///< Current buffer
+  std::vector<std::unique_ptr<Buffer>> buffers_;  ///< Every buffer ever used, owned by the deque
+
+  /**
+   * @brief Replace a full buffer with one twice its size (owner only)
+   */
+  Buffer* grow(Buffer* old_buffer, int64_t top, int64_t bottom) {
+    buffers_.push_back(std::make_unique<Buffer>(old_buffer->capacity * 2));
+    Buffer* buffer = buffers_.back().get();
+    for (int64_t i = top; i < bottom; ++i) {
+      buffer->put(i, old_buffer->get(i));
+    }
+    buffer_.store(buffer, std::memory_order_release);
+    return buffer;
+  }
+};
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <bit>
 #include <cstdint>
 
 struct GCObject;
@@ -166,4 +167,93 @@ struct PEBBLObject {
    * @return The GC pointer (undefined behavior if not a GC pointer)
    */
   GCObject* as_gc_ptr() const;
-};
\ No newline at end of file
+};
+
+// The accessors below sit on the hot path of both the VM dispatch loop and the tree-walker, so
+// they are defined inline here rather than out of line in a separate translation unit.
+
+inline PEBBLObject PEBBLObject::make_double(double value) {
+  PEBBLObject obj;
+  obj.bits = std::bit_cast<uint64_t>(value);
+  return obj;
+}
+
+inline PEBBLObject PEBBLObject::make_int32(int32_t value) {
+  PEBBLObject obj;
+  obj.bits = BOXED_BASE | (static_cast<uint64_t>(Tag::INT32) << TAG_SHIFT) |
+             (static_cast<uint64_t>(value) & PAYLOAD_MASK);
+  return obj;
+}
+
+inline PEBBLObject PEBBLObject::make_bool(bool value) {
+  PEBBLObject obj;
+  obj.bits = BOXED_BASE | (static_cast<uint64_t>(Tag::BOOL) << TAG_SHIFT) | (value ? 1ULL : 0ULL);
+  return obj;
+}
+
+inline PEBBLObject PEBBLObject::make_null() {
+  PEBBLObject obj;
+  obj.bits = BOXED_BASE | (static_cast<uint64_t>(Tag::NIL) << TAG_SHIFT);
+  return obj;
+}
+
+inline PEBBLObject PEBBLObject::make_undefined() {
+  PEBBLObject obj;
+  obj.bits = BOXED_BASE | (static_cast<uint64_t>(Tag::UNDEFINED) << TAG_SHIFT);
+  return obj;
+}
+
+inline PEBBLObject PEBBLObject::make_gc_ptr(GCObject* ptr) {
+  PEBBLObject obj;
+  obj.bits = BOXED_BASE | (static_cast<uint64_t>(Tag::GC_PTR) << TAG_SHIFT) |
+             (reinterpret_cast<uintptr_t>(ptr) & PAYLOAD_MASK);
+  return obj;
+}
+
+inline bool PEBBLObject::is_double() const {
+  return (bits & EXP_MASK) != EXP_MASK;
+}
+
+inline bool PEBBLObject::is_boxed() const {
+  return (bits & BOXED_BASE) == BOXED_BASE;
+}
+
+inline PEBBLObject::Tag PEBBLObject::get_tag() const {
+  return static_cast<Tag>((bits & TAG_MASK) >> TAG_SHIFT);
+}
+
+inline bool PEBBLObject::is_int32() const {
+  return is_boxed() && get_tag() == Tag::INT32;
+}
+
+inline bool PEBBLObject::is_bool() const {
+  return is_boxed() && get_tag() == Tag::BOOL;
+}
+
+inline bool PEBBLObject::is_null() const {
+  return is_boxed() && get_tag() == Tag::NIL;
+}
+
+inline bool PEBBLObject::is_undefined() const {
+  return is_boxed() && get_tag() == Tag::UNDEFINED;
+}
+
+inline bool PEBBLObject::is_gc_ptr() const {
+  return is_boxed() && get_tag() == Tag::GC_PTR;
+}
+
+inline double PEBBLObject::as_double() const {
+  return std::bit_cast<double>(bits);
+}
+
+inline int32_t PEBBLObject::as_int32() const {
+  return static_cast<int32_t>(bits & PAYLOAD_MASK);
+}
+
+inline bool PEBBLObject::as_bool() const {
+  return (bits & PAYLOAD_MASK) != 0;
+}
+
+inline GCObject* PEBBLObject::as_gc_ptr() const {
+  return reinterpret_cast<GCObject*>(bits & PAYLOAD_MASK);
+}
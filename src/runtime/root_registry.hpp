@@ -0,0 +1,78 @@
+/**
+ * @file root_registry.hpp
+ * @brief Packed set of GC roots that can be registered and removed in constant time
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Stable identifier of an entry in a RootRegistry, handed out when it is added
+ */
+using RootToken = size_t;
+
+/**
+ * @brief Unordered collection of roots addressed by RootToken
+ *
+ * Entries are kept packed so the collector visits only live ones. Removing an entry moves the
+ * last one into its place; a token-to-position table keeps every other token valid, and freed
+ * tokens are reused by later additions.
+ */
+template <typename T>
+class RootRegistry {
+public:
+  /**
+   * @brief Register an entry
+   * @return Token that removes the entry again
+   */
+  RootToken add(T entry) {
+    RootToken token;
+    if (free_tokens_.empty()) {
+      token = positions_.size();
+      positions_.push_back(entries_.size());
+    } else {
+      token = free_tokens_.back();
+      free_tokens_.pop_back();
+      positions_[token] = entries_.size();
+    }
+    entries_.push_back(std::move(entry));
+    tokens_.push_back(token);
+    return token;
+  }
+
+  /**
+   * @brief Unregister the entry a token was handed out for
+   */
+  void remove(RootToken token) {
+    size_t position = positions_[token];
+
+    // Swap the last entry into the vacated position
+    if (position != entries_.size() - 1) {
+      entries_[position] = std::move(entries_.back());
+      tokens_[position] = tokens_.back();
+      positions_[tokens_[position]] = position;
+    }
+    entries_.pop_back();
+    tokens_.pop_back();
+    free_tokens_.push_back(token);
+  }
+
+  /**
+   * @brief Call a function with every registered entry
+   */
+  template <typename Visit>
+  void for_each(Visit&& visit) {
+    for (T& entry : entries_) {
+      visit(entry);
+    }
+  }
+
+private:
+  std::vector<T> entries_;              ///< Registered entries, packed
+  std::vector<RootToken> tokens_;       ///< Token of each entry, parallel to entries_
+  std::vector<size_t> positions_;       ///< Index into entries_ of each token in use
+  std::vector<RootToken> free_tokens_;  ///< Tokens of removed entries, ready for reuse
+};
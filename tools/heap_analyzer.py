@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Summarize a PEBBL heap snapshot written by --heap-snapshot=<path> or heap_snapshot(path).
+
+Computes the dominator tree of the object graph and each node's retained size: the bytes that
+would be freed if nothing but its dominator path referenced it. The largest retainers are
+listed with a shortest path from the roots, so a function keeping a whole environment chain
+alive shows up as the environment (or function) retaining it.
+
+Usage: heap_analyzer.py snapshot.json [--top N] [--type TYPE]
+"""
+
+import argparse
+import collections
+import json
+import sys
+
+
+def load(path):
+    with open(path) as file:
+        snapshot = json.load(file)
+    nodes = snapshot["nodes"]
+    successors = [[] for _ in nodes]
+    for source, target, name in snapshot["edges"]:
+        successors[source].append((target, name))
+    return nodes, successors
+
+
+def depth_first_order(successors):
+    """Reverse postorder of the nodes reachable from the roots (node 0)."""
+    postorder = []
+    visited = [False] * len(successors)
+    visited[0] = True
+    stack = [(0, iter(successors[0]))]
+    while stack:
+        node, children = stack[-1]
+        for child, _ in children:
+            if not visited[child]:
+                visited[child] = True
+                stack.append((child, iter(successors[child])))
+                break
+        else:
+            stack.pop()
+            postorder.append(node)
+    postorder.reverse()
+    return postorder
+
+
+def dominators(successors):
+    """Immediate dominator of every reachable node (Cooper, Harvey and Kennedy's algorithm)."""
+    order = depth_first_order(successors)
+    position = {node: index for index, node in enumerate(order)}
+    predecessors = collections.defaultdict(list)
+    for node in order:
+        for child, _ in successors[node]:
+            predecessors[child].append(node)
+
+    idom = {0: 0}
+
+    def intersect(a, b):
+        while a != b:
+            while position[a] > position[b]:
+                a = idom[a]
+            while position[b] > position[a]:
+                b = idom[b]
+        return a
+
+    changed = True
+    while changed:
+        changed = False
+        for node in order[1:]:
+            new_idom = None
+            for predecessor in predecessors[node]:
+                if predecessor in idom:
+                    new_idom = predecessor if new_idom is None else intersect(predecessor, new_idom)
+            if idom.get(node) != new_idom:
+                idom[node] = new_idom
+                changed = True
+    return idom, order
+
+
+def retained_sizes(nodes, idom, order):
+    retained = {node: nodes[node][1] for node in order}
+    # Children come after their dominators in reverse postorder, so walking it backwards
+    # finishes every subtree before adding it to its parent
+    for node in reversed(order[1:]):
+        retained[idom[node]] += retained[node]
+    return retained
+
+
+def shortest_paths(successors):
+    """Parent edge of every reachable node on a shortest path from the roots."""
+    parents = {0: None}
+    queue = collections.deque([0])
+    while queue:
+        node = queue.popleft()
+        for child, name in successors[node]:
+            if child not in parents:
+                parents[child] = (node, name)
+                queue.append(child)
+    return parents
+
+
+def describe(nodes, node):
+    node_type, _, name = nodes[node]
+    return f"{node_type} '{name}'" if name else node_type
+
+
+def path_to(nodes, parents, node):
+    steps = []
+    while parents[node] is not None:
+        parent, name = parents[node]
+        steps.append((f".{name}" if name else "") + " -> " + describe(nodes, node))
+        node = parent
+    return "(roots)" + "".join(reversed(steps))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Find what retains memory in a heap snapshot")
+    parser.add_argument("snapshot", help="JSON file written by pebbli")
+    parser.add_argument("--top", type=int, default=20, help="number of retainers to list")
+    parser.add_argument("--type", help="only list nodes of this type, e.g. environment")
+    args = parser.parse_args()
+
+    nodes, successors = load(args.snapshot)
+    idom, order = dominators(successors)
+    retained = retained_sizes(nodes, idom, order)
+    parents = shortest_paths(successors)
+
+    print(f"{len(order) - 1} reachable nodes, {retained[0]} bytes")
+    print()
+    print(f"{'type':<18}{'count':>10}{'self bytes':>14}")
+    totals = collections.defaultdict(lambda: [0, 0])
+    for node in order[1:]:
+        totals[nodes[node][0]][0] += 1
+        totals[nodes[node][0]][1] += nodes[node][1]
+    for node_type, (count, size) in sorted(totals.items(), key=lambda item: -item[1][1]):
+        print(f"{node_type:<18}{count:>10}{size:>14}")
+
+    candidates = [node for node in order[1:] if args.type is None or nodes[node][0] == args.type]
+    candidates.sort(key=lambda node: -retained[node])
+    print()
+    print(f"{'retained':>12}{'self':>10}  node and shortest path from the roots")
+    for node in candidates[: args.top]:
+        print(f"{retained[node]:>12}{nodes[node][1]:>10}  {describe(nodes, node)}")
+        print(f"{'':>24}{path_to(nodes, parents, node)}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())